@@ -0,0 +1,478 @@
+#include "qs_http.h"
+
+#include <intrin.h>
+#if defined(_M_IX86) || defined(_M_X64)
+#include <emmintrin.h>
+#define HAVE_SSE2
+#endif
+
+// First '\n' in [p, end), NULL if there is none. With SSE2 16 bytes are compared at once.
+static const char *find_newline(const char *p, const char *end)
+{
+#if defined(HAVE_SSE2)
+	const __m128i lf = _mm_set1_epi8('\n');
+	unsigned long bit;
+	int mask;
+	while(end - p >= 16)
+	{
+		mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p), lf));
+		if(mask)
+		{
+			_BitScanForward(&bit, (unsigned long)mask);
+			return p + bit;
+		}
+		p += 16;
+	}
+#endif
+	return (const char *)memchr(p, '\n', (size_t)(end - p));
+}
+
+// Length of the header block including the empty line, 0 if it is not complete yet.
+// Scanning resumes where the previous call stopped.
+static size_t find_header_end(qs_http_parser *parser, const char *data, size_t len)
+{
+	const char *end = data + len;
+	const char *p = data + parser->scanned;
+	const char *nl;
+
+	while((nl = find_newline(p, end)) != NULL)
+	{
+		if(nl + 1 < end && nl[1] == '\n') return nl + 2 - data;
+		if(nl + 2 < end && nl[1] == '\r' && nl[2] == '\n') return nl + 3 - data;
+		// The line after this newline is not complete, look at it again next time
+		if(nl + 2 >= end)
+		{
+			parser->scanned = (u_long)(nl - data);
+			return 0;
+		}
+		p = nl + 1;
+	}
+	parser->scanned = (u_long)len;
+	return 0;
+}
+
+static const char *line_end(const char *p, const char *end, const char **next)
+{
+	const char *nl = find_newline(p, end);
+	if(!nl) nl = end;
+	*next = nl < end ? nl + 1 : end;
+	return nl > p && nl[-1] == '\r' ? nl - 1 : nl;
+}
+
+static void trim(qs_http_str *s)
+{
+	while(s->len && (s->p[0] == ' ' || s->p[0] == '\t'))
+	{
+		s->p++;
+		s->len--;
+	}
+	while(s->len && (s->p[s->len - 1] == ' ' || s->p[s->len - 1] == '\t')) s->len--;
+}
+
+static BOOL str_equal(const qs_http_str *s, const char *value)
+{
+	size_t len = strlen(value);
+	return s->len == len && _strnicmp(s->p, value, len) == 0;
+}
+
+static qs_http_result parse_request_line(qs_http_request *r, const char *p, const char *end)
+{
+	const char *sp;
+
+	sp = (const char *)memchr(p, ' ', end - p);
+	if(!sp || sp == p) return qs_http_bad_request;
+	r->method.p = p;
+	r->method.len = sp - p;
+
+	p = sp + 1;
+	sp = (const char *)memchr(p, ' ', end - p);
+	if(!sp || sp == p) return qs_http_bad_request;
+	r->uri.p = p;
+	r->uri.len = sp - p;
+	r->path = r->uri;
+	r->query.p = NULL;
+	r->query.len = 0;
+	sp = (const char *)memchr(r->uri.p, '?', r->uri.len);
+	if(sp)
+	{
+		r->path.len = sp - r->uri.p;
+		r->query.p = sp + 1;
+		r->query.len = r->uri.len - r->path.len - 1;
+	}
+
+	p = r->uri.p + r->uri.len + 1;
+	if(end - p != 8 || memcmp(p, "HTTP/1.", 7) != 0 || p[7] < '0' || p[7] > '9') return qs_http_bad_request;
+	r->version_minor = p[7] - '0';
+	return qs_http_ok;
+}
+
+static qs_http_result parse_headers(qs_http_parser *parser, const char *data, size_t header_len)
+{
+	qs_http_request *r = &parser->request;
+	const char *end = data + header_len;
+	const char *p = data, *next, *le, *colon;
+	qs_http_header *h;
+	qs_http_result res;
+	BOOL have_length = FALSE;
+	size_t length;
+
+	le = line_end(p, end, &next);
+	if((res = parse_request_line(r, p, le)) != qs_http_ok) return res;
+	r->headers_count = 0;
+	r->content_length = 0;
+	r->keep_alive = r->version_minor >= 1;
+
+	for(p = next; p < end; p = next)
+	{
+		le = line_end(p, end, &next);
+		if(le == p) break;
+		// Obsolete line folding is rejected as RFC 7230 allows
+		if(*p == ' ' || *p == '\t') return qs_http_bad_request;
+		colon = (const char *)memchr(p, ':', le - p);
+		if(!colon || colon == p) return qs_http_bad_request;
+		if(r->headers_count == QS_HTTP_MAX_HEADERS) return qs_http_too_large;
+		h = &r->headers[r->headers_count++];
+		h->name.p = p;
+		h->name.len = colon - p;
+		if(h->name.p[h->name.len - 1] == ' ' || h->name.p[h->name.len - 1] == '\t') return qs_http_bad_request;
+		h->value.p = colon + 1;
+		h->value.len = le - colon - 1;
+		trim(&h->value);
+
+		if(str_equal(&h->name, "Content-Length"))
+		{
+			size_t i;
+			if(h->value.len == 0 || h->value.len > 15) return qs_http_bad_request;
+			for(i = 0, length = 0; i < h->value.len; ++i)
+			{
+				if(h->value.p[i] < '0' || h->value.p[i] > '9') return qs_http_bad_request;
+				length = length * 10 + (h->value.p[i] - '0');
+			}
+			if(have_length && length != r->content_length) return qs_http_bad_request;
+			r->content_length = length;
+			have_length = TRUE;
+		}
+		else if(str_equal(&h->name, "Transfer-Encoding"))
+		{
+			if(!str_equal(&h->value, "identity")) return qs_http_not_implemented;
+		}
+		else if(str_equal(&h->name, "Connection"))
+		{
+			if(str_equal(&h->value, "close")) r->keep_alive = FALSE;
+			else if(str_equal(&h->value, "keep-alive")) r->keep_alive = TRUE;
+		}
+	}
+	return qs_http_ok;
+}
+
+MYDLL_API void qs_http_parser_init(qs_http_parser *parser)
+{
+	memset(parser, 0, sizeof(qs_http_parser));
+}
+
+// Parses one request from the start of data. The parser remembers how far the
+// headers were scanned and whether they were already parsed, so calling it again
+// with more data continues instead of starting over.
+MYDLL_API qs_http_result qs_http_parse(qs_http_parser *parser, const char *data, size_t len, size_t *consumed)
+{
+	qs_http_request *r = &parser->request;
+	qs_http_result res;
+	size_t header_len;
+
+	*consumed = 0;
+	if(!parser->header_len)
+	{
+		// Empty lines in front of a request are ignored
+		while(len && (*data == '\r' || *data == '\n') && parser->scanned == 0)
+		{
+			++data;
+			--len;
+			++*consumed;
+		}
+		header_len = find_header_end(parser, data, len);
+		if(!header_len) return qs_http_incomplete;
+		if((res = parse_headers(parser, data, header_len)) != qs_http_ok) return res;
+		parser->header_len = (u_long)header_len;
+	}
+
+	if(len < parser->header_len + r->content_length) return qs_http_incomplete;
+	r->body.p = data + parser->header_len;
+	r->body.len = r->content_length;
+	*consumed += parser->header_len + r->content_length;
+	parser->header_len = 0;
+	parser->scanned = 0;
+	return qs_http_ok;
+}
+
+static void rebase(qs_http_str *s, size_t shift)
+{
+	if(s->p) s->p -= shift;
+}
+
+// Views of a request whose body is still missing follow the data when it is moved
+static void rebase_request(qs_http_request *r, size_t shift)
+{
+	size_t i;
+	rebase(&r->method, shift);
+	rebase(&r->uri, shift);
+	rebase(&r->path, shift);
+	rebase(&r->query, shift);
+	for(i = 0; i < r->headers_count; ++i)
+	{
+		rebase(&r->headers[i].name, shift);
+		rebase(&r->headers[i].value, shift);
+	}
+}
+
+// Processes the data of a completed receive posted by qs_http_recv(): every
+// complete request, pipelined ones included, is passed to on_request. An
+// incomplete request is moved to the start of the buffer, which is the only copy
+// made, and the next qs_http_recv() appends after it. Responses are best queued
+// with qs_http_response_reserve(); written into the connection buffer they must
+// start after the first parser->buffered bytes.
+MYDLL_API qs_http_result qs_http_on_recv(qs_http_parser *parser, connection *connection, QS_HTTP_REQUEST_PROC on_request, void *arg)
+{
+	char *base;
+	u_long size;
+	size_t left, used;
+	const char *p;
+	qs_http_result res = qs_http_ok;
+
+	if(!parser || !connection || !on_request) return qs_http_bad_request;
+	base = qs_buffer_base(connection, &size);
+	p = base;
+	left = parser->buffered + connection->bytes_transferred;
+
+	while(left)
+	{
+		res = qs_http_parse(parser, p, left, &used);
+		if(res == qs_http_incomplete)
+		{
+			// Skipped empty lines are dropped, the parser state is relative to what follows
+			p += used;
+			left -= used;
+			if(parser->header_len && parser->header_len + parser->request.content_length > size) return qs_http_too_large;
+			break;
+		}
+		if(res != qs_http_ok) return res;
+		p += used;
+		left -= used;
+		if(!on_request(connection, &parser->request, arg))
+		{
+			res = qs_http_stopped;
+			break;
+		}
+	}
+
+	if(res == qs_http_incomplete && left >= size) return qs_http_too_large;
+	if(left && p != base)
+	{
+		memmove(base, p, left);
+		if(parser->header_len) rebase_request(&parser->request, p - base);
+	}
+	parser->buffered = (u_long)left;
+	return res == qs_http_incomplete ? qs_http_ok : res;
+}
+
+// Posts a receive after the buffered part of an incomplete request
+MYDLL_API unsigned int qs_http_recv(qs_http_parser *parser, connection *connection)
+{
+	if(!parser) return ERROR_INVALID_PARAMETER;
+	return qs_recv_append(connection, parser->buffered);
+}
+
+MYDLL_API const qs_http_str *qs_http_get_header(const qs_http_request *request, const char *name)
+{
+	size_t i;
+	for(i = 0; i < request->headers_count; ++i)
+	{
+		if(str_equal(&request->headers[i].name, name)) return &request->headers[i].value;
+	}
+	return NULL;
+}
+
+#define HTTP_DATE_LENGTH 29
+
+typedef struct _status_line {
+	int status;
+	const char *text;           // status line followed by the Date header name
+	size_t len;
+} status_line;
+
+#define STATUS_LINE(status, reason) { status, "HTTP/1.1 " #status " " reason "\r\nDate: ", sizeof("HTTP/1.1 " #status " " reason "\r\nDate: ") - 1 }
+
+static const status_line status_lines[] = {
+	STATUS_LINE(200, "OK"),
+	STATUS_LINE(100, "Continue"),
+	STATUS_LINE(101, "Switching Protocols"),
+	STATUS_LINE(201, "Created"),
+	STATUS_LINE(202, "Accepted"),
+	STATUS_LINE(204, "No Content"),
+	STATUS_LINE(206, "Partial Content"),
+	STATUS_LINE(301, "Moved Permanently"),
+	STATUS_LINE(302, "Found"),
+	STATUS_LINE(304, "Not Modified"),
+	STATUS_LINE(307, "Temporary Redirect"),
+	STATUS_LINE(400, "Bad Request"),
+	STATUS_LINE(401, "Unauthorized"),
+	STATUS_LINE(403, "Forbidden"),
+	STATUS_LINE(404, "Not Found"),
+	STATUS_LINE(405, "Method Not Allowed"),
+	STATUS_LINE(408, "Request Timeout"),
+	STATUS_LINE(411, "Length Required"),
+	STATUS_LINE(413, "Payload Too Large"),
+	STATUS_LINE(414, "URI Too Long"),
+	STATUS_LINE(431, "Request Header Fields Too Large"),
+	STATUS_LINE(500, "Internal Server Error"),
+	STATUS_LINE(501, "Not Implemented"),
+	STATUS_LINE(503, "Service Unavailable"),
+	STATUS_LINE(505, "HTTP Version Not Supported")
+};
+
+typedef struct _header_block {
+	const char *text;
+	size_t len;
+} header_block;
+
+#define HEADER_BLOCK(text) { text, sizeof(text) - 1 }
+
+// Indexed by qs_http_content_type
+static const header_block content_types[] = {
+	HEADER_BLOCK(""),
+	HEADER_BLOCK("\r\nContent-Type: text/plain; charset=utf-8"),
+	HEADER_BLOCK("\r\nContent-Type: text/html; charset=utf-8"),
+	HEADER_BLOCK("\r\nContent-Type: application/json"),
+	HEADER_BLOCK("\r\nContent-Type: application/octet-stream")
+};
+
+static const header_block connection_close = HEADER_BLOCK("\r\nConnection: close");
+
+__inline static char *response_tail(qs_http_response *response, size_t len)
+{
+	if(response->size - response->len < len) return NULL;
+	return response->buf + response->len;
+}
+
+MYDLL_API void qs_http_response_init(qs_http_response *response, char *buf, u_long size)
+{
+	response->buf = buf;
+	response->size = size;
+	response->len = 0;
+}
+
+// Writes the status line, the Date header and the optional Content-Type and
+// Connection headers. The last header line is terminated by the next writer.
+MYDLL_API BOOL qs_http_write_status(qs_http_response *response, void *qs_instance, int status, qs_http_content_type content_type, BOOL keep_alive)
+{
+	// Codes missing from the table get an empty reason phrase
+	char unknown_text[] = "HTTP/1.1 000 \r\nDate: ";
+	status_line unknown = { status, unknown_text, sizeof(unknown_text) - 1 };
+	const status_line *line = &unknown;
+	const header_block *type;
+	const char *date;
+	char *p;
+	size_t i, len, line_len, date_len;
+
+	if(status < 100 || status > 999 || (u_int)content_type >= sizeof(content_types) / sizeof(content_types[0])) return FALSE;
+	for(i = 0; i < sizeof(status_lines) / sizeof(status_lines[0]); ++i)
+	{
+		if(status_lines[i].status == status)
+		{
+			line = &status_lines[i];
+			break;
+		}
+	}
+	if(line == &unknown)
+	{
+		unknown_text[9] = (char)('0' + status / 100);
+		unknown_text[10] = (char)('0' + status / 10 % 10);
+		unknown_text[11] = (char)('0' + status % 10);
+	}
+	type = &content_types[content_type];
+	// Without a running server there is no date and the Date header is left out
+	date = qs_instance ? qs_get_date(qs_instance) : NULL;
+	line_len = line->len;
+	date_len = HTTP_DATE_LENGTH;
+	if(!date || !date[0])
+	{
+		line_len -= sizeof("\r\nDate: ") - 1;
+		date_len = 0;
+	}
+
+	len = line_len + date_len + type->len + (keep_alive ? 0 : connection_close.len);
+	if(!(p = response_tail(response, len))) return FALSE;
+	memcpy(p, line->text, line_len);
+	p += line_len;
+	if(date_len) memcpy(p, date, date_len);
+	p += date_len;
+	memcpy(p, type->text, type->len);
+	p += type->len;
+	if(!keep_alive) memcpy(p, connection_close.text, connection_close.len);
+	response->len += (u_long)len;
+	return TRUE;
+}
+
+MYDLL_API BOOL qs_http_write_header(qs_http_response *response, const char *name, size_t name_len, const char *value, size_t value_len)
+{
+	char *p;
+	size_t len = name_len + value_len + 4;
+
+	if(!(p = response_tail(response, len))) return FALSE;
+	p[0] = '\r';
+	p[1] = '\n';
+	memcpy(p + 2, name, name_len);
+	p += 2 + name_len;
+	p[0] = ':';
+	p[1] = ' ';
+	memcpy(p + 2, value, value_len);
+	response->len += (u_long)len;
+	return TRUE;
+}
+
+// Writes Content-Length and the end of the headers and reserves content_length
+// bytes for the body. Returns where the body goes or NULL when it does not fit.
+MYDLL_API char* qs_http_end_headers(qs_http_response *response, size_t content_length)
+{
+	static const char header[] = "\r\nContent-Length: ";
+	char digits[20];
+	char *p;
+	size_t n = 0, len, value = content_length;
+
+	do
+	{
+		digits[sizeof(digits) - ++n] = (char)('0' + value % 10);
+		value /= 10;
+	} while(value);
+
+	len = sizeof(header) - 1 + n + 4;
+	if(!(p = response_tail(response, len + content_length))) return NULL;
+	memcpy(p, header, sizeof(header) - 1);
+	p += sizeof(header) - 1;
+	memcpy(p, digits + sizeof(digits) - n, n);
+	p += n;
+	memcpy(p, "\r\n\r\n", 4);
+	response->len += (u_long)(len + content_length);
+	return p + 4;
+}
+
+MYDLL_API BOOL qs_http_write_body(qs_http_response *response, const char *body, size_t len)
+{
+	char *p = qs_http_end_headers(response, len);
+	if(!p) return FALSE;
+	memcpy(p, body, len);
+	return TRUE;
+}
+
+MYDLL_API BOOL qs_http_response_reserve(qs_http_response *response, connection *connection)
+{
+	u_long available;
+	char *p = qs_send_reserve(connection, &available);
+	if(!p) return FALSE;
+	qs_http_response_init(response, p, available);
+	return TRUE;
+}
+
+MYDLL_API unsigned int qs_http_response_commit(qs_http_response *response, connection *connection)
+{
+	return qs_send_commit(connection, response->len);
+}
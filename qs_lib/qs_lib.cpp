@@ -6,10 +6,18 @@
 #endif
 
 #pragma comment(lib, "ws2_32.lib")
+#pragma comment(lib, "secur32.lib")
+#pragma comment(lib, "crypt32.lib")
+#pragma comment(lib, "bcrypt.lib")
 
 #include <process.h>
+#include <intrin.h>
 #include <time.h>
 #include <Mstcpip.h>
+#define SECURITY_WIN32
+#include <security.h>
+#include <schannel.h>
+#include <bcrypt.h>
 
 #define BUF_LEN 256
 #define HAVE_INET_NTOP
@@ -27,11 +35,21 @@
 
 using namespace nedalloc;
 
-typedef struct _connection_storage {
+// Connections are spread over shards by id, so accepts, disconnects and
+// broadcasts running on different workers rarely wait for the same lock
+#define STORAGE_SHARDS 16
+
+typedef struct _storage_shard {
 	connection **connections;
 	size_t count;
 	size_t size;
 	CRITICAL_SECTION cs;
+} storage_shard;
+
+typedef struct _connection_storage {
+	volatile LONG count;
+	size_t size;
+	storage_shard shards[STORAGE_SHARDS];
 } connection_storage;
 
 typedef enum _states {
@@ -43,7 +61,21 @@ typedef enum _states {
 	transmit_file,
 	start_server,
 	start_clean,
-	stop_server
+	stop_server,
+	retire_worker,
+	queue_probe,
+	frames_ready,
+	connect_done,
+	proxy_recv,
+	proxy_send,
+	udp_recv,
+	udp_send,
+	broadcast_shard,
+	broadcast_members,
+	broadcast_sent,
+	tls_handshake,
+	tls_handshake_sent,
+	writable
 } states;
 
 typedef enum _qs_status {
@@ -51,14 +83,217 @@ typedef enum _qs_status {
 	runned
 } qs_status;
 
+typedef enum _worker_state {
+	worker_free,
+	worker_running,
+	worker_retired
+} worker_state;
+
+struct _qs_context;
+
+// Log-linear histogram of microsecond values: 16 sub-buckets per power of two,
+// which keeps every recorded value within 6.25% of its bucket.
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_SUB_COUNT (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_MAX_BITS 36
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_COUNT)
+
+typedef struct _histogram {
+	ULONGLONG count;
+	ULONGLONG sum;
+	ULONGLONG min;
+	ULONGLONG max;
+	ULONGLONG buckets[HISTOGRAM_BUCKETS];
+} histogram;
+
+static u_long histogram_index(ULONGLONG value)
+{
+	u_long msb = 0;
+	if(value < HISTOGRAM_SUB_COUNT) return (u_long)value;
+	if(value >= ((ULONGLONG)1 << HISTOGRAM_MAX_BITS)) return HISTOGRAM_BUCKETS - 1;
+#if defined(_M_X64)
+	_BitScanReverse64(&msb, value);
+#else
+	if(value >> 32)
+	{
+		_BitScanReverse(&msb, (u_long)(value >> 32));
+		msb += 32;
+	}
+	else _BitScanReverse(&msb, (u_long)value);
+#endif
+	return (msb - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_COUNT + (u_long)((value >> (msb - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB_COUNT - 1));
+}
+
+// Highest value which falls into the bucket
+static ULONGLONG histogram_bucket_value(u_long index)
+{
+	u_long msb;
+	if(index < HISTOGRAM_SUB_COUNT) return index;
+	msb = index / HISTOGRAM_SUB_COUNT + HISTOGRAM_SUB_BITS - 1;
+	return (((ULONGLONG)(HISTOGRAM_SUB_COUNT + index % HISTOGRAM_SUB_COUNT) + 1) << (msb - HISTOGRAM_SUB_BITS)) - 1;
+}
+
+__inline static void histogram_record(histogram *h, ULONGLONG value)
+{
+	if(h->count == 0 || value < h->min) h->min = value;
+	if(value > h->max) h->max = value;
+	h->count++;
+	h->sum += value;
+	h->buckets[histogram_index(value)]++;
+}
+
+static void histogram_merge(histogram *to, const histogram *from)
+{
+	u_long i;
+	if(from->count == 0) return;
+	if(to->count == 0 || from->min < to->min) to->min = from->min;
+	if(from->max > to->max) to->max = from->max;
+	to->count += from->count;
+	to->sum += from->sum;
+	for(i = 0; i < HISTOGRAM_BUCKETS; ++i)
+	{
+		to->buckets[i] += from->buckets[i];
+	}
+}
+
+static ULONGLONG histogram_percentile(const histogram *h, double percentile)
+{
+	ULONGLONG rank, seen = 0;
+	u_long i;
+	if(h->count == 0) return 0;
+	rank = (ULONGLONG)(h->count * percentile / 100.0);
+	if(rank >= h->count) rank = h->count - 1;
+	for(i = 0; i < HISTOGRAM_BUCKETS; ++i)
+	{
+		seen += h->buckets[i];
+		if(seen > rank) break;
+	}
+	return i < HISTOGRAM_BUCKETS && histogram_bucket_value(i) < h->max ? histogram_bucket_value(i) : h->max;
+}
+
+// Fixed ring of the latest trace events. Timestamps are kept in performance
+// counter ticks and converted by qs_trace_snapshot. The head counts all events
+// written, 64 bits do not wrap in the lifetime of a server.
+#define TRACE_RING_SIZE 4096
+
+typedef struct _trace_ring {
+	volatile ULONGLONG head;
+	qs_trace_event events[TRACE_RING_SIZE];
+} trace_ring;
+
+// One slot of the worker pool. The counters are written only by the owning thread
+// without interlocked operations and read by the scaling controller and queries.
+// Slots are cache line aligned so that workers never share a line.
+typedef __declspec(align(64)) struct _worker {
+	struct _qs_context *server;
+	uintptr_t thread;
+	volatile LONG state;
+	unsigned int id;
+	qs_worker_stats stats;      // callbacks_time in performance counter ticks
+	volatile LONG histograms_epoch;
+	histogram histograms[qs_histogram_types_count];
+	trace_ring trace;
+	struct _io_context *delivering;     // connection inside on_recv or on_frames on this thread
+	BOOL issued;                        // the callback posted an operation of that connection
+} worker;
+
+typedef struct _scaling_state {
+	void *timer;
+	volatile LONG in_tick;
+	volatile LONG probe_pending;
+	LONGLONG probe_posted;
+	LONGLONG last_tick;
+	ULONGLONG last_busy_time;
+	ULONGLONG last_completions;
+	u_long quiet_ticks;
+} scaling_state;
+
+typedef struct _metrics_state {
+	SOCKET sock;
+	uintptr_t thread;
+	char *text;
+	size_t text_len;
+	histogram *scratch;
+} metrics_state;
+
+// Bounded multi-producer queue of error events with per-cell sequence numbers.
+// Producers are the I/O threads, the only consumer is the error logging thread.
+typedef struct _error_cell {
+	volatile LONG sequence;
+	qs_error_event event;
+} error_cell;
+
+typedef struct _error_queue {
+	error_cell *cells;
+	LONG mask;
+	__declspec(align(64)) volatile LONG enqueue_pos;
+	__declspec(align(64)) LONG dequeue_pos;
+	volatile LONG dropped;
+	HANDLE stop_event;
+	uintptr_t thread;
+} error_queue;
+
+// Listener with its settings resolved against the server wide ones
+typedef struct _listener_state {
+	struct socket socket;
+	u_long id;
+	qs_listener params;
+	qs_callbacks callbacks;
+	u_long buffer_size;
+	u_long ring_size;               // receive ring of its connections, 0 without rings
+	volatile LONG pending;          // AcceptEx() calls not completed
+	// AcceptEx() output shared by the pending accepts, the addresses are
+	// taken with getsockname() and getpeername() instead
+	BYTE addresses[2 * (sizeof(struct sockaddr_storage) + 16)];
+	BOOL tls;
+	CredHandle tls_cred;
+	PCCERT_CONTEXT tls_cert;
+	u_long tls_timeout;             // ms a handshake may take
+	SecPkgCred_SessionTicketKey tls_keys[2];    // the issuing key first, then the previous one
+	u_long tls_keys_count;
+	u_long tls_key_rotation;        // ms, 0 without tickets
+	ULONGLONG tls_keys_rotated;
+} listener_state;
+
 typedef struct _qs_context {
 	qs_status status;
 	qs_info qs_info;
 	HANDLE iocp;
-	uintptr_t *threads;
+	worker *workers;
+	unsigned int workers_size;
+	CRITICAL_SECTION workers_cs;
+	LONGLONG qpc_frequency;
+	__declspec(align(64)) qs_worker_stats external_stats;   // threads outside the pool
+	volatile LONG histograms_epoch;
+	trace_ring external_trace;
+	LONGLONG started;
+	volatile LONG connections_ids;
+	volatile LONGLONG clock;        // ms of system uptime, see clock_now()
+	void *clock_timer;
+	char date[2][32];               // HTTP date of the current second, see date_update()
+	volatile LONG date_slot;
+	ULONGLONG date_seconds;
+	scaling_state scaling;
+	struct _io_context *probe_ctx;
+	struct _io_context *scaling_ctx;
+	metrics_state metrics;
+	error_queue errors;
 	void *timer;
 	connection_storage * storage;
-	struct socket qs_socket;
+	struct _group_shard *groups;    // GROUP_SHARDS, see qs_group_join()
+	CRITICAL_SECTION connects_cs;
+	struct _io_context *connects;   // pending qs_connect() calls with a timeout
+	ULONGLONG connects_checked;
+	CRITICAL_SECTION upstreams_cs;
+	struct _upstream *upstreams;
+	void *reap_timer;               // see upstreams_reap()
+	void *keys_timer;               // see tls_keys_check(), NULL without session tickets
+	CRITICAL_SECTION udp_cs;
+	struct _udp_endpoint *endpoints;    // see qs_udp_open(), guarded by udp_cs
+	volatile LONG udp_refs;         // endpoints not freed yet and one of qs_start()
+	HANDLE udp_drained;             // set when udp_refs drops to 0, see udp_close_all()
+	listener_state *listeners;      // params.listeners resolved, see listeners_open()
+	u_long listeners_count;
 	qs_params qs_params;
 
 	struct _ex_funcs {
@@ -66,20 +301,202 @@ typedef struct _qs_context {
 		LPFN_TRANSMITPACKETS TransmitPackets; 
 		LPFN_DISCONNECTEX DisconnectEx;
 		LPFN_TRANSMITFILE TransmitFile;
+		LPFN_CONNECTEX ConnectEx;
 	} ex_funcs;
 
 } qs_context;
 
+// Every packet of the port starts with the OVERLAPPED and the operation
 struct _io_context {
 	OVERLAPPED ov;
+	states ended_operation;
 	struct _connection connection;
 	qs_context *server_ctx;
-	states ended_operation;
-	u_long last_activity;
+	listener_state *listener;   // accepting listener, the first one for outbound connections
+	volatile LONG refs;         // the connection and its pending broadcast sends
+	ULONGLONG last_activity;
+	char *buffer_base;          // allocation behind connection.buffer, which callers may move
+	u_long buffer_size;
+	u_long recv_offset;         // bytes kept in front of a qs_recv_append() receive
+	LONGLONG posted;            // performance counter when the pending operation was issued
+	LONGLONG recv_completed;    // last receive completion not yet answered by a send
+	struct _recv_ring *ring;    // receive ring, see recv_ring
+	struct _send_queue *sendq;  // allocated by the first queued response
+	struct _membership *memberships;    // groups joined, changed only by the owning thread
+	struct _io_context *connect_next;   // list of pending connects, see connects_expire()
+	struct _io_context *connect_prev;
+	ULONGLONG connect_deadline;
+	BOOL connect_listed;
+	BOOL connect_timed_out;
+	struct _upstream *upstream;         // pool the connection belongs to, see qs_upstream_acquire()
+	struct _upstream_idle *idle_list;   // set while the connection is idle in that pool
+	struct _io_context *idle_next;
+	struct _io_context *idle_prev;
+	ULONGLONG idle_since;
+	struct _proxy *proxy;               // forwarding pair, see qs_proxy()
+	ULONGLONG proxy_received;           // bytes the pair received from this connection
+	ULONGLONG proxy_sent;               // and sent to it
+	struct _tls_session *tls;           // connections of TLS listeners
+	u_long memory;                      // buffer bytes charged to qs_info.buffer_memory
+	volatile LONG send_pending;         // bytes of its own and of broadcast sends not completed
+	u_long send_posted;                 // of them the pending send of its own
+	volatile LONG recv_held;            // a receive waits for the sends to drain, see recv_hold()
+	u_long held_offset;
 };
 
 typedef struct _io_context io_context;
 
+static __declspec(thread) worker *current_worker;
+
+// Adds to a counter of the calling worker. Threads outside the pool share one slot.
+#define STAT_ADD(qs, field, value) \
+	do { \
+		if(current_worker && current_worker->server == (qs)) current_worker->stats.field += (value); \
+		else InterlockedExchangeAdd64((volatile LONGLONG *)&(qs)->external_stats.field, (LONGLONG)(value)); \
+	} while(0)
+
+#define STAT_ERROR(qs, type) STAT_ADD(qs, errors[type], 1)
+
+__inline static void trace_write(qs_trace_event *e, LONGLONG ticks, unsigned short type, unsigned short worker_id, u_long connection_id, u_long value)
+{
+	e->timestamp = (ULONGLONG)ticks;
+	e->connection_id = connection_id;
+	e->value = value;
+	e->type = type;
+	e->worker = worker_id;
+}
+
+// Owner-only ring of a worker: a plain store and increment
+__inline static void trace_record(worker *self, LONGLONG ticks, qs_trace_event_type type, u_long connection_id, u_long value)
+{
+	trace_ring *ring = &self->trace;
+	trace_write(&ring->events[ring->head & (TRACE_RING_SIZE - 1)], ticks, (unsigned short)type, (unsigned short)self->id, connection_id, value);
+	ring->head++;
+}
+
+// Events from any thread: threads outside the pool claim a slot of the shared ring
+__inline static void trace_post(qs_context *server, LONGLONG ticks, qs_trace_event_type type, u_long connection_id, u_long value)
+{
+	ULONGLONG slot;
+	if(current_worker && current_worker->server == server)
+	{
+		trace_record(current_worker, ticks, type, connection_id, value);
+		return;
+	}
+	slot = (ULONGLONG)InterlockedIncrement64((volatile LONGLONG *)&server->external_trace.head) - 1;
+	trace_write(&server->external_trace.events[slot & (TRACE_RING_SIZE - 1)], ticks, (unsigned short)type, QS_TRACE_EXTERNAL_WORKER, connection_id, value);
+}
+
+__inline static LONGLONG qpc_now(void)
+{
+	LARGE_INTEGER counter;
+	QueryPerformanceCounter(&counter);
+	return counter.QuadPart;
+}
+
+__inline static ULONGLONG qpc_to_us(qs_context *server, LONGLONG ticks)
+{
+	LONGLONG frequency = server->qpc_frequency;
+	return (ULONGLONG)(ticks / frequency * 1000000 + ticks % frequency * 1000000 / frequency);
+}
+
+// Coarse server clock, refreshed by a timer every CLOCK_RESOLUTION ms. Reading it
+// is a single load, 64 bits remove the 49 day wraparound of GetTickCount().
+#define CLOCK_RESOLUTION 10
+
+__inline static ULONGLONG clock_now(qs_context *server)
+{
+#if defined(_WIN64)
+	return (ULONGLONG)server->clock;
+#else
+	// Plain 64-bit loads are not atomic on 32-bit targets
+	return (ULONGLONG)InterlockedCompareExchange64(&server->clock, 0, 0);
+#endif
+}
+
+// Formats the IMF-fixdate of RFC 7231 once per second into the slot readers do
+// not use. A reader copying the old slot has a full second before it is reused.
+static void date_update(qs_context *server)
+{
+	static const char *days[] = {"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
+	static const char *months[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+	FILETIME ft;
+	SYSTEMTIME st;
+	ULONGLONG seconds;
+	LONG slot;
+
+	GetSystemTimeAsFileTime(&ft);
+	seconds = (((ULONGLONG)ft.dwHighDateTime << 32) | ft.dwLowDateTime) / 10000000;
+	if(seconds == server->date_seconds) return;
+	server->date_seconds = seconds;
+	FileTimeToSystemTime(&ft, &st);
+	slot = server->date_slot ^ 1;
+	_snprintf_s(server->date[slot], sizeof(server->date[slot]), _TRUNCATE, "%s, %02u %s %04u %02u:%02u:%02u GMT",
+		days[st.wDayOfWeek], st.wDay, months[st.wMonth - 1], st.wYear, st.wHour, st.wMinute, st.wSecond);
+	InterlockedExchange(&server->date_slot, slot);
+}
+
+
+// Pending connects with a timeout are listed until their completion arrives.
+// The list is walked from the clock timer a few times per second.
+#define CONNECT_CHECK_PERIOD 100
+
+static void connect_list(qs_context *server, struct _io_context *context)
+{
+	EnterCriticalSection(&server->connects_cs);
+	context->connect_prev = NULL;
+	context->connect_next = server->connects;
+	if(server->connects) server->connects->connect_prev = context;
+	server->connects = context;
+	context->connect_listed = TRUE;
+	LeaveCriticalSection(&server->connects_cs);
+}
+
+__inline static void connect_unlink(qs_context *server, struct _io_context *context)
+{
+	if(context->connect_prev) context->connect_prev->connect_next = context->connect_next;
+	else server->connects = context->connect_next;
+	if(context->connect_next) context->connect_next->connect_prev = context->connect_prev;
+	context->connect_listed = FALSE;
+}
+
+// Called by the worker with the completion. Waits for a running expiry, which
+// may be cancelling the connect, before the context is used.
+static void connect_unlist(qs_context *server, struct _io_context *context)
+{
+	if(!context->connect_deadline) return;
+	EnterCriticalSection(&server->connects_cs);
+	if(context->connect_listed) connect_unlink(server, context);
+	LeaveCriticalSection(&server->connects_cs);
+}
+
+// Cancelled connects complete with an error, which the worker reports as a timeout
+static void connects_expire(qs_context *server, ULONGLONG now)
+{
+	struct _io_context *context, *next;
+	if(!server->connects || now - server->connects_checked < CONNECT_CHECK_PERIOD) return;
+	server->connects_checked = now;
+	EnterCriticalSection(&server->connects_cs);
+	for(context = server->connects; context; context = next)
+	{
+		next = context->connect_next;
+		if(context->connect_deadline > now) continue;
+		connect_unlink(server, context);
+		context->connect_timed_out = TRUE;
+		CancelIoEx((HANDLE)context->connection.socket.sock, &context->ov);
+	}
+	LeaveCriticalSection(&server->connects_cs);
+}
+
+void WINAPI clock_timer_callback(void *context, BOOL fTimerOrWaitFired)
+{
+	qs_context *server = (qs_context *)context;
+	ULONGLONG now = GetTickCount64();
+	InterlockedExchange64(&server->clock, (LONGLONG)now);
+	date_update(server);
+	connects_expire(server, now);
+}
+
 MYDLL_API void* qs_memory_alloc(size_t size)
 {
 	return nedmalloc(size);
@@ -92,84 +509,108 @@ MYDLL_API void qs_memory_free(void *p)
 
 static connection_storage * connection_storage_new(size_t max_count_of_connections)
 {
-	connection_storage * storage = (connection_storage *)qs_memory_alloc(sizeof connection_storage);
+	connection_storage * storage = (connection_storage *)qs_memory_alloc(sizeof(connection_storage));
+	size_t i;
 	if(!storage) return NULL;
-	storage->connections = (connection **)qs_memory_alloc(sizeof(connection *) * max_count_of_connections);
 	storage->size = max_count_of_connections;
 	storage->count = 0;
-	InitializeCriticalSectionAndSpinCount(&storage->cs, 0x400);
+	for(i = 0; i < STORAGE_SHARDS; i++)
+	{
+		storage_shard *shard = &storage->shards[i];
+		shard->size = max_count_of_connections / STORAGE_SHARDS + 1;
+		shard->connections = (connection **)qs_memory_alloc(sizeof(connection *) * shard->size);
+		shard->count = 0;
+		InitializeCriticalSectionAndSpinCount(&shard->cs, 0x400);
+		if(!shard->connections)
+		{
+			DeleteCriticalSection(&shard->cs);
+			while(i-- > 0)
+			{
+				qs_memory_free(storage->shards[i].connections);
+				DeleteCriticalSection(&storage->shards[i].cs);
+			}
+			qs_memory_free(storage);
+			return NULL;
+		}
+	}
 	return storage;
 }
 
-static bool connection_storage_is_full(connection_storage * storage)
+__inline static storage_shard *connection_storage_shard(connection_storage * storage, connection * connection)
 {
-	EnterCriticalSection(&storage->cs);
-	if (storage->count >= storage->size) 
-	{
-		LeaveCriticalSection(&storage->cs);
-		return true;
-	}
-	LeaveCriticalSection(&storage->cs);
-	return false;
+	return &storage->shards[connection->id & (STORAGE_SHARDS - 1)];
 }
 
+static bool connection_storage_is_full(connection_storage * storage)
+{
+	return (size_t)storage->count >= storage->size;
+}
 
 static void connection_storage_add(connection_storage * storage, connection * connection)
 {
-	EnterCriticalSection(&storage->cs);
-	if(storage->count < storage->size)
+	storage_shard *shard = connection_storage_shard(storage, connection);
+	struct _connection **grown;
+	EnterCriticalSection(&shard->cs);
+	// Ids are sequential, a shard outgrows its share only when long lived connections cluster
+	if(shard->count == shard->size)
+	{
+		grown = (struct _connection **)nedrealloc(shard->connections, sizeof(*grown) * shard->size * 2);
+		if(grown)
+		{
+			shard->connections = grown;
+			shard->size *= 2;
+		}
+	}
+	if(shard->count < shard->size)
 	{
-		storage->connections[storage->count] = connection;
-		storage->count++;
+		shard->connections[shard->count] = connection;
+		shard->count++;
+		InterlockedIncrement(&storage->count);
 	}
-	LeaveCriticalSection(&storage->cs);
+	LeaveCriticalSection(&shard->cs);
 }
 
 static void connection_storage_traverse(connection_storage * storage, void (*do_func) (connection *))
 {
-	EnterCriticalSection(&storage->cs);
-	for(size_t i = 0; i < storage->count; i++)
+	size_t i, j;
+	for(i = 0; i < STORAGE_SHARDS; i++)
 	{
-		do_func(storage->connections[i]);
+		storage_shard *shard = &storage->shards[i];
+		EnterCriticalSection(&shard->cs);
+		for(j = 0; j < shard->count; j++)
+		{
+			do_func(shard->connections[j]);
+		}
+		LeaveCriticalSection(&shard->cs);
 	}
-	LeaveCriticalSection(&storage->cs);
-}
-
-int eq(const void* a, const void* b)
-{
-	return a == b;
 }
 
 static void connection_storage_delete(connection_storage * storage, connection * connection)
 {
-	EnterCriticalSection(&storage->cs);
-	if(storage->count == 0) 
-	{
-		LeaveCriticalSection(&storage->cs);
-		return;
-	}
-	if(storage->connections[storage->count - 1] == connection) 
-	{
-		storage->count--;
-		LeaveCriticalSection(&storage->cs);
-		return;
-	}
-	for(size_t i = 0; i < storage->count - 1; i++)
+	storage_shard *shard = connection_storage_shard(storage, connection);
+	size_t i;
+	EnterCriticalSection(&shard->cs);
+	for(i = shard->count; i-- > 0; )
 	{
-		if(storage->connections[i] == connection)
+		if(shard->connections[i] == connection)
 		{
-			storage->count--;
-			storage->connections[i] = storage->connections[storage->count];
+			shard->count--;
+			shard->connections[i] = shard->connections[shard->count];
+			InterlockedDecrement(&storage->count);
 			break;
 		}
 	}
-	LeaveCriticalSection(&storage->cs);
+	LeaveCriticalSection(&shard->cs);
 }
 
 static void connection_storage_free(connection_storage * storage)
 {
-	DeleteCriticalSection(&storage->cs);
-	qs_memory_free(storage->connections);
+	size_t i;
+	for(i = 0; i < STORAGE_SHARDS; i++)
+	{
+		DeleteCriticalSection(&storage->shards[i].cs);
+		qs_memory_free(storage->shards[i].connections);
+	}
 	qs_memory_free(storage);
 }
 
@@ -189,6 +630,9 @@ static void cry(qs_context* server, const char *fmt, ...)
 	struct tm timeinfo;
 	size_t convertedChars;
 
+	// Nothing to report to before qs_start() has set the callbacks
+	if(!server->qs_params.callbacks.on_error) return;
+
 	va_start(ap, fmt);
 	vsnprintf_s(buf, sizeof(buf), fmt, ap);
 	va_end(ap);
@@ -203,12 +647,6 @@ static void cry(qs_context* server, const char *fmt, ...)
 	server->qs_params.callbacks.on_error(buf_on_error);
 }
 
-__inline static io_context *get_context(connection *connection)
-{
-	ptrdiff_t  p = (ptrdiff_t)connection;
-	return (io_context *)(p - sizeof(OVERLAPPED));
-}
-
 static uintptr_t create_thread(unsigned (__stdcall * start_addr) (void *), void * args, unsigned int stack_size)
 {
 	unsigned int threadID;
@@ -216,145 +654,732 @@ static uintptr_t create_thread(unsigned (__stdcall * start_addr) (void *), void
 	return thread;
 }
 
-static io_context *alloc_context(qs_context *server)
-{
-	io_context *io_cont = (io_context *)qs_memory_alloc(sizeof(io_context));
-	memset(io_cont, 0, sizeof(io_context));
-	io_cont->connection.buffer.buf = (char *)qs_memory_alloc((size_t)server->qs_params.connection_buffer_size);
-	io_cont->connection.buffer.data_len = server->qs_params.connection_buffer_size;
-	io_cont->server_ctx = server;
-	return io_cont;
-}
+#define ERROR_QUEUE_SIZE 1024
+#define ERROR_DRAIN_PERIOD 100
+#define ERROR_REPORTS_DEFAULT 10
+#define ERROR_FOLD_SLOTS 16
 
-static void free_context(qs_context *server, io_context * io_context)
-{
-	qs_memory_free(io_context->connection.buffer.buf);
-	qs_memory_free(io_context);
-}
+static const char *error_type_names[qs_error_types_count] = {
+	"accept", "recv", "send", "completion", "iocp", "connect", "tls"
+};
 
-__inline SOCKET socket_create(qs_info *info)
+// Hot path error report: no formatting and no locks. When the queue is full
+// the event is only counted, the next report says how many were lost.
+static void report_error(qs_context *server, qs_error_type type, u_long code, u_long connection_id)
 {
-	SOCKET sock;
-#if defined(USE_IPV6)
-	sock = socket(AF_INET6, SOCK_STREAM, IPPROTO_TCP);
-#else
-	sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-#endif
-	InterlockedIncrement(&info->sockets_count);
-	return sock;
-}
+	error_queue *q = &server->errors;
+	error_cell *cell;
+	LONG pos, diff;
 
-__inline void socket_close(SOCKET sock, qs_info *info)
-{
-	closesocket(sock);
-	InterlockedDecrement(&info->sockets_count);
+	if(!q->cells)
+	{
+		cry(server, "%s failed with error: %lu", error_type_names[type], code);
+		return;
+	}
+	pos = q->enqueue_pos;
+	for(;;)
+	{
+		cell = &q->cells[pos & q->mask];
+		diff = cell->sequence - pos;
+		if(diff == 0)
+		{
+			if(InterlockedCompareExchange(&q->enqueue_pos, pos + 1, pos) == pos) break;
+		}
+		else if(diff < 0)
+		{
+			InterlockedIncrement(&q->dropped);
+			return;
+		}
+		pos = q->enqueue_pos;
+	}
+	cell->event.type = type;
+	cell->event.code = code;
+	cell->event.connection_id = connection_id;
+	cell->event.timestamp = clock_now(server);
+	cell->event.count = 1;
+	InterlockedExchange(&cell->sequence, pos + 1);
 }
 
-static BOOL init_ex_funcs(qs_context* server)
+static BOOL error_queue_pop(error_queue *q, qs_error_event *event)
 {
-	SOCKET s = socket_create(&server->qs_info);
+	error_cell *cell = &q->cells[q->dequeue_pos & q->mask];
+	if(cell->sequence - (q->dequeue_pos + 1) < 0) return FALSE;
+	*event = cell->event;
+	InterlockedExchange(&cell->sequence, q->dequeue_pos + q->mask + 1);
+	q->dequeue_pos++;
+	return TRUE;
+}
 
-	GUID accept_ex_GUID =        WSAID_ACCEPTEX; 
-	GUID transmit_packets_GUID = WSAID_TRANSMITPACKETS; 
-	GUID disconnect_ex_GUID =    WSAID_DISCONNECTEX;
-	GUID transmitfile_GUID =     WSAID_TRANSMITFILE;
-	u_long dwTmp;
-	int res = TRUE;
+typedef struct _error_reporter {
+	qs_error_event folded[ERROR_FOLD_SLOTS];
+	u_long folded_count;
+	u_long tokens;
+	ULONGLONG refilled;
+	ULONGLONG suppressed;
+} error_reporter;
 
-	if ( ( WSAIoctl(s, SIO_GET_EXTENSION_FUNCTION_POINTER, &accept_ex_GUID, sizeof(accept_ex_GUID), &server->ex_funcs.AcceptEx, sizeof(server->ex_funcs.AcceptEx), &dwTmp, NULL, NULL)!=0) 
-		||(WSAIoctl(s, SIO_GET_EXTENSION_FUNCTION_POINTER, &transmit_packets_GUID, sizeof(transmit_packets_GUID), &server->ex_funcs.TransmitPackets, sizeof(server->ex_funcs.TransmitPackets), &dwTmp, NULL, NULL)!=0) 
-		||(WSAIoctl(s, SIO_GET_EXTENSION_FUNCTION_POINTER, &disconnect_ex_GUID, sizeof(disconnect_ex_GUID), &server->ex_funcs.DisconnectEx, sizeof(server->ex_funcs.DisconnectEx), &dwTmp, NULL, NULL)!=0)
-		||(WSAIoctl(s, SIO_GET_EXTENSION_FUNCTION_POINTER, &transmitfile_GUID, sizeof(transmitfile_GUID), &server->ex_funcs.TransmitFile, sizeof(server->ex_funcs.TransmitFile), &dwTmp, NULL, NULL)!=0)) 
-		res = FALSE;
-	socket_close(s, &server->qs_info);
-	return res;
+static void error_deliver(qs_context *server, error_reporter *r, const qs_error_event *e)
+{
+	if(server->qs_params.callbacks.on_error_event) server->qs_params.callbacks.on_error_event(e);
+	if(!server->qs_params.callbacks.on_error) return;
+	if(r->tokens == 0)
+	{
+		r->suppressed += e->count;
+		return;
+	}
+	r->tokens--;
+	if(e->count > 1)
+	{
+		cry(server, "%s failed with error: %lu, connection: %lu (%lu times)", error_type_names[e->type], e->code, e->connection_id, e->count);
+	}
+	else cry(server, "%s failed with error: %lu, connection: %lu", error_type_names[e->type], e->code, e->connection_id);
 }
 
-MYDLL_API u_long qs_create(void **qs_instance )
+// Drains the queue, folding events of the same operation and code, then delivers
+// them. A folded event keeps the connection id only when all occurrences share it. Formatting for on_error is limited to error_reports_per_second.
+static void error_drain(qs_context *server, error_reporter *r)
 {
-	int result;
-	int error;
-	WSADATA wsaData;
-	qs_context* server = (qs_context*)malloc(sizeof(qs_context));
-	*qs_instance = server;
+	error_queue *q = &server->errors;
+	qs_error_event e;
+	ULONGLONG now = clock_now(server);
+	LONG dropped;
+	u_long i;
 
-	if(*qs_instance)
+	if(now - r->refilled >= 1000)
 	{
-		memset(*qs_instance, 0, sizeof(qs_instance));
-
-		result = WSAStartup(MAKEWORD(2,2), &wsaData);
-		if (result != 0) 
+		r->tokens = server->qs_params.error_reports_per_second;
+		r->refilled = now;
+		if(r->suppressed && server->qs_params.callbacks.on_error && r->tokens)
 		{
-			error = GetLastError();
-			cry(server, "%s: WSAStartup() fail with error: %d",
-				__func__, error);
-			return error;
+			r->tokens--;
+			cry(server, "%I64u error reports suppressed", r->suppressed);
+			r->suppressed = 0;
 		}
+	}
 
-		server->iocp = CreateIoCompletionPort(INVALID_HANDLE_VALUE, 0, 0, 0);
-		if(!server->iocp) 
-		{	
-			error = GetLastError();
-			WSACleanup();
-			cry(server, "%s: CreateIoCompletionPort() fail with error: %d",	__func__, error);
-			return error;
+	while(error_queue_pop(q, &e))
+	{
+		for(i = 0; i < r->folded_count; ++i)
+		{
+			if(r->folded[i].type == e.type && r->folded[i].code == e.code) break;
 		}
-
-		if(!init_ex_funcs(server)) 
-		{		
-			error = WSAGetLastError();
-			CloseHandle(server->iocp);
-			WSACleanup();
-			cry(server, "%s: init_ex_funcs() fail with error: %d",	__func__, error);
-			return error;
+		if(i < r->folded_count)
+		{
+			// Occurrences of several connections are not tied to one of them
+			if(r->folded[i].connection_id != e.connection_id) r->folded[i].connection_id = 0;
+			r->folded[i].count++;
+			continue;
+		}
+		if(r->folded_count == ERROR_FOLD_SLOTS)
+		{
+			for(i = 0; i < r->folded_count; ++i) error_deliver(server, r, &r->folded[i]);
+			r->folded_count = 0;
 		}
+		r->folded[r->folded_count++] = e;
+	}
+	for(i = 0; i < r->folded_count; ++i) error_deliver(server, r, &r->folded[i]);
+	r->folded_count = 0;
 
-		return ERROR_SUCCESS;
+	dropped = InterlockedExchange(&q->dropped, 0);
+	if(dropped && server->qs_params.callbacks.on_error)
+	{
+		cry(server, "%ld error events lost, the error queue was full", dropped);
 	}
-	else return ERROR_ALLOCATE_BUCKET;
 }
 
-MYDLL_API void qs_delete(void *qs_instance )
+unsigned __stdcall error_thread(void *s)
 {
-	free(qs_instance);
+	qs_context *server = (qs_context *)s;
+	error_reporter reporter;
+
+	memset(&reporter, 0, sizeof(reporter));
+	while(WaitForSingleObject(server->errors.stop_event, ERROR_DRAIN_PERIOD) == WAIT_TIMEOUT)
+	{
+		error_drain(server, &reporter);
+	}
+	error_drain(server, &reporter);
+	return 0;
 }
 
-static int parse_ipvX_addr_string(char *addr_buf, int port, union usa *u) 
+static BOOL error_queue_start(qs_context *server)
 {
-#if defined(USE_IPV6) && defined(HAVE_INET_NTOP)
-	// Only Windoze Vista (and newer) have inet_pton()
-	struct in_addr a = {0};
-	struct in6_addr a6 = {0};
+	error_queue *q = &server->errors;
+	LONG i;
 
-	memset(u, 0, sizeof(usa));
-	if (inet_pton(AF_INET6, addr_buf, &a6) > 0) {
+	memset(q, 0, sizeof(error_queue));
+	if(server->qs_params.error_reports_per_second == 0) server->qs_params.error_reports_per_second = ERROR_REPORTS_DEFAULT;
+	q->cells = (error_cell *)qs_memory_alloc(sizeof(error_cell) * ERROR_QUEUE_SIZE);
+	q->stop_event = CreateEvent(NULL, TRUE, FALSE, NULL);
+	if(!q->cells || !q->stop_event) goto fail;
+	q->mask = ERROR_QUEUE_SIZE - 1;
+	for(i = 0; i < ERROR_QUEUE_SIZE; ++i)
+	{
+		q->cells[i].sequence = i;
+	}
+	q->thread = create_thread(error_thread, server, 0);
+	if(!q->thread) goto fail;
+	return TRUE;
 
-		u->sin6.sin6_family = AF_INET6;
-		u->sin6.sin6_port = htons((uint16_t) port);
-		u->sin6.sin6_addr = a6;
-		return 1;
-	} else if (inet_pton(AF_INET, addr_buf, &a) > 0) {
+fail:
+	if(q->stop_event) CloseHandle(q->stop_event);
+	qs_memory_free(q->cells);
+	memset(q, 0, sizeof(error_queue));
+	return FALSE;
+}
 
-		u->sin.sin_family = AF_INET;
-		u->sin.sin_port = htons((uint16_t) port);
-		u->sin.sin_addr = a;
-		return 1;
-	} else {
-		return 0;
-	}
-#elif defined(HAVE_GETNAMEINFO)
-	struct addrinfo hints = {0};
+// Called after the workers have exited, the thread drains what is left
+static void error_queue_stop(qs_context *server)
+{
+	error_queue *q = &server->errors;
+	if(!q->cells) return;
+	SetEvent(q->stop_event);
+	WaitForSingleObject((HANDLE)q->thread, INFINITE);
+	CloseHandle((HANDLE)q->thread);
+	CloseHandle(q->stop_event);
+	qs_memory_free(q->cells);
+	q->cells = NULL;
+}
+
+// Receive ring of a connection with message framing or params.receive_ring.
+// The ring is mapped twice back to back, so data that wraps the end is still
+// contiguous and neither receives nor readers ever move bytes. When the
+// mirror mapping fails the ring is a plain allocation and the one frame of a
+// batch that wraps the end is copied to the scratch area behind it.
+// Delivered frames stay held until the connection receives again from outside
+// on_frames, so the views survive a qs_recv() in the callback.
+#define FRAMES_BATCH 64
+#define MIRROR_ATTEMPTS 16
+
+typedef struct _recv_ring {
+	char *data;                 // size bytes followed by the mirror or by size bytes of scratch
+	u_long size;
+	BOOL mirrored;
+	u_long start;               // offset of the first unconsumed byte
+	u_long used;                // unconsumed bytes
+	u_long held;                // delivered bytes in front of start still referenced
+	u_long scanned;             // bytes of the first incomplete frame searched for the delimiter
+	BOOL pending;               // the last batch was full, complete frames may remain
+	WSABUF free[2];
+	qs_frame frames[FRAMES_BATCH];
+} recv_ring;
+
+// Maps one section at two adjacent addresses. The address found free may be
+// taken by another thread before the views are mapped, hence the retries.
+static char *mirror_map(u_long size)
+{
+	HANDLE mapping;
+	char *p, *view = NULL;
+	int attempt;
+
+	mapping = CreateFileMapping(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, size, NULL);
+	if(!mapping) return NULL;
+	for(attempt = 0; attempt < MIRROR_ATTEMPTS && !view; ++attempt)
+	{
+		p = (char *)VirtualAlloc(NULL, (SIZE_T)size * 2, MEM_RESERVE, PAGE_NOACCESS);
+		if(!p) break;
+		VirtualFree(p, 0, MEM_RELEASE);
+		if(!MapViewOfFileEx(mapping, FILE_MAP_ALL_ACCESS, 0, 0, size, p)) continue;
+		if(MapViewOfFileEx(mapping, FILE_MAP_ALL_ACCESS, 0, 0, size, p + size)) view = p;
+		else UnmapViewOfFile(p);
+	}
+	// The views keep the section alive
+	CloseHandle(mapping);
+	return view;
+}
+
+// size is a multiple of the allocation granularity, see ring_size()
+static recv_ring *ring_alloc(u_long size)
+{
+	recv_ring *ring = (recv_ring *)qs_memory_alloc(sizeof(recv_ring));
+	if(!ring) return NULL;
+	memset(ring, 0, sizeof(recv_ring));
+	ring->size = size;
+	if((ring->data = mirror_map(size)) != NULL) ring->mirrored = TRUE;
+	else if((ring->data = (char *)qs_memory_alloc((size_t)size * 2)) == NULL)
+	{
+		qs_memory_free(ring);
+		return NULL;
+	}
+	return ring;
+}
+
+static void ring_free(recv_ring *ring)
+{
+	if(ring->mirrored)
+	{
+		UnmapViewOfFile(ring->data + ring->size);
+		UnmapViewOfFile(ring->data);
+	}
+	else qs_memory_free(ring->data);
+	qs_memory_free(ring);
+}
+
+// Without the mirror the wrapped part of the data is copied behind the ring
+__inline static void ring_linearize(recv_ring *ring)
+{
+	if(!ring->mirrored && ring->start + ring->used > ring->size)
+		memcpy(ring->data + ring->size, ring->data, ring->start + ring->used - ring->size);
+}
+
+static u_long ring_size(u_long buffer_size)
+{
+	SYSTEM_INFO si;
+	GetSystemInfo(&si);
+	return (buffer_size + si.dwAllocationGranularity - 1) / si.dwAllocationGranularity * si.dwAllocationGranularity;
+}
+
+// Responses queued by the application and sent with one WSASend, after
+// on_recv or on_frames returns or from qs_send_flush(). Appended data is
+// copied into the queue area, references must stay valid until on_send.
+#define SEND_QUEUE_BUFFERS 64
+
+typedef struct _send_queue {
+	char *area;
+	u_long area_size;
+	u_long area_used;
+	u_long count;
+	BOOL sending;
+	WSABUF buffers[SEND_QUEUE_BUFFERS];
+} send_queue;
+
+static send_queue *send_queue_alloc(u_long size)
+{
+	send_queue *q = (send_queue *)qs_memory_alloc(sizeof(send_queue));
+	if(!q) return NULL;
+	memset(q, 0, sizeof(send_queue));
+	if((q->area = (char *)qs_memory_alloc(size)) == NULL)
+	{
+		qs_memory_free(q);
+		return NULL;
+	}
+	q->area_size = size;
+	return q;
+}
+
+static void send_queue_free(send_queue *q)
+{
+	qs_memory_free(q->area);
+	qs_memory_free(q);
+}
+
+// TLS state of a connection. Received records are decrypted in place in the
+// input buffer, records to send are built in the output buffer a batch at a time.
+#define TLS_BUFFER_SIZE (2 * (16384 + 512))
+#define TLS_HANDSHAKE_TIMEOUT 10000
+
+typedef struct _tls_session {
+	CtxtHandle ctx;
+	BOOL have_ctx;
+	BOOL open;                  // handshake done
+	SecPkgContext_StreamSizes sizes;
+	char *in;
+	u_long in_start;            // records not decrypted yet
+	u_long in_len;
+	char *plain;                // decrypted data not delivered yet, in front of in_start
+	u_long plain_len;
+	SECURITY_STATUS closed;     // end of the input, reported after the data before it
+	WSABUF target[2];           // where the pending receive wants the plaintext
+	u_long target_count;
+	BOOL delivered;             // the receive was completed through the port with data in target
+	char *token;                // handshake message of SChannel being sent
+	u_long token_len;
+	u_long token_sent;
+	char *out;                  // encrypted records being sent
+	u_long out_len;
+	u_long out_sent;
+	const WSABUF *source;       // plaintext of the pending send
+	u_long source_count;
+	u_long source_index;
+	u_long source_offset;
+	u_long source_total;        // plaintext bytes encrypted so far
+	// Broadcast sends encrypt on other threads. The lock keeps the records in
+	// sequence on the wire; broadcasts arriving while a send of the connection
+	// is between its records wait for it, so they never split its data.
+	CRITICAL_SECTION lock;
+	BOOL sending;
+	struct _broadcast_send *deferred;
+	struct _broadcast_send *deferred_tail;
+} tls_session;
+
+static void tls_free(tls_session *t)
+{
+	if(t->token) FreeContextBuffer(t->token);
+	if(t->have_ctx) DeleteSecurityContext(&t->ctx);
+	if(t->in) qs_memory_free(t->in);
+	if(t->out) qs_memory_free(t->out);
+	DeleteCriticalSection(&t->lock);
+	qs_memory_free(t);
+}
+
+static tls_session *tls_session_new(void)
+{
+	tls_session *t = (tls_session *)qs_memory_alloc(sizeof(tls_session));
+	if(!t) return NULL;
+	memset(t, 0, sizeof(tls_session));
+	InitializeCriticalSectionAndSpinCount(&t->lock, 0x400);
+	t->in = (char *)qs_memory_alloc(TLS_BUFFER_SIZE);
+	t->out = (char *)qs_memory_alloc(TLS_BUFFER_SIZE);
+	if(!t->in || !t->out)
+	{
+		tls_free(t);
+		return NULL;
+	}
+	return t;
+}
+
+typedef struct _qs_listener::_framing framing_params;
+
+static BOOL framing_check(const framing_params *f, ON_FRAMES_PROC on_frames)
+{
+	switch(f->type)
+	{
+	case qs_framing_none:
+		return TRUE;
+	case qs_framing_fixed:
+		if(f->length_size != 1 && f->length_size != 2 && f->length_size != 4) return FALSE;
+		if(f->length_offset + f->length_size > f->header_size) return FALSE;
+		break;
+	case qs_framing_varint:
+		break;
+	case qs_framing_delimiter:
+		if(f->delimiter_len == 0 || f->delimiter_len > sizeof(f->delimiter)) return FALSE;
+		break;
+	default:
+		return FALSE;
+	}
+	return on_frames != NULL;
+}
+
+__inline static io_context *get_context(connection *connection)
+{
+	ptrdiff_t  p = (ptrdiff_t)connection;
+	return (io_context *)(p - offsetof(io_context, connection));
+}
+
+static io_context *alloc_context_sized(qs_context *server, u_long buffer_size)
+{
+	io_context *io_cont = (io_context *)qs_memory_alloc(sizeof(io_context));
+	memset(io_cont, 0, sizeof(io_context));
+	io_cont->connection.buffer.buf = (char *)qs_memory_alloc((size_t)buffer_size);
+	io_cont->connection.buffer.data_len = buffer_size;
+	io_cont->buffer_base = io_cont->connection.buffer.buf;
+	io_cont->buffer_size = buffer_size;
+	io_cont->server_ctx = server;
+	io_cont->refs = 1;
+	return io_cont;
+}
+
+// Buffer memory of the connections, limited by params.limits.buffer_memory
+static void memory_charge(io_context *context, u_long bytes)
+{
+	context->memory += bytes;
+	InterlockedExchangeAdd64(&context->server_ctx->qs_info.buffer_memory, (LONGLONG)bytes);
+}
+
+static BOOL memory_full(qs_context *server)
+{
+	return server->qs_params.limits.buffer_memory && (ULONGLONG)server->qs_info.buffer_memory >= server->qs_params.limits.buffer_memory;
+}
+
+static io_context *alloc_context(qs_context *server)
+{
+	return alloc_context_sized(server, server->qs_params.connection_buffer_size);
+}
+
+static void free_context(qs_context *server, io_context * io_context)
+{
+	// Sends which failed without a completion are still charged
+	if(io_context->send_pending) InterlockedExchangeAdd64(&server->qs_info.send_bytes, -(LONGLONG)io_context->send_pending);
+	if(io_context->memory) InterlockedExchangeAdd64(&server->qs_info.buffer_memory, -(LONGLONG)io_context->memory);
+	if(io_context->ring) ring_free(io_context->ring);
+	if(io_context->sendq) send_queue_free(io_context->sendq);
+	if(io_context->tls) tls_free(io_context->tls);
+	qs_memory_free(io_context->buffer_base);
+	qs_memory_free(io_context);
+}
+
+// Connection context with the buffer and the receive ring of the listener
+static io_context *listener_context(qs_context *server, listener_state *l)
+{
+	io_context *ctx = alloc_context_sized(server, l->buffer_size);
+	if(ctx == NULL) return NULL;
+	ctx->listener = l;
+	ctx->connection.listener_id = l->id;
+	if(l->ring_size && !(ctx->ring = ring_alloc(l->ring_size)))
+	{
+		free_context(server, ctx);
+		return NULL;
+	}
+	memory_charge(ctx, l->buffer_size + l->ring_size);
+	return ctx;
+}
+
+// Group index: member arrays of the groups, hashed by id into shards with their
+// own locks. Every member entry points at the membership node of the connection,
+// which remembers the position of the entry for removal in constant time.
+#define GROUP_SHARDS 16
+#define GROUP_BUCKETS 256
+
+typedef struct _membership {
+	struct _membership *next;
+	u_long group_id;
+	u_long index;               // in group->members, guarded by the shard lock
+} membership;
+
+typedef struct _group_member {
+	io_context *context;
+	membership *membership;
+} group_member;
+
+typedef struct _group {
+	struct _group *next;
+	u_long id;
+	u_long count;
+	u_long size;
+	group_member *members;
+} group;
+
+typedef struct _group_shard {
+	CRITICAL_SECTION cs;
+	group *buckets[GROUP_BUCKETS];
+} group_shard;
+
+__inline static u_long group_hash(u_long id)
+{
+	return id * 2654435761u;
+}
+
+__inline static group_shard *group_shard_get(qs_context *server, u_long id)
+{
+	return &server->groups[group_hash(id) >> 28];
+}
+
+static group **group_slot(group_shard *shard, u_long id)
+{
+	group **slot = &shard->buckets[(group_hash(id) >> 20) & (GROUP_BUCKETS - 1)];
+	while(*slot && (*slot)->id != id) slot = &(*slot)->next;
+	return slot;
+}
+
+static group_shard *groups_new(void)
+{
+	group_shard *groups = (group_shard *)qs_memory_alloc(sizeof(group_shard) * GROUP_SHARDS);
+	u_long i;
+	if(!groups) return NULL;
+	memset(groups, 0, sizeof(group_shard) * GROUP_SHARDS);
+	for(i = 0; i < GROUP_SHARDS; i++)
+	{
+		InitializeCriticalSectionAndSpinCount(&groups[i].cs, 0x400);
+	}
+	return groups;
+}
+
+static void groups_free(group_shard *groups)
+{
+	group *g, *next;
+	u_long i, j;
+	for(i = 0; i < GROUP_SHARDS; i++)
+	{
+		for(j = 0; j < GROUP_BUCKETS; j++)
+		{
+			for(g = groups[i].buckets[j]; g; g = next)
+			{
+				next = g->next;
+				qs_memory_free(g->members);
+				qs_memory_free(g);
+			}
+		}
+		DeleteCriticalSection(&groups[i].cs);
+	}
+	qs_memory_free(groups);
+}
+
+// Takes the entry of the membership out of its group, the last member frees the group
+static void group_remove(qs_context *server, membership *m)
+{
+	group_shard *shard = group_shard_get(server, m->group_id);
+	group **slot, *g;
+	EnterCriticalSection(&shard->cs);
+	slot = group_slot(shard, m->group_id);
+	g = *slot;
+	g->count--;
+	if(m->index != g->count)
+	{
+		g->members[m->index] = g->members[g->count];
+		g->members[m->index].membership->index = m->index;
+	}
+	if(!g->count)
+	{
+		*slot = g->next;
+		qs_memory_free(g->members);
+		qs_memory_free(g);
+	}
+	LeaveCriticalSection(&shard->cs);
+}
+
+static void groups_leave_all(qs_context *server, io_context *context)
+{
+	membership *m;
+	while((m = context->memberships) != NULL)
+	{
+		context->memberships = m->next;
+		group_remove(server, m);
+		qs_memory_free(m);
+	}
+}
+
+__inline SOCKET socket_create(qs_info *info, int family)
+{
+	SOCKET sock;
+	sock = socket(family, SOCK_STREAM, family == AF_UNIX ? 0 : IPPROTO_TCP);
+	InterlockedIncrement(&info->sockets_count);
+	return sock;
+}
+
+__inline void socket_close(SOCKET sock, qs_info *info)
+{
+	closesocket(sock);
+	InterlockedDecrement(&info->sockets_count);
+}
+
+// Drops a reference of a connection context. The last one closes the socket,
+// so a pending broadcast never sends on a handle reused by a new connection.
+static void context_release(qs_context *server, io_context * io_context)
+{
+	if(InterlockedDecrement(&io_context->refs)) return;
+	socket_close(io_context->connection.socket.sock, &server->qs_info);
+	free_context(server, io_context);
+}
+
+static BOOL init_ex_funcs(qs_context* server)
+{
+	// The functions are the same for both families, IPv6 may be missing
+	SOCKET s = socket_create(&server->qs_info, AF_INET6);
+
+	GUID accept_ex_GUID =        WSAID_ACCEPTEX; 
+	GUID transmit_packets_GUID = WSAID_TRANSMITPACKETS; 
+	GUID disconnect_ex_GUID =    WSAID_DISCONNECTEX;
+	GUID transmitfile_GUID =     WSAID_TRANSMITFILE;
+	GUID connect_ex_GUID =       WSAID_CONNECTEX;
+	u_long dwTmp;
+	int res = TRUE;
+
+	if(s == INVALID_SOCKET)
+	{
+		socket_close(s, &server->qs_info);
+		s = socket_create(&server->qs_info, AF_INET);
+	}
+	if ( ( WSAIoctl(s, SIO_GET_EXTENSION_FUNCTION_POINTER, &accept_ex_GUID, sizeof(accept_ex_GUID), &server->ex_funcs.AcceptEx, sizeof(server->ex_funcs.AcceptEx), &dwTmp, NULL, NULL)!=0) 
+		||(WSAIoctl(s, SIO_GET_EXTENSION_FUNCTION_POINTER, &transmit_packets_GUID, sizeof(transmit_packets_GUID), &server->ex_funcs.TransmitPackets, sizeof(server->ex_funcs.TransmitPackets), &dwTmp, NULL, NULL)!=0) 
+		||(WSAIoctl(s, SIO_GET_EXTENSION_FUNCTION_POINTER, &disconnect_ex_GUID, sizeof(disconnect_ex_GUID), &server->ex_funcs.DisconnectEx, sizeof(server->ex_funcs.DisconnectEx), &dwTmp, NULL, NULL)!=0)
+		||(WSAIoctl(s, SIO_GET_EXTENSION_FUNCTION_POINTER, &transmitfile_GUID, sizeof(transmitfile_GUID), &server->ex_funcs.TransmitFile, sizeof(server->ex_funcs.TransmitFile), &dwTmp, NULL, NULL)!=0)
+		||(WSAIoctl(s, SIO_GET_EXTENSION_FUNCTION_POINTER, &connect_ex_GUID, sizeof(connect_ex_GUID), &server->ex_funcs.ConnectEx, sizeof(server->ex_funcs.ConnectEx), &dwTmp, NULL, NULL)!=0)) 
+		res = FALSE;
+	socket_close(s, &server->qs_info);
+	return res;
+}
+
+MYDLL_API u_long qs_create(void **qs_instance )
+{
+	int result;
+	int error;
+	WSADATA wsaData;
+	qs_context* server = (qs_context*)malloc(sizeof(qs_context));
+	*qs_instance = server;
+
+	if(*qs_instance)
+	{
+		memset(*qs_instance, 0, sizeof(qs_context));
+
+		result = WSAStartup(MAKEWORD(2,2), &wsaData);
+		if (result != 0) 
+		{
+			error = GetLastError();
+			cry(server, "%s: WSAStartup() fail with error: %d",
+				__func__, error);
+			return error;
+		}
+
+		LARGE_INTEGER frequency;
+		QueryPerformanceFrequency(&frequency);
+		server->qpc_frequency = frequency.QuadPart;
+
+		server->iocp = CreateIoCompletionPort(INVALID_HANDLE_VALUE, 0, 0, 0);
+		if(!server->iocp) 
+		{	
+			error = GetLastError();
+			WSACleanup();
+			cry(server, "%s: CreateIoCompletionPort() fail with error: %d",	__func__, error);
+			return error;
+		}
+
+		if(!init_ex_funcs(server)) 
+		{		
+			error = WSAGetLastError();
+			CloseHandle(server->iocp);
+			WSACleanup();
+			cry(server, "%s: init_ex_funcs() fail with error: %d",	__func__, error);
+			return error;
+		}
+
+		server->udp_drained = CreateEvent(NULL, TRUE, FALSE, NULL);
+		if(!server->udp_drained)
+		{
+			error = GetLastError();
+			CloseHandle(server->iocp);
+			WSACleanup();
+			cry(server, "%s: CreateEvent() fail with error: %d",	__func__, error);
+			return error;
+		}
+		InitializeCriticalSectionAndSpinCount(&server->udp_cs, 0x400);
+
+		return ERROR_SUCCESS;
+	}
+	else return ERROR_ALLOCATE_BUCKET;
+}
+
+MYDLL_API void qs_delete(void *qs_instance )
+{
+	qs_context* server = (qs_context*)qs_instance;
+	if(server && server->udp_drained)
+	{
+		CloseHandle(server->udp_drained);
+		DeleteCriticalSection(&server->udp_cs);
+	}
+	free(qs_instance);
+}
+
+static int parse_ipvX_addr_string(char *addr_buf, int port, union usa *u) 
+{
+#if defined(HAVE_INET_NTOP)
+	// Only Windoze Vista (and newer) have inet_pton()
+	struct in_addr a = {0};
+	struct in6_addr a6 = {0};
+
+	memset(u, 0, sizeof(usa));
+	if (inet_pton(AF_INET6, addr_buf, &a6) > 0) {
+
+		u->sin6.sin6_family = AF_INET6;
+		u->sin6.sin6_port = htons((uint16_t) port);
+		u->sin6.sin6_addr = a6;
+		return 1;
+	} else if (inet_pton(AF_INET, addr_buf, &a) > 0) {
+
+		u->sin.sin_family = AF_INET;
+		u->sin.sin_port = htons((uint16_t) port);
+		u->sin.sin_addr = a;
+		return 1;
+	} else {
+		return 0;
+	}
+#elif defined(HAVE_GETNAMEINFO)
+	struct addrinfo hints = {0};
 	struct addrinfo *rset = NULL;
-#if defined(USE_IPV6)
 	hints.ai_family = AF_UNSPEC;
-#else
-	hints.ai_family = AF_INET;
-#endif
 	hints.ai_socktype = SOCK_STREAM; // TCP
 	hints.ai_flags = AI_NUMERICHOST;
 	if (!getaddrinfo(addr_buf, NULL, &hints, &rset) && rset) {
 		memcpy(&usa->u.sa, rset->ai_addr, rset->ai_addrlen);
-#if defined(USE_IPV6)
 		if (rset->ai_family == PF_INET6) {
 			usa->len = sizeof(usa->u.sin6);
 			assert(rset->ai_addrlen == sizeof(usa->u.sin6));
@@ -363,7 +1388,6 @@ static int parse_ipvX_addr_string(char *addr_buf, int port, union usa *u)
 			freeaddrinfo(rset);
 			return 1;
 		} else
-#endif
 			if (rset->ai_family == PF_INET) {
 				usa->len = sizeof(usa->u.sin);
 				assert(rset->ai_addrlen == sizeof(usa->u.sin));
@@ -382,274 +1406,3158 @@ static int parse_ipvX_addr_string(char *addr_buf, int port, union usa *u)
 	if (sscanf(addr_buf, "%d.%d.%d.%d%n", &a, &b, &c, &d, &len) == 4 //-V112
 		&& len == (int) strlen(addr_buf)) 
 	{
-			// Bind to a specific IPv4 address
-			u->sin.sin_family = AF_INET;
-			u->sin.sin_port = htons((uint16_t) port);
-			u->sin.sin_addr.s_addr = htonl((a << 24) | (b << 16) | (c << 8) | d);
-			return 1;
+			// Bind to a specific IPv4 address
+			u->sin.sin_family = AF_INET;
+			u->sin.sin_port = htons((uint16_t) port);
+			u->sin.sin_addr.s_addr = htonl((a << 24) | (b << 16) | (c << 8) | d);
+			return 1;
+	}
+	return 0;
+#endif
+}
+
+// unix:C:\run\qs.sock is a socket file, unix:@name an abstract name where the
+// system supports them
+static int parse_unix_string(const char *path, union usa *usa) {
+	size_t len = strlen(path);
+	if (len == 0 || len >= sizeof(usa->sun.sun_path)) return 0;
+	usa->sun.sun_family = AF_UNIX;
+	memcpy(usa->sun.sun_path, path, len);
+	if (path[0] == '@') usa->sun.sun_path[0] = '\0';
+	return 1;
+}
+
+// Length of the address for bind() and connect()
+static int usa_len(const union usa *usa) {
+	switch (usa->sa.sa_family) {
+	case AF_INET:
+		return sizeof(usa->sin);
+	case AF_INET6:
+		return sizeof(usa->sin6);
+	case AF_UNIX:
+		// Abstract names are not terminated, their length is the whole name
+		if (usa->sun.sun_path[0] == '\0')
+			return (int) (offsetof(struct sockaddr_un, sun_path) + 1 + strlen(usa->sun.sun_path + 1));
+		return (int) (offsetof(struct sockaddr_un, sun_path) + strlen(usa->sun.sun_path) + 1);
+	default:
+		return sizeof(*usa);
+	}
+}
+
+// IPv4 address as seen by a dual-stack socket, ::ffff:a.b.c.d
+static void usa_map_v4(const union usa *from, union usa *to) {
+	memset(to, 0, sizeof(*to));
+	to->sin6.sin6_family = AF_INET6;
+	to->sin6.sin6_port = from->sin.sin_port;
+	to->sin6.sin6_addr.s6_addr[10] = 0xff;
+	to->sin6.sin6_addr.s6_addr[11] = 0xff;
+	memcpy(&to->sin6.sin6_addr.s6_addr[12], &from->sin.sin_addr, 4);
+}
+
+// Examples: 80, 127.0.0.1:3128, [::1]:3128, unix:C:\run\qs.sock
+static int parse_port_string(const char *addr, struct socket *so) {
+	union usa *usa = &so->lsa;
+	int port, len;
+	char addr_buf[128];
+
+	memset(so, 0, sizeof(*so));
+
+	if (strncmp(addr, "unix:", 5) == 0) {
+		return parse_unix_string(addr + 5, usa);
+	} else if (sscanf(addr, " [%40[^]]]:%d%n", addr_buf, &port, &len) == 2
+		&& len > 0
+		&& parse_ipvX_addr_string(addr_buf, port, usa)) {
+			// all done: probably IPv6 URI
+	} else if (sscanf(addr, " %40[^:]:%d%n", addr_buf, &port, &len) == 2
+		&& len > 0
+		&& parse_ipvX_addr_string(addr_buf, port, usa)) {
+			// all done: probably IPv4 URI
+	} else if (sscanf(addr, "%d%n", &port, &len) != 1 ||
+		len <= 0 ||
+		(addr[len] && strchr("sp, \t", addr[len]) == NULL)) {
+			return 0;
+	} else {
+		// The IPv6 wildcard, dual-stack unless the socket is IPv6 only
+		usa->sin6.sin6_family = AF_INET6;
+		usa->sin6.sin6_port = htons((uint16_t) port);
+	}
+
+	return 1;
+}
+
+// Socket for binding to a parsed address. IPV6_V6ONLY is always set, the
+// system default differs between Windows versions. A wildcard falls back to
+// IPv4 on hosts without an IPv6 stack.
+static SOCKET socket_for_address(union usa *usa, int type, BOOL v6only)
+{
+	int protocol = usa->sa.sa_family == AF_UNIX ? 0 : (type == SOCK_DGRAM ? IPPROTO_UDP : IPPROTO_TCP);
+	DWORD value = v6only ? 1 : 0;
+	SOCKET s = socket(usa->sa.sa_family, type, protocol);
+	u_short port;
+
+	if(s == INVALID_SOCKET && usa->sa.sa_family == AF_INET6 && WSAGetLastError() == WSAEAFNOSUPPORT &&
+		IN6_IS_ADDR_UNSPECIFIED(&usa->sin6.sin6_addr) && !v6only)
+	{
+		port = usa->sin6.sin6_port;
+		memset(usa, 0, sizeof(*usa));
+		usa->sin.sin_family = AF_INET;
+		usa->sin.sin_port = port;
+		return socket(AF_INET, type, protocol);
+	}
+	if(s != INVALID_SOCKET && usa->sa.sa_family == AF_INET6)
+		setsockopt(s, IPPROTO_IPV6, IPV6_V6ONLY, (char *)&value, sizeof(value));
+	return s;
+}
+
+#define THREAD_STACK_SIZE 1024
+#define SCALING_DEFAULT_PERIOD 500
+#define SCALING_DEFAULT_QUEUE_DELAY 2000
+#define SCALING_HIGH_LOAD 85
+#define SCALING_LOW_LOAD 25
+#define SCALING_QUIET_TICKS 4
+#define UPSTREAM_REAP_PERIOD 1000
+unsigned __stdcall working_thread(void *s);
+void WINAPI clean_timer_callback(void * , BOOL );
+void WINAPI scaling_timer_callback(void * , BOOL );
+void WINAPI reap_timer_callback(void * , BOOL );
+void WINAPI keys_timer_callback(void * , BOOL );
+static u_int metrics_start(qs_context *server);
+static void metrics_run(qs_context *server);
+static void metrics_stop(qs_context *server);
+static void upstreams_free(qs_context *server);
+static void udp_close_all(qs_context *server);
+static void listeners_fill(qs_context *server);
+
+// Starts a worker in the first free slot. Caller holds workers_cs.
+static BOOL worker_start(qs_context *server)
+{
+	unsigned int i;
+	for(i = 0; i < server->workers_size; ++i)
+	{
+		worker *w = &server->workers[i];
+		if(w->state != worker_free) continue;
+		w->server = server;
+		w->id = i;
+		w->state = worker_running;
+		w->thread = create_thread(working_thread, w, THREAD_STACK_SIZE);
+		if(!w->thread)
+		{
+			w->state = worker_free;
+			return FALSE;
+		}
+		server->qs_info.worker_threads_count++;
+		return TRUE;
+	}
+	return FALSE;
+}
+
+// Posts a stop packet to every running worker and waits for all started
+// workers, retired ones which were not reaped yet included.
+static void workers_stop(qs_context *server)
+{
+	size_t i;
+	for(i = 0; i<(size_t)server->qs_info.worker_threads_count; i++)
+	{
+		io_context *io_context = alloc_context(server);
+		io_context->ended_operation = stop_server;
+		PostQueuedCompletionStatus(server->iocp, 8, 0, (LPOVERLAPPED)io_context);
+	}
+	for(i = 0; i<(size_t)server->workers_size; i++)
+	{
+		if(server->workers[i].state == worker_free) continue;
+		WaitForSingleObject((HANDLE)server->workers[i].thread, INFINITE);
+		CloseHandle((HANDLE)server->workers[i].thread);
+		server->workers[i].state = worker_free;
+	}
+	server->qs_info.worker_threads_count = 0;
+}
+
+// Closes handles of retired workers which have finished. Caller holds workers_cs.
+static void workers_reap(qs_context *server)
+{
+	unsigned int i;
+	for(i = 0; i < server->workers_size; ++i)
+	{
+		worker *w = &server->workers[i];
+		if(w->state == worker_retired && WaitForSingleObject((HANDLE)w->thread, 0) == WAIT_OBJECT_0)
+		{
+			CloseHandle((HANDLE)w->thread);
+			w->thread = 0;
+			w->state = worker_free;
+		}
+	}
+}
+
+// Callbacks of a listener, the server wide ones fill the gaps
+#define CALLBACK_MERGE(name) to->name = own && own->name ? own->name : common->name
+
+static void callbacks_merge(qs_callbacks *to, const qs_callbacks *own, const qs_callbacks *common)
+{
+	CALLBACK_MERGE(on_connect);
+	CALLBACK_MERGE(on_connect_error);
+	CALLBACK_MERGE(on_disconnect);
+	CALLBACK_MERGE(on_send);
+	CALLBACK_MERGE(on_send_file);
+	CALLBACK_MERGE(on_recv);
+	CALLBACK_MERGE(on_frames);
+	CALLBACK_MERGE(on_error);
+	CALLBACK_MERGE(on_error_event);
+	CALLBACK_MERGE(on_message);
+	CALLBACK_MERGE(on_writable);
+}
+
+// Ticket keys of a TLS listener. Each rotation generates a key for the new
+// tickets while the previous one still opens the tickets issued before it.
+#define TLS_KEY_ROTATION_DEFAULT (12 * 60 * 60 * 1000)
+#define TLS_KEYS_CHECK_PERIOD 1000
+
+static BOOL tls_key_generate(SecPkgCred_SessionTicketKey *key)
+{
+	memset(key, 0, sizeof(*key));
+	key->TicketInfoVersion = SESSION_TICKET_INFO_VERSION;
+	key->KeyingMaterialSize = sizeof(key->KeyingMaterial);
+	return BCryptGenRandom(NULL, key->KeyId, sizeof(key->KeyId), BCRYPT_USE_SYSTEM_PREFERRED_RNG) == 0 &&
+		BCryptGenRandom(NULL, key->KeyingMaterial, sizeof(key->KeyingMaterial), BCRYPT_USE_SYSTEM_PREFERRED_RNG) == 0;
+}
+
+static SECURITY_STATUS tls_keys_rotate(listener_state *l)
+{
+	SecPkgCred_SessionTicketKeys keys;
+	SECURITY_STATUS status;
+	l->tls_keys[1] = l->tls_keys[0];
+	if(!tls_key_generate(&l->tls_keys[0])) return SEC_E_INTERNAL_ERROR;
+	if(l->tls_keys_count < 2) l->tls_keys_count++;
+	keys.cSessionTicketKeys = l->tls_keys_count;
+	keys.pSessionTicketKeys = l->tls_keys;
+	status = SetCredentialsAttributesA(&l->tls_cred, SECPKG_ATTR_SESSION_TICKET_KEYS, &keys, sizeof(keys));
+	// Only SChannel's copy is needed, the retired key is wiped
+	SecureZeroMemory(&l->tls_keys[1], sizeof(l->tls_keys[1]));
+	return status;
+}
+
+// Runs on a pool thread of its own timer, setting the keys is a call into LSA
+static void tls_keys_check(qs_context *server, ULONGLONG now)
+{
+	listener_state *l;
+	SECURITY_STATUS status;
+	u_long i;
+	for(i = 0; i < server->listeners_count; ++i)
+	{
+		l = &server->listeners[i];
+		if(!l->tls_key_rotation || now - l->tls_keys_rotated < l->tls_key_rotation) continue;
+		l->tls_keys_rotated = now;
+		if((status = tls_keys_rotate(l)) != SEC_E_OK) report_error(server, qs_error_tls, (u_long)status, 0);
+	}
+}
+
+void WINAPI keys_timer_callback(void *context, BOOL fTimerOrWaitFired)
+{
+	qs_context *server = (qs_context *)context;
+	tls_keys_check(server, GetTickCount64());
+}
+
+// Server credentials of a TLS listener from its certificate
+static u_int tls_credentials(qs_context *server, listener_state *l)
+{
+	const qs_tls_params *p = l->params.tls;
+	HCERTSTORE store;
+	SCHANNEL_CRED cred;
+	PCCERT_CONTEXT cert = NULL;
+	SECURITY_STATUS status;
+
+	if(p->certificate) cert = CertDuplicateCertificateContext((PCCERT_CONTEXT)p->certificate);
+	else if(p->cert_subject)
+	{
+		store = CertOpenStore(CERT_STORE_PROV_SYSTEM_A, 0, 0, 
+			(p->machine_store ? CERT_SYSTEM_STORE_LOCAL_MACHINE : CERT_SYSTEM_STORE_CURRENT_USER) | CERT_STORE_READONLY_FLAG,
+			p->cert_store ? p->cert_store : "MY");
+		if(store)
+		{
+			cert = CertFindCertificateInStore(store, X509_ASN_ENCODING | PKCS_7_ASN_ENCODING, 0, CERT_FIND_SUBJECT_STR_A, p->cert_subject, NULL);
+			CertCloseStore(store, 0);
+		}
+	}
+	if(!cert)
+	{
+		cry(server, "%s: no certificate for %s", __func__, l->params.listen_adr);
+		return ERROR_NOT_FOUND;
+	}
+
+	memset(&cred, 0, sizeof(cred));
+	cred.dwVersion = SCHANNEL_CRED_VERSION;
+	cred.cCreds = 1;
+	cred.paCred = &cert;
+	cred.dwFlags = SCH_USE_STRONG_CRYPTO;
+	cred.dwSessionLifespan = p->session_lifespan;
+	status = AcquireCredentialsHandleA(NULL, (char *)UNISP_NAME_A, SECPKG_CRED_INBOUND, NULL, &cred, NULL, NULL, &l->tls_cred, NULL);
+	if(status != SEC_E_OK)
+	{
+		CertFreeCertificateContext(cert);
+		cry(server, "%s: AcquireCredentialsHandle() fail with error: 0x%08x", __func__, status);
+		return (u_int)status;
+	}
+	l->tls = TRUE;
+	l->tls_cert = cert;
+	l->tls_timeout = p->handshake_timeout ? p->handshake_timeout : TLS_HANDSHAKE_TIMEOUT;
+	if(p->session_tickets)
+	{
+		if((status = tls_keys_rotate(l)) != SEC_E_OK)
+		{
+			cry(server, "%s: setting session ticket keys fail with error: 0x%08x", __func__, status);
+			return (u_int)status;
+		}
+		l->tls_key_rotation = p->ticket_key_rotation ? p->ticket_key_rotation : TLS_KEY_ROTATION_DEFAULT;
+		l->tls_keys_rotated = GetTickCount64();
+	}
+	return ERROR_SUCCESS;
+}
+
+static void listeners_close(qs_context *server)
+{
+	u_long i;
+	for(i = 0; i < server->listeners_count; ++i)
+	{
+		if(server->listeners[i].socket.sock != INVALID_SOCKET) closesocket(server->listeners[i].socket.sock);
+		if(server->listeners[i].tls)
+		{
+			FreeCredentialsHandle(&server->listeners[i].tls_cred);
+			CertFreeCertificateContext(server->listeners[i].tls_cert);
+			SecureZeroMemory(server->listeners[i].tls_keys, sizeof(server->listeners[i].tls_keys));
+		}
+	}
+	if(server->listeners) free(server->listeners);
+	server->listeners = NULL;
+	server->listeners_count = 0;
+}
+
+// Resolves and binds params.listeners, or params.listener alone
+static u_int listeners_open(qs_context *server)
+{
+	const qs_params *params = &server->qs_params;
+	const qs_listener *list = params->listeners_count ? params->listeners : &params->listener;
+	u_long count = params->listeners_count ? params->listeners_count : 1;
+	listener_state *l;
+	struct socket *so;
+	u_int error;
+	u_long i;
+	int on = 1;
+
+	if(list == NULL) return ERROR_INVALID_PARAMETER;
+	server->listeners = (listener_state *)calloc(count, sizeof(listener_state));
+	if(!server->listeners) return ERROR_NOT_ENOUGH_MEMORY;
+	server->listeners_count = count;
+	for(i = 0; i < count; ++i) server->listeners[i].socket.sock = INVALID_SOCKET;
+
+	for(i = 0; i < count; ++i)
+	{
+		l = &server->listeners[i];
+		so = &l->socket;
+		l->id = i;
+		l->params = list[i];
+		callbacks_merge(&l->callbacks, list[i].callbacks, &params->callbacks);
+		l->buffer_size = list[i].connection_buffer_size ? list[i].connection_buffer_size : params->connection_buffer_size;
+
+		if(!framing_check(&l->params.framing, l->callbacks.on_frames))
+		{
+			cry(server, "%s: invalid framing parameters of listener %lu", __func__, i);
+			listeners_close(server);
+			return ERROR_INVALID_PARAMETER;
+		}
+		if(l->params.tls && (error = tls_credentials(server, l)) != ERROR_SUCCESS)
+		{
+			listeners_close(server);
+			return error;
+		}
+		if(l->params.framing.type != qs_framing_none || params->receive_ring)
+			l->ring_size = ring_size(l->buffer_size);
+		else l->ring_size = 0;
+		if (!parse_port_string(l->params.listen_adr, so))
+		{
+			cry(server, "%s: invalid port spec.\nExpecting list of: %s",
+				__func__, "[IP_ADDRESS:]PORT[s|p] or unix:PATH");
+			listeners_close(server);
+			return ERROR_INVALID_PARAMETER;
+		} 
+		// A socket file left by a previous run would fail the bind
+		if (so->lsa.sa.sa_family == AF_UNIX && so->lsa.sun.sun_path[0] != '\0') DeleteFileA(so->lsa.sun.sun_path);
+		if ((so->sock = socket_for_address(&so->lsa, SOCK_STREAM, l->params.ipv6_only)) ==
+			INVALID_SOCKET ||
+
+			// Set TCP keep-alive. This is needed because if HTTP-level
+			// keep-alive is enabled, and client resets the connection,
+			// server won't get TCP FIN or RST and will keep the connection
+			// open forever. With TCP keep-alive, next keep-alive
+			// handshake will figure out that the client is down and
+			// will close the server end.
+			(so->lsa.sa.sa_family != AF_UNIX && setsockopt(so->sock, SOL_SOCKET, SO_KEEPALIVE, (char *) &on,
+			sizeof(on)) != 0) ||
+			bind(so->sock, &so->lsa.sa, usa_len(&so->lsa)) != 0 ||
+			listen(so->sock, SOMAXCONN) != 0)
+		{
+			error = GetLastError();
+			cry(server, "%s: cannot bind to %s, error: %d", __func__, l->params.listen_adr, error);
+			listeners_close(server);
+			return error;
+		} 
+	}
+	return ERROR_SUCCESS;
+}
+
+MYDLL_API unsigned int qs_start( void *qs_instance, qs_params * params )
+{
+	qs_context* server;
+	size_t i;
+	io_context *io_context;
+	struct _qs_params::_scaling scaling;
+	u_int error;
+
+	if(!qs_instance || !params) return ERROR_INVALID_PARAMETER;
+	server = (qs_context*)qs_instance;	
+	if(server->status == runned) return ERROR_ALREADY_EXISTS;
+
+	memcpy(&server->qs_params, params, sizeof(qs_params));
+
+	if((error = listeners_open(server)) != ERROR_SUCCESS) return error;
+
+	if((error = metrics_start(server)) != ERROR_SUCCESS)
+	{
+		listeners_close(server);
+		return error;
+	}
+
+	if (server->qs_params.max_count_of_connections == 0) server->qs_params.max_count_of_connections = 10000;
+	server->storage = connection_storage_new(server->qs_params.max_count_of_connections);
+	if(!server->storage)
+	{
+		metrics_stop(server);
+		listeners_close(server);
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+	server->groups = groups_new();
+	if(!server->groups)
+	{
+		connection_storage_free(server->storage);
+		server->storage = NULL;
+		metrics_stop(server);
+		listeners_close(server);
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	if(!error_queue_start(server))
+	{
+		error = GetLastError();
+		groups_free(server->groups);
+		server->groups = NULL;
+		connection_storage_free(server->storage);
+		server->storage = NULL;
+		metrics_stop(server);
+		listeners_close(server);
+		return error != ERROR_SUCCESS ? error : ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	for(i = 0; i < (size_t)server->listeners_count; ++i)
+	{
+		SOCKET sock = server->listeners[i].socket.sock;
+		CreateIoCompletionPort((HANDLE)sock, server->iocp, sock, 0);
+	}
+
+	server->qs_info.sockets_count = 0;
+	server->qs_info.send_bytes = 0;
+	server->qs_info.buffer_memory = 0;
+
+	scaling = server->qs_params.scaling;
+	if(scaling.max_worker_threads)
+	{
+		if(scaling.min_worker_threads == 0) scaling.min_worker_threads = 1;
+		if(scaling.max_worker_threads < scaling.min_worker_threads) scaling.max_worker_threads = scaling.min_worker_threads;
+		if(scaling.period == 0) scaling.period = SCALING_DEFAULT_PERIOD;
+		if(scaling.queue_delay_threshold == 0) scaling.queue_delay_threshold = SCALING_DEFAULT_QUEUE_DELAY;
+		if(server->qs_params.worker_threads_count < scaling.min_worker_threads) server->qs_params.worker_threads_count = scaling.min_worker_threads;
+		if(server->qs_params.worker_threads_count > scaling.max_worker_threads) server->qs_params.worker_threads_count = scaling.max_worker_threads;
+		server->qs_params.scaling = scaling;
+		server->workers_size = scaling.max_worker_threads;
+	}
+	else server->workers_size = server->qs_params.worker_threads_count;
+
+	server->qs_info.worker_threads_count = 0;
+	server->workers = (worker *)nedmemalign(64, sizeof(worker) * (size_t)server->workers_size);
+	memset(server->workers, 0, sizeof(worker) * (size_t)server->workers_size);
+	InitializeCriticalSectionAndSpinCount(&server->workers_cs, 0x400);
+	InitializeCriticalSectionAndSpinCount(&server->connects_cs, 0x400);
+	server->connects = NULL;
+	server->connects_checked = 0;
+	InitializeCriticalSectionAndSpinCount(&server->upstreams_cs, 0x400);
+	server->upstreams = NULL;
+	server->endpoints = NULL;
+	server->udp_refs = 1;
+	ResetEvent(server->udp_drained);
+	memset(&server->scaling, 0, sizeof(scaling_state));
+	memset(&server->external_stats, 0, sizeof(qs_worker_stats));
+	server->clock = (LONGLONG)GetTickCount64();
+	server->date_seconds = 0;
+	date_update(server);
+	CreateTimerQueueTimer(&server->clock_timer, NULL, (WAITORTIMERCALLBACK)clock_timer_callback, server, 
+		CLOCK_RESOLUTION, CLOCK_RESOLUTION, WT_EXECUTEINTIMERTHREAD);
+	server->external_trace.head = 0;
+	server->started = qpc_now();
+
+	EnterCriticalSection(&server->workers_cs);
+	for(i = 0; i<(size_t)server->qs_params.worker_threads_count; ++i)
+	{
+		if(!worker_start(server)) break;
+	}
+	LeaveCriticalSection(&server->workers_cs);
+	if(i < (size_t)server->qs_params.worker_threads_count)
+	{
+		error = GetLastError();
+		cry(server, "qs_start: cannot create worker threads, error: %lu", error);
+		workers_stop(server);
+		DeleteTimerQueueTimer(NULL, server->clock_timer, INVALID_HANDLE_VALUE);
+		DeleteCriticalSection(&server->workers_cs);
+		DeleteCriticalSection(&server->connects_cs);
+		DeleteCriticalSection(&server->upstreams_cs);
+		free(server->workers);
+		server->workers = NULL;
+		error_queue_stop(server);
+		groups_free(server->groups);
+		server->groups = NULL;
+		connection_storage_free(server->storage);
+		server->storage = NULL;
+		metrics_stop(server);
+		listeners_close(server);
+		return error != ERROR_SUCCESS ? error : ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	io_context = alloc_context(server);
+	io_context->ended_operation = start_server;
+
+	u_long idle_check_period = server->qs_params.connections_idle_timeout;
+	if(idle_check_period)
+	{
+		CreateTimerQueueTimer(&server->timer, NULL, (WAITORTIMERCALLBACK)clean_timer_callback, server,  idle_check_period,  idle_check_period/2, NULL);
+	}
+
+	CreateTimerQueueTimer(&server->reap_timer, NULL, (WAITORTIMERCALLBACK)reap_timer_callback, server, 
+		UPSTREAM_REAP_PERIOD, UPSTREAM_REAP_PERIOD, NULL);
+	server->keys_timer = NULL;
+	for(i = 0; i < (size_t)server->listeners_count; ++i)
+	{
+		if(!server->listeners[i].tls_key_rotation) continue;
+		CreateTimerQueueTimer(&server->keys_timer, NULL, (WAITORTIMERCALLBACK)keys_timer_callback, server, 
+			TLS_KEYS_CHECK_PERIOD, TLS_KEYS_CHECK_PERIOD, NULL);
+		break;
+	}
+
+	if(server->qs_params.scaling.max_worker_threads)
+	{
+		server->probe_ctx = alloc_context(server);
+		server->probe_ctx->ended_operation = queue_probe;
+		server->scaling_ctx = alloc_context(server);
+		server->scaling_ctx->ended_operation = retire_worker;
+		server->scaling.last_tick = qpc_now();
+		CreateTimerQueueTimer(&server->scaling.timer, NULL, (WAITORTIMERCALLBACK)scaling_timer_callback, server, 
+			server->qs_params.scaling.period, server->qs_params.scaling.period, NULL);
+	}
+
+	PostQueuedCompletionStatus(server->iocp, 8, 0, (LPOVERLAPPED)io_context);
+	server->status = runned;
+	metrics_run(server);
+	return ERROR_SUCCESS;
+
+}
+
+static void idle_check(connection *con)
+{
+	io_context *context = get_context(con);
+	ULONGLONG now = clock_now(context->server_ctx);
+	if(now - context->last_activity > context->server_ctx->qs_params.connections_idle_timeout)
+	{
+		shutdown(con->socket.sock, SD_BOTH);
+	}
+}
+
+void WINAPI clean_timer_callback(void * context, BOOL fTimerOrWaitFired)
+{
+	qs_context * server = (qs_context *)context;
+	connection_storage *storage = server->storage;
+	connection_storage_traverse(storage, idle_check);
+}
+
+// Worker pool controller. The completion port gives no queue length, so the wait
+// is measured with a probe packet posted each tick, the callbacks load from the
+// busy time of the workers, and the depth is estimated from both by Little's law.
+void WINAPI scaling_timer_callback(void * context, BOOL fTimerOrWaitFired)
+{
+	qs_context *server = (qs_context *)context;
+	struct _qs_params::_scaling *scaling = &server->qs_params.scaling;
+	LONGLONG now, elapsed;
+	ULONGLONG busy_time = 0, completions = 0;
+	u_long running, load, rate, delay;
+	unsigned int i;
+
+	if(InterlockedCompareExchange(&server->scaling.in_tick, 1, 0) != 0) return;
+	EnterCriticalSection(&server->workers_cs);
+	workers_reap(server);
+
+	now = qpc_now();
+	elapsed = now - server->scaling.last_tick;
+	for(i = 0; i < server->workers_size; ++i)
+	{
+		busy_time += server->workers[i].stats.callbacks_time;
+		completions += server->workers[i].stats.completions;
+	}
+	running = server->qs_info.worker_threads_count;
+	if(elapsed <= 0 || running == 0) goto done;
+
+	// A probe still waiting in the port has been queued at least since it was posted
+	if(server->scaling.probe_pending)
+	{
+		delay = (u_long)qpc_to_us(server, now - server->scaling.probe_posted);
+		if(delay > server->qs_info.queue_delay) server->qs_info.queue_delay = delay;
+	}
+	delay = server->qs_info.queue_delay;
+
+	// Slots keep their counters across restarts, so the sums only grow
+	load = busy_time > server->scaling.last_busy_time ? 
+		(u_long)((busy_time - server->scaling.last_busy_time) * 100 / (elapsed * running)) : 0;
+	rate = completions > server->scaling.last_completions ? 
+		(u_long)((completions - server->scaling.last_completions) * server->qpc_frequency / elapsed) : 0;
+	server->qs_info.callbacks_load = load > 100 ? 100 : load;
+	server->qs_info.completions_per_second = rate;
+	server->qs_info.queue_depth = (u_long)((ULONGLONG)rate * delay / 1000000);
+
+	if((delay > scaling->queue_delay_threshold || load > SCALING_HIGH_LOAD) && running < scaling->max_worker_threads)
+	{
+		server->scaling.quiet_ticks = 0;
+		if(worker_start(server)) server->qs_info.workers_added++;
+	}
+	else if(delay < scaling->queue_delay_threshold / 4 && load < SCALING_LOW_LOAD && running > scaling->min_worker_threads)
+	{
+		if(++server->scaling.quiet_ticks >= SCALING_QUIET_TICKS)
+		{
+			server->scaling.quiet_ticks = 0;
+			server->qs_info.worker_threads_count--;
+			server->qs_info.workers_retired++;
+			PostQueuedCompletionStatus(server->iocp, 8, 0, (LPOVERLAPPED)server->scaling_ctx);
+		}
+	}
+	else server->scaling.quiet_ticks = 0;
+
+done:
+	server->scaling.last_tick = now;
+	server->scaling.last_busy_time = busy_time;
+	server->scaling.last_completions = completions;
+	if(InterlockedCompareExchange(&server->scaling.probe_pending, 1, 0) == 0)
+	{
+		server->scaling.probe_posted = qpc_now();
+		PostQueuedCompletionStatus(server->iocp, 8, 0, (LPOVERLAPPED)server->probe_ctx);
+	}
+	LeaveCriticalSection(&server->workers_cs);
+	InterlockedExchange(&server->scaling.in_tick, 0);
+}
+
+MYDLL_API unsigned int qs_stop( void *qs_instance )
+{
+	qs_context* server = (qs_context*)qs_instance;
+	size_t i;
+
+	u_long idle_check_period = server->qs_params.connections_idle_timeout;
+	server->status = not_runned;
+	metrics_stop(server);
+	if(idle_check_period)
+	{
+		DeleteTimerQueueTimer(NULL, server->timer, NULL);
+	}
+	if(server->qs_params.scaling.max_worker_threads)
+	{
+		// Wait for a running controller tick, it may be starting a worker
+		DeleteTimerQueueTimer(NULL, server->scaling.timer, INVALID_HANDLE_VALUE);
+	}
+	// Evictions close connections through the workers
+	DeleteTimerQueueTimer(NULL, server->reap_timer, INVALID_HANDLE_VALUE);
+	if(server->keys_timer) DeleteTimerQueueTimer(NULL, server->keys_timer, INVALID_HANDLE_VALUE);
+	udp_close_all(server);
+	workers_stop(server);
+
+	CloseHandle(server->iocp);
+	connection_storage_free(server->storage);
+	groups_free(server->groups);
+	if(server->qs_params.scaling.max_worker_threads)
+	{
+		free_context(server, server->probe_ctx);
+		free_context(server, server->scaling_ctx);
+	}
+	error_queue_stop(server);
+	DeleteTimerQueueTimer(NULL, server->clock_timer, INVALID_HANDLE_VALUE);
+	listeners_close(server);
+	DeleteCriticalSection(&server->workers_cs);
+	DeleteCriticalSection(&server->connects_cs);
+	upstreams_free(server);
+	DeleteCriticalSection(&server->upstreams_cs);
+	free(server->workers);
+	neddisablethreadcache(0);
+	server->qs_info.sockets_count = 0;
+	server->qs_info.active_connections_count = 0;
+	server->qs_info.worker_threads_count = 0;
+	server->status = not_runned;
+
+	return ERROR_SUCCESS;
+}
+
+// Tells the dispatching worker that a callback posted an operation of its
+// connection, which may now complete on another thread at any moment.
+__inline static void mark_issued(io_context *context)
+{
+	if(current_worker && current_worker->delivering == context) current_worker->issued = TRUE;
+}
+
+__inline static char ring_at(recv_ring *ring, u_long offset)
+{
+	u_long pos = ring->start + offset;
+	if(pos >= ring->size) pos -= ring->size;
+	return ring->data[pos];
+}
+
+// Position of the delimiter behind the frame at offset, -1 while it is not buffered.
+// The search resumes at ring->scanned.
+static long ring_find_delimiter(recv_ring *ring, const framing_params *f, u_long offset, u_long avail)
+{
+	u_long i = ring->scanned, pos, span, k;
+	const char *hit;
+
+	while(i + f->delimiter_len <= avail)
+	{
+		pos = ring->start + offset + i;
+		if(pos >= ring->size) pos -= ring->size;
+		span = ring->size - pos;
+		if(span > avail - i) span = avail - i;
+		hit = (const char *)memchr(ring->data + pos, f->delimiter[0], span);
+		if(!hit)
+		{
+			i += span;
+			continue;
+		}
+		i += (u_long)(hit - (ring->data + pos));
+		if(i + f->delimiter_len > avail) break;
+		for(k = 1; k < f->delimiter_len && ring_at(ring, offset + i + k) == f->delimiter[k]; ++k);
+		if(k == f->delimiter_len)
+		{
+			ring->scanned = 0;
+			return (long)i;
+		}
+		++i;
+	}
+	// A delimiter cut by the end of the data is looked at again
+	ring->scanned = avail >= f->delimiter_len ? avail - f->delimiter_len + 1 : 0;
+	return -1;
+}
+
+// 1 when a complete frame starts at offset, 0 when more data is needed and -1
+// when the frame can never fit into the ring
+static int frame_parse(recv_ring *ring, const framing_params *f, u_long offset, u_long *header_len, u_long *len, u_long *skip)
+{
+	u_long avail = ring->used - offset, i;
+	ULONGLONG value = 0;
+	LONGLONG payload;
+	unsigned char b;
+	long found;
+
+	switch(f->type)
+	{
+	case qs_framing_fixed:
+		if(avail < f->header_size) return 0;
+		for(i = 0; i < f->length_size; ++i)
+		{
+			b = (unsigned char)ring_at(ring, offset + f->length_offset + (f->big_endian ? i : f->length_size - 1 - i));
+			value = value << 8 | b;
+		}
+		payload = (LONGLONG)value + f->length_adjustment;
+		if(payload < 0 || payload > (LONGLONG)(ring->size - f->header_size)) return -1;
+		*header_len = f->header_size;
+		*len = f->header_size + (u_long)payload;
+		*skip = *len;
+		break;
+
+	case qs_framing_varint:
+		for(i = 0; ; ++i)
+		{
+			if(i == 5) return -1;
+			if(i == avail) return 0;
+			b = (unsigned char)ring_at(ring, offset + i);
+			value |= (ULONGLONG)(b & 0x7F) << (7 * i);
+			if(!(b & 0x80)) break;
+		}
+		if(value > ring->size - (i + 1)) return -1;
+		*header_len = i + 1;
+		*len = i + 1 + (u_long)value;
+		*skip = *len;
+		break;
+
+	case qs_framing_delimiter:
+		if((found = ring_find_delimiter(ring, f, offset, avail)) < 0) return 0;
+		*header_len = 0;
+		*len = (u_long)found;
+		*skip = *len + f->delimiter_len;
+		return 1;
+
+	default:
+		return -1;
+	}
+	return avail >= *skip ? 1 : 0;
+}
+
+// Collects up to FRAMES_BATCH complete frames and consumes them from the ring.
+static u_long frames_collect(recv_ring *ring, const framing_params *f, BOOL *invalid)
+{
+	u_long count = 0, offset = 0, header_len, len, skip, pos;
+	qs_frame *frame;
+	int res = 0;
+
+	while(count < FRAMES_BATCH && (res = frame_parse(ring, f, offset, &header_len, &len, &skip)) > 0)
+	{
+		frame = &ring->frames[count++];
+		pos = ring->start + offset;
+		if(pos >= ring->size) pos -= ring->size;
+		if(ring->mirrored || pos + len <= ring->size) frame->data = ring->data + pos;
+		else
+		{
+			memcpy(ring->data + ring->size, ring->data + pos, ring->size - pos);
+			memcpy(ring->data + ring->size + (ring->size - pos), ring->data, len - (ring->size - pos));
+			frame->data = ring->data + ring->size;
+		}
+		frame->len = len;
+		frame->header_len = header_len;
+		offset += skip;
+	}
+	*invalid = res < 0;
+	ring->pending = count == FRAMES_BATCH;
+	ring->start += offset;
+	if(ring->start >= ring->size) ring->start -= ring->size;
+	ring->used -= offset;
+	ring->held = offset;
+	return count;
+}
+
+// Decrypts the next buffered record. SEC_E_INCOMPLETE_MESSAGE while it is not
+// received completely, SEC_I_CONTEXT_EXPIRED after the close_notify of the peer.
+// Renegotiation is not supported and ends the connection like an error.
+static SECURITY_STATUS tls_decrypt(tls_session *t)
+{
+	SecBuffer b[4];
+	SecBufferDesc desc;
+	SECURITY_STATUS status;
+	u_long i, end = t->in_start + t->in_len;
+
+	if(!t->in_len) return SEC_E_INCOMPLETE_MESSAGE;
+	b[0].BufferType = SECBUFFER_DATA;
+	b[0].pvBuffer = t->in + t->in_start;
+	b[0].cbBuffer = t->in_len;
+	for(i = 1; i < 4; ++i)
+	{
+		b[i].BufferType = SECBUFFER_EMPTY;
+		b[i].pvBuffer = NULL;
+		b[i].cbBuffer = 0;
+	}
+	desc.ulVersion = SECBUFFER_VERSION;
+	desc.cBuffers = 4;
+	desc.pBuffers = b;
+	EnterCriticalSection(&t->lock);
+	status = DecryptMessage(&t->ctx, &desc, 0, NULL);
+	LeaveCriticalSection(&t->lock);
+	if(status != SEC_E_OK) return status;
+	t->in_start = end;
+	t->in_len = 0;
+	for(i = 1; i < 4; ++i)
+	{
+		if(b[i].BufferType == SECBUFFER_DATA)
+		{
+			t->plain = (char *)b[i].pvBuffer;
+			t->plain_len = b[i].cbBuffer;
+		}
+		else if(b[i].BufferType == SECBUFFER_EXTRA)
+		{
+			t->in_start = end - b[i].cbBuffer;
+			t->in_len = b[i].cbBuffer;
+		}
+	}
+	return SEC_E_OK;
+}
+
+// Copies decrypted data into the receive target, decrypting buffered records
+// while there is room. Returns the bytes copied; when none, status tells whether
+// more records have to be received or the input has ended.
+static u_long tls_fill(tls_session *t, SECURITY_STATUS *status)
+{
+	u_long i = 0, offset = 0, total = 0, n;
+	*status = SEC_E_OK;
+	while(i < t->target_count)
+	{
+		if(!t->plain_len)
+		{
+			if(t->closed) *status = t->closed;
+			else if((*status = tls_decrypt(t)) == SEC_E_OK) continue;
+			else if(*status != SEC_E_INCOMPLETE_MESSAGE) t->closed = *status;
+			break;
+		}
+		n = t->target[i].len - offset;
+		if(n > t->plain_len) n = t->plain_len;
+		memcpy(t->target[i].buf + offset, t->plain, n);
+		t->plain += n;
+		t->plain_len -= n;
+		offset += n;
+		total += n;
+		if(offset == t->target[i].len)
+		{
+			i++;
+			offset = 0;
+		}
+	}
+	return total;
+}
+
+// Receives more records behind the buffered ones
+static unsigned int tls_socket_recv(io_context *context, states operation)
+{
+	tls_session *t = context->tls;
+	WSABUF wsabuf;
+	u_long bytes_recv, flags = 0;
+	int error;
+
+	if(t->in_start)
+	{
+		memmove(t->in, t->in + t->in_start, t->in_len);
+		t->in_start = 0;
+	}
+	if(t->in_len == TLS_BUFFER_SIZE) return ERROR_INSUFFICIENT_BUFFER;
+	wsabuf.buf = t->in + t->in_len;
+	wsabuf.len = TLS_BUFFER_SIZE - t->in_len;
+	context->ended_operation = operation;
+	context->posted = qpc_now();
+	if(WSARecv(context->connection.socket.sock, &wsabuf, 1, &bytes_recv, &flags, (LPOVERLAPPED)context, 0) == SOCKET_ERROR &&
+		(error = WSAGetLastError()) != WSA_IO_PENDING)
+	{
+		return error;
+	}
+	return ERROR_SUCCESS;
+}
+
+// Receive of a TLS connection. With data already decrypted or buffered it
+// completes right away through the port, like a receive finding data waiting.
+static unsigned int tls_recv_post(io_context *context, const WSABUF *target, u_long count)
+{
+	tls_session *t = context->tls;
+	SECURITY_STATUS status;
+	u_long n;
+
+	memcpy(t->target, target, count * sizeof(WSABUF));
+	t->target_count = count;
+	n = tls_fill(t, &status);
+	if(n || status != SEC_E_INCOMPLETE_MESSAGE)
+	{
+		// An ended input completes with 0 bytes, which is a disconnect
+		if(!n && status != SEC_I_CONTEXT_EXPIRED)
+		{
+			STAT_ERROR(context->server_ctx, qs_error_tls);
+			report_error(context->server_ctx, qs_error_tls, (u_long)status, context->connection.id);
+		}
+		t->delivered = TRUE;
+		PostQueuedCompletionStatus(context->server_ctx->iocp, n, 0, (LPOVERLAPPED)context);
+		return ERROR_SUCCESS;
+	}
+	return tls_socket_recv(context, recv_done);
+}
+
+static unsigned int tls_out_post(io_context *context)
+{
+	tls_session *t = context->tls;
+	WSABUF wsabuf;
+	u_long bytes_send;
+	int error;
+	wsabuf.buf = t->out + t->out_sent;
+	wsabuf.len = t->out_len - t->out_sent;
+	if(WSASend(context->connection.socket.sock, &wsabuf, 1, &bytes_send, 0, (LPOVERLAPPED)context, 0) == SOCKET_ERROR &&
+		(error = WSAGetLastError()) != WSA_IO_PENDING)
+	{
+		return error;
+	}
+	return ERROR_SUCCESS;
+}
+
+// Encrypts len bytes of plaintext placed behind the header of a record. Called
+// with the lock held.
+static SECURITY_STATUS tls_seal(tls_session *t, char *record, u_long len, u_long *record_len)
+{
+	SecBuffer b[4];
+	SecBufferDesc desc;
+	SECURITY_STATUS status;
+	b[0].BufferType = SECBUFFER_STREAM_HEADER;
+	b[0].pvBuffer = record;
+	b[0].cbBuffer = t->sizes.cbHeader;
+	b[1].BufferType = SECBUFFER_DATA;
+	b[1].pvBuffer = record + t->sizes.cbHeader;
+	b[1].cbBuffer = len;
+	b[2].BufferType = SECBUFFER_STREAM_TRAILER;
+	b[2].pvBuffer = record + t->sizes.cbHeader + len;
+	b[2].cbBuffer = t->sizes.cbTrailer;
+	b[3].BufferType = SECBUFFER_EMPTY;
+	b[3].pvBuffer = NULL;
+	b[3].cbBuffer = 0;
+	desc.ulVersion = SECBUFFER_VERSION;
+	desc.cBuffers = 4;
+	desc.pBuffers = b;
+	if((status = EncryptMessage(&t->ctx, 0, &desc, 0)) != SEC_E_OK) return status;
+	*record_len = b[0].cbBuffer + b[1].cbBuffer + b[2].cbBuffer;
+	return SEC_E_OK;
+}
+
+// Encrypts the rest of the pending send into records until the output buffer is
+// full and sends them. Small buffers of a send queue are gathered into full records.
+static unsigned int tls_send_next(io_context *context)
+{
+	tls_session *t = context->tls;
+	SECURITY_STATUS status = SEC_E_OK;
+	u_long overhead = t->sizes.cbHeader + t->sizes.cbTrailer;
+	u_long room, n, len, record_len;
+	unsigned int error;
+	char *data;
+
+	EnterCriticalSection(&t->lock);
+	t->out_len = t->out_sent = 0;
+	while(t->out_len + overhead < TLS_BUFFER_SIZE)
+	{
+		room = TLS_BUFFER_SIZE - t->out_len - overhead;
+		if(room > t->sizes.cbMaximumMessage) room = t->sizes.cbMaximumMessage;
+		data = t->out + t->out_len + t->sizes.cbHeader;
+		for(n = 0; n < room && t->source_index < t->source_count; n += len)
+		{
+			len = t->source[t->source_index].len - t->source_offset;
+			if(len > room - n) len = room - n;
+			memcpy(data + n, t->source[t->source_index].buf + t->source_offset, len);
+			t->source_offset += len;
+			if(t->source_offset == t->source[t->source_index].len)
+			{
+				t->source_index++;
+				t->source_offset = 0;
+			}
+		}
+		if(!n) break;
+		if((status = tls_seal(t, t->out + t->out_len, n, &record_len)) != SEC_E_OK) break;
+		t->out_len += record_len;
+		t->source_total += n;
+	}
+	if(status != SEC_E_OK) error = (unsigned int)status;
+	else if(!t->out_len) error = ERROR_NO_DATA;
+	else error = tls_out_post(context);
+	LeaveCriticalSection(&t->lock);
+	return error;
+}
+
+static void tls_send_finish(io_context *context);
+
+// Send of a TLS connection. The send completes once all of its records are sent.
+static unsigned int tls_send_post(io_context *context, const WSABUF *source, u_long count)
+{
+	tls_session *t = context->tls;
+	unsigned int error;
+	t->source = source;
+	t->source_count = count;
+	t->source_index = 0;
+	t->source_offset = 0;
+	t->source_total = 0;
+	EnterCriticalSection(&t->lock);
+	t->sending = TRUE;
+	LeaveCriticalSection(&t->lock);
+	if((error = tls_send_next(context)) != ERROR_SUCCESS) tls_send_finish(context);
+	return error;
+}
+
+static unsigned int ring_recv_post(io_context *context)
+{
+	recv_ring *ring = context->ring;
+	connection *connection = &context->connection;
+	u_long pos, len, count, bytes_recv, flags = 0;
+	int res;
+	int error;
+
+	// Views of the last batch are released unless its on_frames is still running here
+	if(!current_worker || current_worker->delivering != context) ring->held = 0;
+	len = ring->size - ring->used - ring->held;
+	context->posted = qpc_now();
+	if(context->listener->params.framing.type == qs_framing_none)
+	{
+		// Without framing the application consumes, a full ring is its error
+		if(len == 0) return ERROR_INSUFFICIENT_BUFFER;
+	}
+	else if(ring->pending || len == 0)
+	{
+		context->ended_operation = frames_ready;
+		PostQueuedCompletionStatus(context->server_ctx->iocp, 0, 0, (LPOVERLAPPED)context);
+		return ERROR_SUCCESS;
+	}
+
+	context->ended_operation = recv_done;
+	pos = ring->start + ring->used;
+	if(pos >= ring->size) pos -= ring->size;
+	ring->free[0].buf = ring->data + pos;
+	if(ring->mirrored || pos + len <= ring->size)
+	{
+		ring->free[0].len = len;
+		count = 1;
+	}
+	else
+	{
+		ring->free[0].len = ring->size - pos;
+		ring->free[1].buf = ring->data;
+		ring->free[1].len = len - ring->free[0].len;
+		count = 2;
+	}
+	if(context->tls) return tls_recv_post(context, ring->free, count);
+	res = WSARecv(connection->socket.sock, ring->free, count, &bytes_recv, &flags, (LPOVERLAPPED)context, 0);
+	if ((res == SOCKET_ERROR) && (WSA_IO_PENDING != (error = WSAGetLastError())))
+	{
+		STAT_ERROR(context->server_ctx, qs_error_recv);
+		return error;
+	}
+	return ERROR_SUCCESS;
+}
+
+// Backpressure. Send bytes are charged when a send is posted and released when
+// it completes. A receive asked for while the connection is over its limits is
+// held; once its sends drain to half the connection limit it is posted again
+// through the connection's own OVERLAPPED, free while the receive waits.
+typedef struct _qs_params::_limits limits_params;
+
+static void send_charge(io_context *context, u_long bytes)
+{
+	InterlockedExchangeAdd(&context->send_pending, (LONG)bytes);
+	InterlockedExchangeAdd64(&context->server_ctx->qs_info.send_bytes, (LONGLONG)bytes);
+}
+
+static void send_release(io_context *context, u_long bytes)
+{
+	qs_context *server = context->server_ctx;
+	LONG pending;
+	if(!bytes) return;
+	pending = InterlockedExchangeAdd(&context->send_pending, -(LONG)bytes) - (LONG)bytes;
+	InterlockedExchangeAdd64(&server->qs_info.send_bytes, -(LONGLONG)bytes);
+	if(context->recv_held && (u_long)pending <= server->qs_params.limits.connection_send_bytes / 2 && 
+		InterlockedExchange(&context->recv_held, 0))
+	{
+		// The packet holds a reference, the sender may drop the last one right after
+		InterlockedIncrement(&context->refs);
+		context->ended_operation = writable;
+		PostQueuedCompletionStatus(server->iocp, 0, 0, (LPOVERLAPPED)context);
+	}
+}
+
+// TRUE when bytes more would exceed the limits. Only connections with sends of
+// their own wait for the server wide limit, nothing would wake the others.
+static BOOL send_over_limits(io_context *context, u_long bytes)
+{
+	const limits_params *limits = &context->server_ctx->qs_params.limits;
+	if(limits->connection_send_bytes && (u_long)context->send_pending + bytes > limits->connection_send_bytes) return TRUE;
+	return limits->send_bytes && (context->send_pending || bytes) && 
+		(ULONGLONG)context->server_ctx->qs_info.send_bytes + bytes > limits->send_bytes;
+}
+
+MYDLL_API unsigned int qs_send(connection *connection)
+{
+	io_context *context;
+	int  res;
+	int  error;
+	u_long bytes_send;
+	if(!connection) return ERROR_INVALID_PARAMETER;
+	context = get_context(connection);
+	mark_issued(context);
+	context->ended_operation = send_done;
+	context->posted = qpc_now();
+	trace_post(context->server_ctx, context->posted, qs_trace_send_post, connection->id, connection->buffer.data_len);
+	context->send_posted = connection->buffer.data_len;
+	send_charge(context, context->send_posted);
+	if(context->tls)
+	{
+		if((error = tls_send_post(context, (WSABUF *)&(connection->buffer), 1)) != ERROR_SUCCESS) send_release(context, context->send_posted);
+		return error;
+	}
+	res = WSASend(connection->socket.sock, (WSABUF *)&(connection->buffer), 1, &bytes_send, 0, (LPOVERLAPPED)context, 0);
+	if ((res == SOCKET_ERROR) && (WSA_IO_PENDING != (error = WSAGetLastError())))
+	{
+		send_release(context, context->send_posted);
+		STAT_ERROR(context->server_ctx, qs_error_send);
+		return error;
+	}
+	return ERROR_SUCCESS;
+}
+
+MYDLL_API unsigned int qs_send_file( void *qs_instance, connection *connection, HANDLE file)
+{
+	qs_context* server;	
+	io_context *context;
+	int error;
+	if(!qs_instance || !connection || file == INVALID_HANDLE_VALUE) return ERROR_INVALID_PARAMETER;
+	server = (qs_context*)qs_instance;
+	context = get_context(connection);
+	// TransmitFile() would send the file unencrypted
+	if(context->tls) return ERROR_NOT_SUPPORTED;
+	mark_issued(context);
+	context->ended_operation = transmit_file;
+	context->posted = qpc_now();
+	trace_post(server, context->posted, qs_trace_send_post, connection->id, 0);
+	if(!server->ex_funcs.TransmitFile(connection->socket.sock, file, 0, 0, (LPOVERLAPPED)context, 0, TF_DISCONNECT | TF_USE_KERNEL_APC) &&
+		(error = WSAGetLastError()) != WSA_IO_PENDING)
+	{
+		STAT_ERROR(server, qs_error_send);
+		return error;
+	}
+	return ERROR_SUCCESS;
+}
+
+static send_queue *send_queue_get(io_context *context)
+{
+	if(context->sendq || memory_full(context->server_ctx)) return context->sendq;
+	if((context->sendq = send_queue_alloc(context->buffer_size)) != NULL) memory_charge(context, context->buffer_size);
+	return context->sendq;
+}
+
+static unsigned int send_queue_post(io_context *context)
+{
+	send_queue *q = context->sendq;
+	connection *connection = &context->connection;
+	int  res;
+	int  error;
+	u_long bytes_send, i;
+	q->sending = TRUE;
+	context->ended_operation = send_done;
+	context->posted = qpc_now();
+	trace_post(context->server_ctx, context->posted, qs_trace_send_post, connection->id, q->area_used);
+	// References are not in area_used
+	for(context->send_posted = 0, i = 0; i < q->count; ++i) context->send_posted += q->buffers[i].len;
+	send_charge(context, context->send_posted);
+	if(context->tls)
+	{
+		if((error = tls_send_post(context, q->buffers, q->count)) != ERROR_SUCCESS)
+		{
+			q->sending = FALSE;
+			send_release(context, context->send_posted);
+		}
+		return error;
+	}
+	res = WSASend(connection->socket.sock, q->buffers, q->count, &bytes_send, 0, (LPOVERLAPPED)context, 0);
+	if ((res == SOCKET_ERROR) && (WSA_IO_PENDING != (error = WSAGetLastError())))
+	{
+		q->sending = FALSE;
+		send_release(context, context->send_posted);
+		STAT_ERROR(context->server_ctx, qs_error_send);
+		return error;
+	}
+	return ERROR_SUCCESS;
+}
+
+// Free space of the queue area for writing a response in place, see qs_send_commit()
+MYDLL_API char* qs_send_reserve(connection *connection, u_long *available)
+{
+	send_queue *q;
+	if(!connection || !available) return NULL;
+	q = send_queue_get(get_context(connection));
+	if(!q || q->sending || q->count == SEND_QUEUE_BUFFERS) return NULL;
+	*available = q->area_size - q->area_used;
+	return q->area + q->area_used;
+}
+
+// Queues len bytes written at the pointer returned by qs_send_reserve()
+MYDLL_API unsigned int qs_send_commit(connection *connection, u_long len)
+{
+	send_queue *q;
+	WSABUF *last;
+	if(!connection) return ERROR_INVALID_PARAMETER;
+	q = get_context(connection)->sendq;
+	if(!q || q->sending) return ERROR_BUSY;
+	if(len > q->area_size - q->area_used) return ERROR_INSUFFICIENT_BUFFER;
+	if(!len) return ERROR_SUCCESS;
+	last = q->count ? &q->buffers[q->count - 1] : NULL;
+	// Consecutive copies share one buffer of the vector
+	if(last && last->buf + last->len == q->area + q->area_used) last->len += len;
+	else if(q->count == SEND_QUEUE_BUFFERS) return ERROR_INSUFFICIENT_BUFFER;
+	else
+	{
+		q->buffers[q->count].buf = q->area + q->area_used;
+		q->buffers[q->count].len = len;
+		q->count++;
+	}
+	q->area_used += len;
+	return ERROR_SUCCESS;
+}
+
+MYDLL_API unsigned int qs_send_append(connection *connection, const char *data, u_long len)
+{
+	u_long available;
+	char *p;
+	if(!connection || (!data && len)) return ERROR_INVALID_PARAMETER;
+	if(!(p = qs_send_reserve(connection, &available))) return get_context(connection)->sendq ? ERROR_INSUFFICIENT_BUFFER : ERROR_NOT_ENOUGH_MEMORY;
+	if(len > available) return ERROR_INSUFFICIENT_BUFFER;
+	memcpy(p, data, len);
+	return qs_send_commit(connection, len);
+}
+
+// Queues data without copying it. It must stay valid until on_send.
+MYDLL_API unsigned int qs_send_append_ref(connection *connection, const char *data, u_long len)
+{
+	send_queue *q;
+	if(!connection || (!data && len)) return ERROR_INVALID_PARAMETER;
+	if(!(q = send_queue_get(get_context(connection)))) return ERROR_NOT_ENOUGH_MEMORY;
+	if(q->sending) return ERROR_BUSY;
+	if(!len) return ERROR_SUCCESS;
+	if(q->count == SEND_QUEUE_BUFFERS) return ERROR_INSUFFICIENT_BUFFER;
+	q->buffers[q->count].buf = (char *)data;
+	q->buffers[q->count].len = len;
+	q->count++;
+	return ERROR_SUCCESS;
+}
+
+// Sends the queued responses in order with one WSASend
+MYDLL_API unsigned int qs_send_flush(connection *connection)
+{
+	io_context *context;
+	if(!connection) return ERROR_INVALID_PARAMETER;
+	context = get_context(connection);
+	if(!context->sendq || !context->sendq->count) return ERROR_NO_DATA;
+	if(context->sendq->sending) return ERROR_BUSY;
+	mark_issued(context);
+	return send_queue_post(context);
+}
+
+static unsigned int recv_post(io_context *context, u_long offset)
+{
+	connection *connection = &context->connection;
+	int res;
+	int error;
+	u_long bytes_recv;
+	u_long flags = 0;
+	mark_issued(context);
+	if(context->ring) return ring_recv_post(context);
+	context->ended_operation = recv_done;
+	context->recv_offset = offset;
+	context->posted = qpc_now();
+	if(context->tls) return tls_recv_post(context, (WSABUF *)&(connection->buffer), 1);
+	res = WSARecv(connection->socket.sock, (WSABUF *)&(connection->buffer), 1, &bytes_recv, &flags, (LPOVERLAPPED)context, 0);
+	if ((res == SOCKET_ERROR) && (WSA_IO_PENDING != (error = WSAGetLastError())))
+	{
+		STAT_ERROR(context->server_ctx, qs_error_recv);
+		return error;
+	}
+	return ERROR_SUCCESS;
+}
+
+// Holds a receive of a connection over its send limits, see send_release().
+// The flag is checked again, sends may have drained before it was set.
+static BOOL recv_hold(io_context *context, u_long offset)
+{
+	if(!send_over_limits(context, 0)) return FALSE;
+	mark_issued(context);
+	context->held_offset = offset;
+	InterlockedExchange(&context->recv_held, 1);
+	STAT_ADD(context->server_ctx, reads_held, 1);
+	return send_over_limits(context, 0) || !InterlockedExchange(&context->recv_held, 0);
+}
+
+MYDLL_API unsigned int qs_recv(connection *connection)
+{
+	io_context *context;
+	if(!connection) return ERROR_INVALID_PARAMETER;
+	context = get_context(connection);
+	if(recv_hold(context, 0)) return ERROR_SUCCESS;
+	return recv_post(context, 0);
+}
+
+// Receives after the first offset bytes of the connection buffer, which are kept.
+// On completion buffer.buf is the start of the buffer again and buffer.data_len
+// covers the kept bytes together with the bytes_transferred new ones.
+MYDLL_API unsigned int qs_recv_append(connection *connection, u_long offset)
+{
+	io_context *context;
+	if(!connection) return ERROR_INVALID_PARAMETER;
+	context = get_context(connection);
+	if(context->ring) return ERROR_NOT_SUPPORTED;
+	if(offset >= context->buffer_size) return ERROR_INSUFFICIENT_BUFFER;
+	connection->buffer.buf = context->buffer_base + offset;
+	connection->buffer.data_len = context->buffer_size - offset;
+	if(recv_hold(context, offset)) return ERROR_SUCCESS;
+	return recv_post(context, offset);
+}
+
+// Releases the first bytes of connection->input after on_recv has processed them.
+// The rest stays in the ring and the next receive is appended to it.
+MYDLL_API unsigned int qs_recv_consume(connection *connection, u_long bytes)
+{
+	io_context *context;
+	recv_ring *ring;
+	if(!connection) return ERROR_INVALID_PARAMETER;
+	context = get_context(connection);
+	ring = context->ring;
+	if(!ring || context->listener->params.framing.type != qs_framing_none) return ERROR_NOT_SUPPORTED;
+	if(bytes > ring->used) return ERROR_INVALID_PARAMETER;
+	ring->start += bytes;
+	if(ring->start >= ring->size) ring->start -= ring->size;
+	ring->used -= bytes;
+	connection->input.buf = ring->data + ring->start;
+	connection->input.data_len = ring->used;
+	return ERROR_SUCCESS;
+}
+
+MYDLL_API char *qs_buffer_base(connection *connection, u_long *size)
+{
+	io_context *context;
+	if(!connection) return NULL;
+	context = get_context(connection);
+	if(size) *size = context->buffer_size;
+	return context->buffer_base;
+}
+
+// Upstream pool of one destination. Idle connections are kept in a list per
+// worker, so a checkout takes what its own worker released and never contends
+// with the others; threads outside the pool share the last list.
+typedef struct _upstream_idle {
+	CRITICAL_SECTION cs;
+	io_context *head;
+} upstream_idle;
+
+typedef struct _upstream {
+	struct _upstream *next;
+	qs_context *server;
+	union usa remote;
+	qs_upstream_params params;
+	volatile LONG total;        // idle, checked out and connecting
+	volatile LONG idle;
+	u_long lists_count;
+	upstream_idle *lists;
+} upstream;
+
+static unsigned int connect_start(qs_context *server, const union usa *remote, u_long timeout, void *user_data, upstream *pool)
+{
+	io_context *context;
+	union usa local;
+	SOCKET sock;
+	int len, error;
+	if(connection_storage_is_full(server->storage)) return WSAEMFILE;
+	if(memory_full(server)) return ERROR_NOT_ENOUGH_QUOTA;
+	// ConnectEx() is not available for AF_UNIX sockets
+	if(remote->sa.sa_family == AF_UNIX) return ERROR_NOT_SUPPORTED;
+	len = usa_len(remote);
+
+	sock = socket(remote->sa.sa_family, SOCK_STREAM, IPPROTO_TCP);
+	if(sock == INVALID_SOCKET) return WSAGetLastError();
+	InterlockedIncrement(&server->qs_info.sockets_count);
+	// ConnectEx() needs a bound socket
+	memset(&local, 0, sizeof(local));
+	local.sa.sa_family = remote->sa.sa_family;
+	if(bind(sock, &local.sa, len) == SOCKET_ERROR ||
+		CreateIoCompletionPort((HANDLE)sock, server->iocp, 0, 0) == NULL)
+	{
+		error = WSAGetLastError();
+		socket_close(sock, &server->qs_info);
+		return error;
+	}
+
+	// Outbound connections take the settings of the first listener
+	if((context = listener_context(server, server->listeners)) == NULL)
+	{
+		socket_close(sock, &server->qs_info);
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+	context->ended_operation = connect_done;
+	context->connection.id = (u_long)InterlockedIncrement(&server->connections_ids);
+	context->connection.socket.sock = sock;
+	context->connection.outbound = TRUE;
+	context->connection.user_data = user_data;
+	context->upstream = pool;
+	context->posted = qpc_now();
+	if(timeout)
+	{
+		context->connect_deadline = clock_now(server) + timeout;
+		connect_list(server, context);
+	}
+	if(!server->ex_funcs.ConnectEx(sock, &remote->sa, len, NULL, 0, NULL, (LPOVERLAPPED)context) &&
+		(error = WSAGetLastError()) != WSA_IO_PENDING)
+	{
+		STAT_ERROR(server, qs_error_connect);
+		connect_unlist(server, context);
+		context_release(server, context);
+		return error;
+	}
+	return ERROR_SUCCESS;
+}
+
+// Opens a connection to a numeric "address:port" or "[address]:port". On success
+// it gets on_connect and then the callbacks of accepted connections; on failure,
+// or when it is not established within timeout ms (0: the system timeout), it
+// gets on_connect_error. user_data is set on the connection before either.
+MYDLL_API unsigned int qs_connect( void *qs_instance, const char *address, u_long timeout, void *user_data )
+{
+	qs_context *server;
+	struct socket remote;
+	if(!qs_instance || !address) return ERROR_INVALID_PARAMETER;
+	server = (qs_context*)qs_instance;
+	if(server->status != runned) return ERROR_NOT_READY;
+	if(!parse_port_string(address, &remote)) return ERROR_INVALID_PARAMETER;
+	return connect_start(server, &remote.lsa, timeout, user_data, NULL);
+}
+
+__inline static upstream_idle *upstream_list(upstream *pool)
+{
+	if(current_worker && current_worker->server == pool->server) return &pool->lists[current_worker - pool->server->workers];
+	return &pool->lists[pool->lists_count - 1];
+}
+
+// Caller holds the lock of the list
+static void upstream_unlink(upstream *pool, upstream_idle *list, io_context *context)
+{
+	if(context->idle_prev) context->idle_prev->idle_next = context->idle_next;
+	else list->head = context->idle_next;
+	if(context->idle_next) context->idle_next->idle_prev = context->idle_prev;
+	context->idle_list = NULL;
+	InterlockedDecrement(&pool->idle);
+}
+
+// A readable idle socket was closed by the peer or got data nobody asked for
+static BOOL upstream_healthy(io_context *context)
+{
+	fd_set readable;
+	struct timeval zero = {0, 0};
+	FD_ZERO(&readable);
+	FD_SET(context->connection.socket.sock, &readable);
+	return select(0, &readable, NULL, NULL, &zero) == 0;
+}
+
+static void upstream_evict(qs_context *server, io_context *context)
+{
+	InterlockedIncrement(&server->qs_info.upstream_evictions);
+	qs_close_connection(server, &context->connection);
+}
+
+// The connection is closing or failed to connect, it no longer counts against the pool
+static void upstream_detach(io_context *context)
+{
+	upstream *pool = context->upstream;
+	upstream_idle *list;
+	if(!pool) return;
+	if((list = context->idle_list) != NULL)
+	{
+		EnterCriticalSection(&list->cs);
+		if(context->idle_list == list) upstream_unlink(pool, list, context);
+		LeaveCriticalSection(&list->cs);
+	}
+	InterlockedDecrement(&pool->total);
+	context->upstream = NULL;
+}
+
+// Closes idle connections which timed out or failed the health check. Runs on
+// a pool thread of its own timer, the health checks are system calls.
+static void upstreams_reap(qs_context *server, ULONGLONG now)
+{
+	upstream *pool;
+	upstream_idle *list;
+	io_context *context, *next;
+	u_long i;
+	if(!server->upstreams) return;
+	EnterCriticalSection(&server->upstreams_cs);
+	for(pool = server->upstreams; pool; pool = pool->next)
+	{
+		for(i = 0; i < pool->lists_count; i++)
+		{
+			list = &pool->lists[i];
+			EnterCriticalSection(&list->cs);
+			for(context = list->head; context; context = next)
+			{
+				next = context->idle_next;
+				if((pool->params.idle_timeout && now - context->idle_since >= pool->params.idle_timeout) || !upstream_healthy(context))
+				{
+					upstream_unlink(pool, list, context);
+					upstream_evict(server, context);
+				}
+			}
+			LeaveCriticalSection(&list->cs);
+		}
+	}
+	LeaveCriticalSection(&server->upstreams_cs);
+}
+
+void WINAPI reap_timer_callback(void *context, BOOL fTimerOrWaitFired)
+{
+	qs_context *server = (qs_context *)context;
+	upstreams_reap(server, clock_now(server));
+}
+
+static void upstreams_free(qs_context *server)
+{
+	upstream *pool, *next;
+	u_long i;
+	for(pool = server->upstreams; pool; pool = next)
+	{
+		next = pool->next;
+		for(i = 0; i < pool->lists_count; i++)
+		{
+			DeleteCriticalSection(&pool->lists[i].cs);
+		}
+		qs_memory_free(pool->lists);
+		qs_memory_free(pool);
+	}
+	server->upstreams = NULL;
+}
+
+// Pools live until qs_stop(). address is numeric as for qs_connect().
+MYDLL_API void* qs_upstream_create( void *qs_instance, const char *address, const qs_upstream_params *params )
+{
+	qs_context *server;
+	upstream *pool;
+	struct socket remote;
+	u_long i;
+	if(!qs_instance || !address || !params) return NULL;
+	server = (qs_context*)qs_instance;
+	if(server->status != runned || !parse_port_string(address, &remote)) return NULL;
+	if(!(pool = (upstream *)qs_memory_alloc(sizeof(upstream)))) return NULL;
+	memset(pool, 0, sizeof(upstream));
+	pool->server = server;
+	pool->remote = remote.lsa;
+	pool->params = *params;
+	pool->lists_count = server->workers_size + 1;
+	if(!(pool->lists = (upstream_idle *)qs_memory_alloc(sizeof(upstream_idle) * pool->lists_count)))
+	{
+		qs_memory_free(pool);
+		return NULL;
+	}
+	for(i = 0; i < pool->lists_count; i++)
+	{
+		InitializeCriticalSectionAndSpinCount(&pool->lists[i].cs, 0x400);
+		pool->lists[i].head = NULL;
+	}
+	EnterCriticalSection(&server->upstreams_cs);
+	pool->next = server->upstreams;
+	server->upstreams = pool;
+	LeaveCriticalSection(&server->upstreams_cs);
+	return pool;
+}
+
+// Checks out a connection of the pool. An idle connection released on this worker
+// is returned at once with ERROR_SUCCESS; otherwise a new one is opened and
+// ERROR_IO_PENDING returned, it arrives in on_connect or on_connect_error.
+// ERROR_BUSY means the pool has max_active connections.
+MYDLL_API unsigned int qs_upstream_acquire( void *upstream_pool, void *user_data, connection **connection )
+{
+	upstream *pool;
+	upstream_idle *list;
+	io_context *context;
+	qs_context *server;
+	unsigned int error;
+	if(!upstream_pool || !connection) return ERROR_INVALID_PARAMETER;
+	pool = (upstream *)upstream_pool;
+	server = pool->server;
+	list = upstream_list(pool);
+	*connection = NULL;
+	for(;;)
+	{
+		EnterCriticalSection(&list->cs);
+		if((context = list->head) != NULL) upstream_unlink(pool, list, context);
+		LeaveCriticalSection(&list->cs);
+		if(!context) break;
+		if(upstream_healthy(context))
+		{
+			InterlockedIncrement(&server->qs_info.upstream_hits);
+			context->connection.user_data = user_data;
+			context->connection.buffer.buf = context->buffer_base;
+			context->connection.buffer.data_len = context->buffer_size;
+			*connection = &context->connection;
+			return ERROR_SUCCESS;
+		}
+		upstream_evict(server, context);
+	}
+	if((u_long)InterlockedIncrement(&pool->total) > pool->params.max_active && pool->params.max_active)
+	{
+		InterlockedDecrement(&pool->total);
+		return ERROR_BUSY;
+	}
+	InterlockedIncrement(&server->qs_info.upstream_misses);
+	if((error = connect_start(server, &pool->remote, pool->params.connect_timeout, user_data, pool)) != ERROR_SUCCESS)
+	{
+		InterlockedDecrement(&pool->total);
+		return error;
+	}
+	return ERROR_IO_PENDING;
+}
+
+// Returns a checked out connection to the pool of this worker, or closes it when
+// reuse is FALSE, the pool has max_idle connections or unsent or unread data is
+// left. No operation may be pending and the connection is not used afterwards.
+MYDLL_API unsigned int qs_upstream_release( connection *connection, BOOL reuse )
+{
+	io_context *context;
+	upstream *pool;
+	upstream_idle *list;
+	if(!connection) return ERROR_INVALID_PARAMETER;
+	context = get_context(connection);
+	if(!(pool = context->upstream) || context->idle_list) return ERROR_INVALID_PARAMETER;
+	// From here on another thread may check the connection out
+	mark_issued(context);
+	if(context->sendq && (context->sendq->count || context->sendq->sending)) reuse = FALSE;
+	if(context->ring && context->ring->used) reuse = FALSE;
+	if(reuse && (u_long)InterlockedIncrement(&pool->idle) > pool->params.max_idle)
+	{
+		InterlockedDecrement(&pool->idle);
+		reuse = FALSE;
+	}
+	if(!reuse) return qs_close_connection(context->server_ctx, connection);
+	list = upstream_list(pool);
+	context->idle_since = clock_now(context->server_ctx);
+	EnterCriticalSection(&list->cs);
+	context->idle_prev = NULL;
+	context->idle_next = list->head;
+	if(list->head) list->head->idle_prev = context;
+	list->head = context;
+	context->idle_list = list;
+	LeaveCriticalSection(&list->cs);
+	return ERROR_SUCCESS;
+}
+
+MYDLL_API unsigned int qs_close_connection( void *qs_instance, connection *connection )
+{
+	qs_context* server;	
+	io_context *context;
+	if(!qs_instance || !connection) return ERROR_INVALID_PARAMETER;
+	server = (qs_context*)qs_instance;
+	context = get_context(connection);
+	mark_issued(context);
+	// A held receive must not be resumed on the OVERLAPPED reused here
+	InterlockedExchange(&context->recv_held, 0);
+	context->ended_operation = on_disconnect;
+	// A socket which is no longer connected still has to reach on_disconnect
+	if(!server->ex_funcs.DisconnectEx(connection->socket.sock, (LPOVERLAPPED)context, 0, 0) && WSAGetLastError() != WSA_IO_PENDING)
+	{
+		PostQueuedCompletionStatus(server->iocp, 0, 0, (LPOVERLAPPED)context);
+	}
+	return ERROR_SUCCESS;
+}
+
+MYDLL_API unsigned int qs_post_message_to_pool(void *qs_instance, void *message, connection *connection)
+{
+	qs_context* server;	
+	io_context *context;
+	if(!qs_instance || !connection) return ERROR_INVALID_PARAMETER;
+	server = (qs_context*)qs_instance;
+	context = get_context(connection);
+	mark_issued(context);
+	context->ended_operation = user_message;
+	PostQueuedCompletionStatus(server->iocp, 8, (uintptr_t)message, (LPOVERLAPPED)context);
+	return ERROR_SUCCESS;
+}
+
+// Forwarding pair. Each direction receives into the buffer of the connection it
+// reads from and sends the same buffer to the other one, one chunk at a time,
+// on OVERLAPPEDs of its own; no callback is involved. An end of stream is passed
+// on as a half-close, an error aborts both directions. When nothing is pending
+// any more both connections are closed through the usual on_disconnect path.
+typedef struct _proxy_op {
+	OVERLAPPED ov;
+	states ended_operation;     // proxy_recv, proxy_send
+	struct _proxy *proxy;
+	u_long dir;
+} proxy_op;
+
+typedef struct _proxy_direction {
+	proxy_op recv_op;
+	proxy_op send_op;
+	io_context *from;
+	io_context *to;
+	WSABUF wsabuf;
+	u_long len;                 // bytes of the chunk received
+	u_long sent;                // of them sent
+} proxy_direction;
+
+typedef struct _proxy {
+	qs_context *server;
+	proxy_direction dirs[2];
+	volatile LONG pending;      // operations in flight, the last one closes the pair
+	volatile LONG aborted;
+} proxy;
+
+static void proxy_abort(proxy *p)
+{
+	if(InterlockedExchange(&p->aborted, 1)) return;
+	shutdown(p->dirs[0].from->connection.socket.sock, SD_BOTH);
+	shutdown(p->dirs[1].from->connection.socket.sock, SD_BOTH);
+	CancelIoEx((HANDLE)p->dirs[0].from->connection.socket.sock, NULL);
+	CancelIoEx((HANDLE)p->dirs[1].from->connection.socket.sock, NULL);
+}
+
+static void proxy_post(proxy *p, proxy_direction *d, BOOL send)
+{
+	u_long bytes, flags = 0;
+	int res, error;
+	if(p->aborted) return;
+	InterlockedIncrement(&p->pending);
+	if(send)
+	{
+		d->wsabuf.buf = d->from->buffer_base + d->sent;
+		d->wsabuf.len = d->len - d->sent;
+		res = WSASend(d->to->connection.socket.sock, &d->wsabuf, 1, &bytes, 0, (LPOVERLAPPED)&d->send_op, 0);
+	}
+	else
+	{
+		d->wsabuf.buf = d->from->buffer_base;
+		d->wsabuf.len = d->from->buffer_size;
+		res = WSARecv(d->from->connection.socket.sock, &d->wsabuf, 1, &bytes, &flags, (LPOVERLAPPED)&d->recv_op, 0);
+	}
+	if(res == SOCKET_ERROR && (error = WSAGetLastError()) != WSA_IO_PENDING)
+	{
+		STAT_ERROR(p->server, send ? qs_error_send : qs_error_recv);
+		report_error(p->server, send ? qs_error_send : qs_error_recv, error, d->from->connection.id);
+		InterlockedDecrement(&p->pending);
+		proxy_abort(p);
+	}
+}
+
+static void proxy_finish(proxy *p)
+{
+	io_context *a = p->dirs[0].from, *b = p->dirs[1].from;
+	qs_context *server = p->server;
+	qs_memory_free(p);
+	qs_close_connection(server, &a->connection);
+	qs_close_connection(server, &b->connection);
+}
+
+// Forwards everything between two connections until both ends are closed. Neither
+// may have a pending operation; the application does not use them afterwards,
+// they come back only in on_disconnect. Data already received is not forwarded.
+MYDLL_API unsigned int qs_proxy( connection *client, connection *upstream )
+{
+	io_context *a, *b;
+	proxy *p;
+	u_long i;
+	if(!client || !upstream || client == upstream) return ERROR_INVALID_PARAMETER;
+	a = get_context(client);
+	b = get_context(upstream);
+	if(a->server_ctx != b->server_ctx || a->proxy || b->proxy) return ERROR_INVALID_PARAMETER;
+	if(a->tls || b->tls) return ERROR_NOT_SUPPORTED;
+	if(!(p = (proxy *)qs_memory_alloc(sizeof(proxy)))) return ERROR_NOT_ENOUGH_MEMORY;
+	memset(p, 0, sizeof(proxy));
+	p->server = a->server_ctx;
+	p->dirs[0].from = a;
+	p->dirs[0].to = b;
+	p->dirs[1].from = b;
+	p->dirs[1].to = a;
+	for(i = 0; i < 2; i++)
+	{
+		p->dirs[i].recv_op.ended_operation = proxy_recv;
+		p->dirs[i].send_op.ended_operation = proxy_send;
+		p->dirs[i].recv_op.proxy = p->dirs[i].send_op.proxy = p;
+		p->dirs[i].recv_op.dir = p->dirs[i].send_op.dir = i;
+	}
+	a->proxy = b->proxy = p;
+	mark_issued(a);
+	mark_issued(b);
+	// Held until both receives are posted, so an early failure cannot finish the pair
+	p->pending = 1;
+	proxy_post(p, &p->dirs[0], FALSE);
+	proxy_post(p, &p->dirs[1], FALSE);
+	if(InterlockedDecrement(&p->pending) == 0) proxy_finish(p);
+	return ERROR_SUCCESS;
+}
+
+// Bytes forwarded by qs_proxy() from and to the connection, valid until its
+// on_disconnect returns
+MYDLL_API unsigned int qs_proxy_bytes( connection *connection, ULONGLONG *received, ULONGLONG *sent )
+{
+	io_context *context;
+	if(!connection) return ERROR_INVALID_PARAMETER;
+	context = get_context(connection);
+	if(received) *received = context->proxy_received;
+	if(sent) *sent = context->proxy_sent;
+	return ERROR_SUCCESS;
+}
+
+static void proxy_complete(worker *self, proxy_op *op, u_long bytes, BOOL success)
+{
+	proxy *p = op->proxy;
+	proxy_direction *d = &p->dirs[op->dir];
+	ULONGLONG now = clock_now(self->server);
+	if(!success) proxy_abort(p);
+	else if(op->ended_operation == proxy_recv)
+	{
+		d->from->last_activity = now;
+		if(!bytes)
+		{
+			// End of stream of this direction, the other one may still run
+			shutdown(d->to->connection.socket.sock, SD_SEND);
+		}
+		else
+		{
+			self->stats.bytes_received += bytes;
+			d->from->proxy_received += bytes;
+			d->len = bytes;
+			d->sent = 0;
+			proxy_post(p, d, TRUE);
+		}
+	}
+	else
+	{
+		self->stats.bytes_sent += bytes;
+		d->to->proxy_sent += bytes;
+		d->to->last_activity = now;
+		d->sent += bytes;
+		proxy_post(p, d, d->sent < d->len);
+	}
+	if(InterlockedDecrement(&p->pending) == 0) proxy_finish(p);
+}
+
+// UDP endpoint. recv_depth receives stay posted, each with its own buffer which
+// is passed to on_datagram and posted again. With coalescing the stack merges
+// datagrams of one sender into a receive (URO) and splits batched sends (USO),
+// so one completion carries many datagrams. Send buffers come from a lock-free
+// pool and return to it on completion.
+#ifndef UDP_SEND_MSG_SIZE
+#define UDP_SEND_MSG_SIZE 2
+#endif
+#ifndef UDP_RECV_MAX_COALESCED_SIZE
+#define UDP_RECV_MAX_COALESCED_SIZE 3
+#endif
+#ifndef UDP_COALESCED_INFO
+#define UDP_COALESCED_INFO 3
+#endif
+
+#define UDP_DEFAULT_DEPTH 16
+#define UDP_DEFAULT_BUFFER 2048
+#define UDP_COALESCED_BUFFER 65535
+
+typedef struct _udp_op {
+	OVERLAPPED ov;
+	states ended_operation;     // udp_recv, udp_send
+	struct _udp_endpoint *endpoint;
+	SLIST_ENTRY entry;          // link in the pool of send buffers
+	WSABUF wsabuf;
+	union usa addr;
+	int addr_len;
+	u_long flags;
+	WSAMSG msg;
+	char control[32];           // UDP_COALESCED_INFO, UDP_SEND_MSG_SIZE
+	char data[1];
+} udp_op;
+
+typedef struct _udp_endpoint {
+	SLIST_HEADER send_pool;
+	struct _udp_endpoint *next;
+	qs_context *server;
+	SOCKET sock;
+	int family;                     // of the socket, IPv4 destinations of an IPv6 one are mapped
+	qs_udp_params params;
+	BOOL coalesce_recv;
+	BOOL coalesce_send;
+	volatile LONG closing;
+	volatile LONG refs;             // the open endpoint and its operations not completed
+	LPFN_WSARECVMSG WSARecvMsg;
+	udp_op **recv_ops;
+} udp_endpoint;
+
+static udp_op *udp_op_alloc(udp_endpoint *ep)
+{
+	udp_op *op = (udp_op *)nedmemalign(MEMORY_ALLOCATION_ALIGNMENT, sizeof(udp_op) + ep->params.buffer_size);
+	if(!op) return NULL;
+	memset(op, 0, sizeof(udp_op));
+	op->endpoint = ep;
+	return op;
+}
+
+static unsigned int udp_recv_post(udp_endpoint *ep, udp_op *op)
+{
+	int res, error;
+	InterlockedIncrement(&ep->refs);
+	memset(&op->ov, 0, sizeof(op->ov));
+	op->ended_operation = udp_recv;
+	op->wsabuf.buf = op->data;
+	op->wsabuf.len = ep->params.buffer_size;
+	if(ep->coalesce_recv)
+	{
+		op->msg.name = &op->addr.sa;
+		op->msg.namelen = sizeof(op->addr);
+		op->msg.lpBuffers = &op->wsabuf;
+		op->msg.dwBufferCount = 1;
+		op->msg.Control.buf = op->control;
+		op->msg.Control.len = sizeof(op->control);
+		op->msg.dwFlags = 0;
+		res = ep->WSARecvMsg(ep->sock, &op->msg, NULL, &op->ov, NULL);
+	}
+	else
+	{
+		op->flags = 0;
+		op->addr_len = sizeof(op->addr);
+		res = WSARecvFrom(ep->sock, &op->wsabuf, 1, NULL, &op->flags, &op->addr.sa, &op->addr_len, &op->ov, NULL);
+	}
+	if(res == SOCKET_ERROR && (error = WSAGetLastError()) != WSA_IO_PENDING)
+	{
+		// The caller holds a reference of its own
+		InterlockedDecrement(&ep->refs);
+		STAT_ERROR(ep->server, qs_error_recv);
+		return error;
+	}
+	return ERROR_SUCCESS;
+}
+
+// Segment size of a coalesced receive, the whole receive is one datagram without it
+static u_long udp_segment_size(udp_op *op, u_long bytes)
+{
+	WSACMSGHDR *cmsg;
+	if(!op->endpoint->coalesce_recv) return bytes;
+	for(cmsg = WSA_CMSG_FIRSTHDR(&op->msg); cmsg; cmsg = WSA_CMSG_NXTHDR(&op->msg, cmsg))
+	{
+		if(cmsg->cmsg_level == IPPROTO_UDP && cmsg->cmsg_type == UDP_COALESCED_INFO) return *(DWORD *)WSA_CMSG_DATA(cmsg);
+	}
+	return bytes;
+}
+
+// Frees the endpoint once it is closed and its last operation has completed.
+// Send buffers are all back in the pool by then.
+static void udp_endpoint_release(udp_endpoint *ep)
+{
+	qs_context *server = ep->server;
+	SLIST_ENTRY *entry;
+	u_long i;
+	if(InterlockedDecrement(&ep->refs) != 0) return;
+	if(ep->recv_ops)
+	{
+		for(i = 0; i < ep->params.recv_depth; i++)
+		{
+			if(ep->recv_ops[i]) nedfree(ep->recv_ops[i]);
+		}
+		qs_memory_free(ep->recv_ops);
+	}
+	while((entry = InterlockedPopEntrySList(&ep->send_pool)) != NULL)
+	{
+		nedfree(CONTAINING_RECORD(entry, udp_op, entry));
+	}
+	nedfree(ep);
+	if(InterlockedDecrement(&server->udp_refs) == 0) SetEvent(server->udp_drained);
+}
+
+static void udp_complete(worker *self, udp_op *op, u_long bytes, BOOL success)
+{
+	udp_endpoint *ep = op->endpoint;
+	u_long segment, offset;
+	unsigned int error;
+	if(op->ended_operation == udp_send)
+	{
+		if(success) self->stats.bytes_sent += bytes;
+		else self->stats.errors[qs_error_send]++;
+		InterlockedPushEntrySList(&ep->send_pool, &op->entry);
+		udp_endpoint_release(ep);
+		return;
+	}
+	// Receives cancelled by udp_endpoint_close() are not posted again. The
+	// operation holds its reference until it is done, a repost racing with
+	// the close fails on the closed socket.
+	if(ep->closing)
+	{
+		udp_endpoint_release(ep);
+		return;
+	}
+	if(success)
+	{
+		self->stats.bytes_received += bytes;
+		segment = udp_segment_size(op, bytes);
+		if(!segment) segment = bytes;
+		offset = 0;
+		do
+		{
+			ep->params.on_datagram(ep, &op->addr, op->data + offset, bytes - offset < segment ? bytes - offset : segment, ep->params.user_data);
+			offset += segment;
+		} while(offset < bytes);
+	}
+	// A truncated datagram fails its receive, the buffer is simply posted again
+	else self->stats.errors[qs_error_recv]++;
+	if((error = udp_recv_post(ep, op)) != ERROR_SUCCESS) report_error(self->server, qs_error_recv, error, 0);
+	udp_endpoint_release(ep);
+}
+
+// Closes the socket and drops the reference of the open endpoint. The workers
+// complete the cancelled operations, the last one frees the endpoint.
+static void udp_endpoint_close(qs_context *server, udp_endpoint *ep)
+{
+	InterlockedExchange(&ep->closing, TRUE);
+	socket_close(ep->sock, &server->qs_info);
+	udp_endpoint_release(ep);
+}
+
+// Opens an endpoint bound to "port" or "address:port"; on_datagram is called on the
+// workers for every datagram received. Endpoints are closed by qs_udp_close() or
+// by qs_stop().
+MYDLL_API void* qs_udp_open( void *qs_instance, const char *address, const qs_udp_params *params )
+{
+	qs_context *server;
+	udp_endpoint *ep;
+	struct socket so;
+	GUID recv_msg_GUID = WSAID_WSARECVMSG;
+	BOOL off = FALSE;
+	DWORD value;
+	u_long bytes, i;
+	unsigned int error;
+	int len;
+	if(!qs_instance || !address || !params || !params->on_datagram) return NULL;
+	server = (qs_context*)qs_instance;
+	if(server->status != runned || !parse_port_string(address, &so) || so.lsa.sa.sa_family == AF_UNIX) return NULL;
+	if(!(ep = (udp_endpoint *)nedmemalign(MEMORY_ALLOCATION_ALIGNMENT, sizeof(udp_endpoint)))) return NULL;
+	memset(ep, 0, sizeof(udp_endpoint));
+	InitializeSListHead(&ep->send_pool);
+	ep->server = server;
+	ep->params = *params;
+	if(!ep->params.recv_depth) ep->params.recv_depth = UDP_DEFAULT_DEPTH;
+	if(!ep->params.buffer_size) ep->params.buffer_size = params->coalesce ? UDP_COALESCED_BUFFER : UDP_DEFAULT_BUFFER;
+
+	ep->sock = socket_for_address(&so.lsa, SOCK_DGRAM, FALSE);
+	ep->family = so.lsa.sa.sa_family;
+	if(ep->sock == INVALID_SOCKET)
+	{
+		nedfree(ep);
+		return NULL;
+	}
+	InterlockedIncrement(&server->qs_info.sockets_count);
+	len = usa_len(&so.lsa);
+	if(bind(ep->sock, &so.lsa.sa, len) == SOCKET_ERROR || CreateIoCompletionPort((HANDLE)ep->sock, server->iocp, 0, 0) == NULL)
+	{
+		cry(server, "%s: bind() fail with error: %d", __func__, WSAGetLastError());
+		socket_close(ep->sock, &server->qs_info);
+		nedfree(ep);
+		return NULL;
+	}
+	// From here on the endpoint is freed through udp_endpoint_close()
+	ep->refs = 1;
+	InterlockedIncrement(&server->udp_refs);
+	// ICMP port unreachable would otherwise fail the next receive
+	WSAIoctl(ep->sock, SIO_UDP_CONNRESET, &off, sizeof(off), NULL, 0, &bytes, NULL, NULL);
+	if(params->socket_buffer)
+	{
+		setsockopt(ep->sock, SOL_SOCKET, SO_RCVBUF, (char *)&params->socket_buffer, sizeof(params->socket_buffer));
+		setsockopt(ep->sock, SOL_SOCKET, SO_SNDBUF, (char *)&params->socket_buffer, sizeof(params->socket_buffer));
+	}
+	if(params->coalesce)
+	{
+		// Both offloads are optional, older systems reject the options
+		value = ep->params.buffer_size;
+		ep->coalesce_recv = setsockopt(ep->sock, IPPROTO_UDP, UDP_RECV_MAX_COALESCED_SIZE, (char *)&value, sizeof(value)) == 0 &&
+			WSAIoctl(ep->sock, SIO_GET_EXTENSION_FUNCTION_POINTER, &recv_msg_GUID, sizeof(recv_msg_GUID), &ep->WSARecvMsg, sizeof(ep->WSARecvMsg), &bytes, NULL, NULL) == 0;
+		len = sizeof(value);
+		ep->coalesce_send = getsockopt(ep->sock, IPPROTO_UDP, UDP_SEND_MSG_SIZE, (char *)&value, &len) == 0;
+	}
+
+	if(!(ep->recv_ops = (udp_op **)qs_memory_alloc(sizeof(udp_op *) * ep->params.recv_depth)))
+	{
+		udp_endpoint_close(server, ep);
+		return NULL;
+	}
+	memset(ep->recv_ops, 0, sizeof(udp_op *) * ep->params.recv_depth);
+	// An endpoint with fewer receives than asked for is not opened
+	for(i = 0; i < ep->params.recv_depth; i++)
+	{
+		error = (ep->recv_ops[i] = udp_op_alloc(ep)) != NULL ? udp_recv_post(ep, ep->recv_ops[i]) : ERROR_NOT_ENOUGH_MEMORY;
+		if(error != ERROR_SUCCESS)
+		{
+			cry(server, "%s: posting receive %u fail with error: %u", __func__, i, error);
+			udp_endpoint_close(server, ep);
+			return NULL;
+		}
+	}
+	EnterCriticalSection(&server->udp_cs);
+	ep->next = server->endpoints;
+	server->endpoints = ep;
+	LeaveCriticalSection(&server->udp_cs);
+	return ep;
+}
+
+// The endpoint must not be used once this returns. Its operations in flight are
+// cancelled, on_datagram may still run for receives which completed before.
+MYDLL_API unsigned int qs_udp_close( void *qs_instance, void *endpoint )
+{
+	qs_context *server = (qs_context*)qs_instance;
+	udp_endpoint *ep = (udp_endpoint *)endpoint, **link;
+	BOOL found;
+	if(!server || !ep) return ERROR_INVALID_PARAMETER;
+	EnterCriticalSection(&server->udp_cs);
+	// Only the pointer is compared, a closed endpoint may be freed already
+	for(link = &server->endpoints; *link && *link != ep; link = &(*link)->next);
+	if((found = *link != NULL)) *link = ep->next;
+	LeaveCriticalSection(&server->udp_cs);
+	if(!found) return ERROR_NOT_FOUND;
+	udp_endpoint_close(server, ep);
+	return ERROR_SUCCESS;
+}
+
+// Sends count datagrams of segment_size bytes each, stored back to back, to one
+// destination. With segmentation offload they leave in a single send. The data is
+// copied, at most buffer_size bytes per call.
+MYDLL_API unsigned int qs_udp_send_batch( void *endpoint, const union usa *to, const char *data, u_long segment_size, u_long count )
+{
+	udp_endpoint *ep = (udp_endpoint *)endpoint;
+	SLIST_ENTRY *entry;
+	WSACMSGHDR *cmsg;
+	udp_op *op;
+	u_long i, total;
+	int res, error, len;
+	if(!ep || !to || !data || !segment_size || !count) return ERROR_INVALID_PARAMETER;
+	if(ep->closing) return WSAENOTSOCK;
+	if(count > 1 && !ep->coalesce_send)
+	{
+		for(i = 0; i < count; i++)
+		{
+			if((error = qs_udp_send_batch(ep, to, data + i * segment_size, segment_size, 1)) != ERROR_SUCCESS) return error;
+		}
+		return ERROR_SUCCESS;
+	}
+	total = segment_size * count;
+	if(total > ep->params.buffer_size) return ERROR_INSUFFICIENT_BUFFER;
+	if((entry = InterlockedPopEntrySList(&ep->send_pool)) != NULL) op = CONTAINING_RECORD(entry, udp_op, entry);
+	else if(!(op = udp_op_alloc(ep))) return ERROR_NOT_ENOUGH_MEMORY;
+	// Referenced before the socket is used, see udp_endpoint_close()
+	InterlockedIncrement(&ep->refs);
+	if(ep->closing)
+	{
+		InterlockedPushEntrySList(&ep->send_pool, &op->entry);
+		udp_endpoint_release(ep);
+		return WSAENOTSOCK;
+	}
+
+	memset(&op->ov, 0, sizeof(op->ov));
+	op->ended_operation = udp_send;
+	memcpy(op->data, data, total);
+	op->wsabuf.buf = op->data;
+	op->wsabuf.len = total;
+	if(ep->family == AF_INET6 && to->sa.sa_family == AF_INET) usa_map_v4(to, &op->addr);
+	else op->addr = *to;
+	len = usa_len(&op->addr);
+	if(count > 1)
+	{
+		memset(op->control, 0, sizeof(op->control));
+		cmsg = (WSACMSGHDR *)op->control;
+		cmsg->cmsg_len = WSA_CMSG_LEN(sizeof(DWORD));
+		cmsg->cmsg_level = IPPROTO_UDP;
+		cmsg->cmsg_type = UDP_SEND_MSG_SIZE;
+		*(DWORD *)WSA_CMSG_DATA(cmsg) = segment_size;
+		op->msg.name = &op->addr.sa;
+		op->msg.namelen = len;
+		op->msg.lpBuffers = &op->wsabuf;
+		op->msg.dwBufferCount = 1;
+		op->msg.Control.buf = op->control;
+		op->msg.Control.len = WSA_CMSG_SPACE(sizeof(DWORD));
+		op->msg.dwFlags = 0;
+		res = WSASendMsg(ep->sock, &op->msg, 0, NULL, &op->ov, NULL);
+	}
+	else res = WSASendTo(ep->sock, &op->wsabuf, 1, NULL, 0, &op->addr.sa, len, &op->ov, NULL);
+	if(res == SOCKET_ERROR && (error = WSAGetLastError()) != WSA_IO_PENDING)
+	{
+		STAT_ERROR(ep->server, qs_error_send);
+		InterlockedPushEntrySList(&ep->send_pool, &op->entry);
+		udp_endpoint_release(ep);
+		return error;
+	}
+	return ERROR_SUCCESS;
+}
+
+MYDLL_API unsigned int qs_udp_send( void *endpoint, const union usa *to, const char *data, u_long len )
+{
+	return qs_udp_send_batch(endpoint, to, data, len, 1);
+}
+
+// Called by qs_stop() while the workers still run, they complete the cancelled
+// operations. Returns when every endpoint, closed here or before, is freed.
+static void udp_close_all(qs_context *server)
+{
+	udp_endpoint *ep, *next;
+	EnterCriticalSection(&server->udp_cs);
+	ep = server->endpoints;
+	server->endpoints = NULL;
+	LeaveCriticalSection(&server->udp_cs);
+	for(; ep; ep = next)
+	{
+		next = ep->next;
+		udp_endpoint_close(server, ep);
+	}
+	if(InterlockedDecrement(&server->udp_refs) == 0) SetEvent(server->udp_drained);
+	WaitForSingleObject(server->udp_drained, INFINITE);
+}
+
+static void stats_add(qs_worker_stats *to, const qs_worker_stats *from)
+{
+	int i;
+	to->completions += from->completions;
+	to->bytes_received += from->bytes_received;
+	to->bytes_sent += from->bytes_sent;
+	to->accepts += from->accepts;
+	to->connects += from->connects;
+	to->tls_handshakes += from->tls_handshakes;
+	to->tls_session_hits += from->tls_session_hits;
+	to->tls_session_misses += from->tls_session_misses;
+	to->disconnects += from->disconnects;
+	to->reads_held += from->reads_held;
+	to->sends_dropped += from->sends_dropped;
+	to->callbacks_time += from->callbacks_time;
+	for(i = 0; i < qs_error_types_count; ++i)
+	{
+		to->errors[i] += from->errors[i];
+	}
+}
+
+MYDLL_API unsigned int qs_query_qs_information( void *qs_instance, qs_info *qs_information )
+{
+	qs_context *server;
+	unsigned int i;
+	if(!qs_instance || !qs_information) return ERROR_INVALID_PARAMETER;
+	server = (qs_context*)qs_instance;
+	memcpy(qs_information, &server->qs_info, sizeof(qs_info));
+	stats_add(&qs_information->totals, &server->external_stats);
+	for(i = 0; i < server->workers_size; ++i)
+	{
+		stats_add(&qs_information->totals, &server->workers[i].stats);
+	}
+	qs_information->totals.callbacks_time = qpc_to_us(server, (LONGLONG)qs_information->totals.callbacks_time);
+	return ERROR_SUCCESS;
+}
+
+MYDLL_API unsigned int qs_query_worker_information( void *qs_instance, unsigned int worker_index, qs_worker_info *worker_information )
+{
+	qs_context *server;
+	worker *w;
+	if(!qs_instance || !worker_information) return ERROR_INVALID_PARAMETER;
+	server = (qs_context*)qs_instance;
+	if(worker_index >= server->workers_size) return ERROR_NO_MORE_ITEMS;
+	w = &server->workers[worker_index];
+	memset(worker_information, 0, sizeof(qs_worker_info));
+	worker_information->running = w->state == worker_running;
+	stats_add(&worker_information->stats, &w->stats);
+	worker_information->stats.callbacks_time = qpc_to_us(server, (LONGLONG)worker_information->stats.callbacks_time);
+	return ERROR_SUCCESS;
+}
+
+static void histograms_collect(qs_context *server, qs_histogram_type type, histogram *merged)
+{
+	unsigned int i;
+	memset(merged, 0, sizeof(histogram));
+	for(i = 0; i < server->workers_size; ++i)
+	{
+		// Workers which have not noticed a reset yet still hold the old values
+		if(server->workers[i].histograms_epoch != server->histograms_epoch) continue;
+		histogram_merge(merged, &server->workers[i].histograms[type]);
 	}
-	return 0;
-#endif
 }
 
-// Examples: 80, 127.0.0.1:3128
-static int parse_port_string(const char *addr, struct socket *so) {
-	union usa *usa = &so->lsa;
-	int port, len;
-	char addr_buf[128];
+MYDLL_API unsigned int qs_query_histogram( void *qs_instance, qs_histogram_type type, qs_histogram *qs_histogram )
+{
+	qs_context *server;
+	histogram *merged;
+	if(!qs_instance || !qs_histogram || (unsigned int)type >= qs_histogram_types_count) return ERROR_INVALID_PARAMETER;
+	server = (qs_context*)qs_instance;
+	merged = (histogram *)qs_memory_alloc(sizeof(histogram));
+	if(!merged) return ERROR_NOT_ENOUGH_MEMORY;
+	histograms_collect(server, type, merged);
+	qs_histogram->count = merged->count;
+	qs_histogram->min = merged->min;
+	qs_histogram->max = merged->max;
+	qs_histogram->mean = merged->count ? merged->sum / merged->count : 0;
+	qs_histogram->p50 = histogram_percentile(merged, 50.0);
+	qs_histogram->p90 = histogram_percentile(merged, 90.0);
+	qs_histogram->p99 = histogram_percentile(merged, 99.0);
+	qs_histogram->p999 = histogram_percentile(merged, 99.9);
+	qs_histogram->p9999 = histogram_percentile(merged, 99.99);
+	qs_memory_free(merged);
+	return ERROR_SUCCESS;
+}
 
-	memset(so, 0, sizeof(*so));
+// Workers clear their own histograms when they see the new epoch, so the
+// recording path stays free of interlocked operations.
+MYDLL_API unsigned int qs_reset_histograms( void *qs_instance )
+{
+	qs_context *server;
+	if(!qs_instance) return ERROR_INVALID_PARAMETER;
+	server = (qs_context*)qs_instance;
+	InterlockedIncrement(&server->histograms_epoch);
+	return ERROR_SUCCESS;
+}
 
-	if (sscanf(addr, " [%40[^]]]:%d%n", addr_buf, &port, &len) == 2
-		&& len > 0
-		&& parse_ipvX_addr_string(addr_buf, port, usa)) {
-			// all done: probably IPv6 URI
-	} else if (sscanf(addr, " %40[^:]:%d%n", addr_buf, &port, &len) == 2
-		&& len > 0
-		&& parse_ipvX_addr_string(addr_buf, port, usa)) {
-			// all done: probably IPv4 URI
-	} else if (sscanf(addr, "%d%n", &port, &len) != 1 ||
-		len <= 0 ||
-		(addr[len] && strchr("sp, \t", addr[len]) == NULL)) {
-			return 0;
-	} else {
-#if defined(USE_IPV6)
-		usa->sin6.sin6_family = AF_INET6;
-		usa->sin6.sin6_port = htons((uint16_t) port);
-#else
-		usa->sin.sin_family = AF_INET;
-		usa->sin.sin_port = htons((uint16_t) port);
-#endif
+#define METRICS_TEXT_SIZE (64 * 1024)
+#define METRICS_HEADER_RESERVE 128
+#define METRICS_RECV_TIMEOUT 1000
+#define METRICS_ACCEPT_BACKOFF 100
+
+static const char *histogram_type_names[qs_histogram_types_count] = {
+	"dispatch", "on_connect", "on_disconnect", "on_recv", "on_send", "on_send_file", "on_message",
+	"recv_in_flight", "send_in_flight", "turnaround"
+};
+
+// Upper bounds of the exported histogram buckets, us
+static const ULONGLONG metrics_buckets[] = {
+	10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000
+};
+
+static void metrics_append(metrics_state *m, const char *fmt, ...)
+{
+	va_list ap;
+	int len;
+	size_t left = METRICS_TEXT_SIZE - m->text_len;
+	if(left <= 1) return;
+	va_start(ap, fmt);
+	len = vsnprintf_s(m->text + m->text_len, left, _TRUNCATE, fmt, ap);
+	va_end(ap);
+	m->text_len = len < 0 ? METRICS_TEXT_SIZE - 1 : m->text_len + len;
+}
+
+static void metrics_family(metrics_state *m, const char *name, const char *type, const char *help)
+{
+	metrics_append(m, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void metrics_value(metrics_state *m, const char *name, const char *type, const char *help, ULONGLONG value)
+{
+	metrics_family(m, name, type, help);
+	metrics_append(m, "%s %I64u\n", name, value);
+}
+
+// Formats the body after METRICS_HEADER_RESERVE bytes of the text buffer.
+// Everything is taken from the preallocated buffers, scrapes never allocate.
+static void metrics_format(qs_context *server, metrics_state *m)
+{
+	qs_info info;
+	histogram *h = m->scratch;
+	unsigned int i, b;
+	u_long j;
+	ULONGLONG cumulative;
+
+	qs_query_qs_information(server, &info);
+	m->text_len = METRICS_HEADER_RESERVE;
+
+	metrics_value(m, "qs_connections", "gauge", "Connections currently open.", info.active_connections_count);
+	metrics_value(m, "qs_sockets", "gauge", "Sockets owned by the server, including pending accepts.", info.sockets_count);
+	metrics_value(m, "qs_worker_threads", "gauge", "Running worker threads.", info.worker_threads_count);
+	metrics_value(m, "qs_workers_added_total", "counter", "Workers started by the scaling controller.", info.workers_added);
+	metrics_value(m, "qs_workers_retired_total", "counter", "Workers retired by the scaling controller.", info.workers_retired);
+	metrics_value(m, "qs_queue_delay_microseconds", "gauge", "Last measured completion queue wait.", info.queue_delay);
+	metrics_value(m, "qs_queue_depth", "gauge", "Estimated completions waiting in the port.", info.queue_depth);
+	metrics_value(m, "qs_callbacks_load_percent", "gauge", "Share of worker time spent dispatching completions.", info.callbacks_load);
+	metrics_value(m, "qs_completions_total", "counter", "Completion packets dispatched.", info.totals.completions);
+	metrics_value(m, "qs_received_bytes_total", "counter", "Bytes received.", info.totals.bytes_received);
+	metrics_value(m, "qs_sent_bytes_total", "counter", "Bytes sent.", info.totals.bytes_sent);
+	metrics_value(m, "qs_accepts_total", "counter", "Accepted connections.", info.totals.accepts);
+	metrics_value(m, "qs_connects_total", "counter", "Outbound connections established.", info.totals.connects);
+	metrics_value(m, "qs_tls_handshakes_total", "counter", "Completed TLS handshakes.", info.totals.tls_handshakes);
+	metrics_value(m, "qs_tls_session_hits_total", "counter", "TLS handshakes that resumed a session.", info.totals.tls_session_hits);
+	metrics_value(m, "qs_tls_session_misses_total", "counter", "Full TLS handshakes.", info.totals.tls_session_misses);
+	metrics_value(m, "qs_upstream_hits_total", "counter", "Upstream checkouts served by an idle connection.", info.upstream_hits);
+	metrics_value(m, "qs_upstream_misses_total", "counter", "Upstream checkouts which opened a connection.", info.upstream_misses);
+	metrics_value(m, "qs_upstream_evictions_total", "counter", "Idle upstream connections closed by timeout or health check.", info.upstream_evictions);
+	metrics_value(m, "qs_disconnects_total", "counter", "Closed connections.", info.totals.disconnects);
+	metrics_value(m, "qs_send_bytes", "gauge", "Queued and in-flight send bytes.", (ULONGLONG)info.send_bytes);
+	metrics_value(m, "qs_buffer_memory_bytes", "gauge", "Buffer memory of the connections.", (ULONGLONG)info.buffer_memory);
+	metrics_value(m, "qs_reads_held_total", "counter", "Receives held back by the send limits.", info.totals.reads_held);
+	metrics_value(m, "qs_sends_dropped_total", "counter", "Broadcast sends dropped by the send limits.", info.totals.sends_dropped);
+	metrics_family(m, "qs_callbacks_seconds_total", "counter", "Time spent dispatching completions.");
+	metrics_append(m, "qs_callbacks_seconds_total %I64u.%06I64u\n", info.totals.callbacks_time / 1000000, info.totals.callbacks_time % 1000000);
+
+	metrics_family(m, "qs_errors_total", "counter", "Failures by operation.");
+	for(i = 0; i < qs_error_types_count; ++i)
+	{
+		metrics_append(m, "qs_errors_total{type=\"%s\"} %I64u\n", error_type_names[i], info.totals.errors[i]);
 	}
 
-	return 1;
+	metrics_family(m, "qs_latency_seconds", "histogram", "Latencies recorded by the worker threads.");
+	for(i = 0; i < qs_histogram_types_count; ++i)
+	{
+		histograms_collect(server, (qs_histogram_type)i, h);
+		cumulative = 0;
+		j = 0;
+		for(b = 0; b < sizeof(metrics_buckets) / sizeof(metrics_buckets[0]); ++b)
+		{
+			for(; j < HISTOGRAM_BUCKETS && histogram_bucket_value(j) <= metrics_buckets[b]; ++j)
+			{
+				cumulative += h->buckets[j];
+			}
+			metrics_append(m, "qs_latency_seconds_bucket{stage=\"%s\",le=\"%I64u.%06I64u\"} %I64u\n", histogram_type_names[i], 
+				metrics_buckets[b] / 1000000, metrics_buckets[b] % 1000000, cumulative);
+		}
+		metrics_append(m, "qs_latency_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %I64u\n", histogram_type_names[i], h->count);
+		metrics_append(m, "qs_latency_seconds_sum{stage=\"%s\"} %I64u.%06I64u\n", histogram_type_names[i], h->sum / 1000000, h->sum % 1000000);
+		metrics_append(m, "qs_latency_seconds_count{stage=\"%s\"} %I64u\n", histogram_type_names[i], h->count);
+	}
 }
 
-#define THREAD_STACK_SIZE 1024
-unsigned __stdcall working_thread(void *s);
-void WINAPI clean_timer_callback(void * , BOOL );
+static void metrics_serve(qs_context *server, metrics_state *m, SOCKET client)
+{
+	char request[1024];
+	char header[METRICS_HEADER_RESERVE];
+	int received = 0, len, timeout = METRICS_RECV_TIMEOUT;
+	size_t header_len, sent;
+	char *response;
 
-MYDLL_API unsigned int qs_start( void *qs_instance, qs_params * params )
+	// Only the end of the request headers matters, the path is ignored
+	setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, (char *)&timeout, sizeof(timeout));
+	setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, (char *)&timeout, sizeof(timeout));
+	for(;;)
+	{
+		len = recv(client, request + received, sizeof(request) - 1 - received, 0);
+		if(len <= 0) return;
+		received += len;
+		request[received] = '\0';
+		if(strstr(request, "\r\n\r\n") || strstr(request, "\n\n")) break;
+		if(received == sizeof(request) - 1) return;
+	}
+
+	metrics_format(server, m);
+	len = _snprintf_s(header, sizeof(header), _TRUNCATE, 
+		"HTTP/1.1 200 OK\r\n"
+		"Content-Type: text/plain; version=0.0.4\r\n"
+		"Content-Length: %u\r\n"
+		"Connection: close\r\n\r\n", (u_int)(m->text_len - METRICS_HEADER_RESERVE));
+	if(len < 0) return;
+	header_len = (size_t)len;
+	response = m->text + METRICS_HEADER_RESERVE - header_len;
+	memcpy(response, header, header_len);
+	for(sent = 0; sent < header_len + m->text_len - METRICS_HEADER_RESERVE; sent += len)
+	{
+		len = send(client, response + sent, (int)(header_len + m->text_len - METRICS_HEADER_RESERVE - sent), 0);
+		if(len <= 0) return;
+	}
+	shutdown(client, SD_SEND);
+}
+
+// Scrapes are served one by one with blocking calls, away from the completion port
+unsigned __stdcall metrics_thread(void *s)
 {
-	qs_context* server;
-	size_t i;
-	io_context *io_context;
-	struct socket so;
-	int on = 1;
+	qs_context *server = (qs_context *)s;
+	metrics_state *m = &server->metrics;
+	SOCKET client;
+	int error;
 
-	if(!qs_instance || !params) return ERROR_INVALID_PARAMETER;
-	server = (qs_context*)qs_instance;	
-	if(server->status == runned) return ERROR_ALREADY_EXISTS;
+	for(;;)
+	{
+		client = accept(m->sock, NULL, NULL);
+		if(client == INVALID_SOCKET)
+		{
+			if(server->status != runned) break;
+			error = WSAGetLastError();
+			report_error(server, qs_error_accept, (u_long)error, 0);
+			// A peer which went away before the accept
+			if(error == WSAECONNRESET || error == WSAECONNABORTED || error == WSAEINTR) continue;
+			// Out of sockets or buffers, give the server time to release some
+			if(error == WSAEMFILE || error == WSAENOBUFS)
+			{
+				Sleep(METRICS_ACCEPT_BACKOFF);
+				continue;
+			}
+			cry(server, "%s: metrics listener stopped, error: %d", __func__, error);
+			break;
+		}
+		metrics_serve(server, m, client);
+		closesocket(client);
+	}
+	return 0;
+}
 
-	memcpy(&server->qs_params, params, sizeof(qs_params));
+static u_int metrics_start(qs_context *server)
+{
+	metrics_state *m = &server->metrics;
+	struct socket so;
+	u_int error;
 
-	if (!parse_port_string(params->listener.listen_adr, &so))
+	memset(m, 0, sizeof(metrics_state));
+	m->sock = INVALID_SOCKET;
+	if(!server->qs_params.metrics.listen_adr) return ERROR_SUCCESS;
+	if(!parse_port_string(server->qs_params.metrics.listen_adr, &so))
 	{
-		WSACleanup();
-		cry(server, "%s: invalid port spec.\nExpecting list of: %s",
-			__func__, "[IP_ADDRESS:]PORT[s|p]");
+		cry(server, "%s: invalid metrics port spec: %s", __func__, server->qs_params.metrics.listen_adr);
 		return ERROR_INVALID_PARAMETER;
-	} 
-	if ((so.sock = socket(so.lsa.sa.sa_family, SOCK_STREAM, IPPROTO_TCP)) ==
-		INVALID_SOCKET ||
-
-		// Set TCP keep-alive. This is needed because if HTTP-level
-		// keep-alive is enabled, and client resets the connection,
-		// server won't get TCP FIN or RST and will keep the connection
-		// open forever. With TCP keep-alive, next keep-alive
-		// handshake will figure out that the client is down and
-		// will close the server end.
-		setsockopt(so.sock, SOL_SOCKET, SO_KEEPALIVE, (char *) &on,
-		sizeof(on)) != 0 ||
-		bind(so.sock, &so.lsa.sa, sizeof(so.lsa)) != 0 ||
+	}
+	if((so.sock = socket_for_address(&so.lsa, SOCK_STREAM, FALSE)) == INVALID_SOCKET ||
+		bind(so.sock, &so.lsa.sa, usa_len(&so.lsa)) != 0 ||
 		listen(so.sock, SOMAXCONN) != 0)
 	{
-		u_int error = GetLastError();
-		closesocket(so.sock);
-		cry(server, "%s: cannot bind to %s, error: %d", __func__, params->listener.listen_adr, error);
+		error = WSAGetLastError();
+		if(so.sock != INVALID_SOCKET) closesocket(so.sock);
+		cry(server, "%s: cannot bind metrics to %s, error: %d", __func__, server->qs_params.metrics.listen_adr, error);
 		return error;
-	} 
+	}
+	m->sock = so.sock;
+	m->text = (char *)qs_memory_alloc(METRICS_TEXT_SIZE);
+	m->scratch = (histogram *)qs_memory_alloc(sizeof(histogram));
+	if(!m->text || !m->scratch)
+	{
+		closesocket(m->sock);
+		qs_memory_free(m->text);
+		qs_memory_free(m->scratch);
+		m->sock = INVALID_SOCKET;
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+	return ERROR_SUCCESS;
+}
 
-	if (server->qs_params.max_count_of_connections == 0) server->qs_params.max_count_of_connections = 10000;
-	server->storage = connection_storage_new(server->qs_params.max_count_of_connections);
+static void metrics_run(qs_context *server)
+{
+	if(server->metrics.sock != INVALID_SOCKET)
+	{
+		server->metrics.thread = create_thread(metrics_thread, server, 0);
+	}
+}
 
-	memcpy(&server->qs_socket, &so, sizeof(so));
-	CreateIoCompletionPort((HANDLE)server->qs_socket.sock, server->iocp, server->qs_socket.sock, 0);
+static void metrics_stop(qs_context *server)
+{
+	metrics_state *m = &server->metrics;
+	if(m->sock == INVALID_SOCKET) return;
+	// Closing the socket fails the pending accept()
+	closesocket(m->sock);
+	if(m->thread)
+	{
+		WaitForSingleObject((HANDLE)m->thread, INFINITE);
+		CloseHandle((HANDLE)m->thread);
+	}
+	qs_memory_free(m->text);
+	qs_memory_free(m->scratch);
+	m->sock = INVALID_SOCKET;
+}
 
-	server->qs_info.sockets_count = 0;
+// Slots next to the head may be rewritten while they are copied, they are skipped
+#define TRACE_SNAPSHOT_MARGIN 64
 
-	server->threads = (uintptr_t *)malloc(sizeof(uintptr_t) * (size_t)server->qs_params.worker_threads_count);
+static size_t trace_collect(qs_context *server, const trace_ring *ring, qs_trace_event *to)
+{
+	ULONGLONG head = ring->head;
+	ULONGLONG count = head < TRACE_RING_SIZE - TRACE_SNAPSHOT_MARGIN ? head : TRACE_RING_SIZE - TRACE_SNAPSHOT_MARGIN;
+	ULONGLONG i;
+	size_t collected = 0;
+	for(i = 0; i < count; ++i)
+	{
+		const qs_trace_event *e = &ring->events[(head - count + i) & (TRACE_RING_SIZE - 1)];
+		LONGLONG ticks = (LONGLONG)e->timestamp;
+		// Events left from a previous run of the instance
+		if(ticks < server->started) continue;
+		to[collected] = *e;
+		to[collected].timestamp = qpc_to_us(server, ticks - server->started);
+		++collected;
+	}
+	return collected;
+}
 
-	for(i = 0; i<(size_t)server->qs_params.worker_threads_count; ++i)
+static int trace_compare(const void *a, const void *b)
+{
+	ULONGLONG ta = ((const qs_trace_event *)a)->timestamp;
+	ULONGLONG tb = ((const qs_trace_event *)b)->timestamp;
+	return ta < tb ? -1 : ta > tb ? 1 : 0;
+}
+
+// Copies the newest events of all rings, ordered by time. On input *events_count
+// is the capacity of events, on output the number of events written.
+MYDLL_API unsigned int qs_trace_snapshot( void *qs_instance, qs_trace_event *events, u_long *events_count )
+{
+	qs_context *server;
+	qs_trace_event *all;
+	size_t collected = 0, first;
+	unsigned int i;
+	if(!qs_instance || !events || !events_count) return ERROR_INVALID_PARAMETER;
+	server = (qs_context*)qs_instance;
+	all = (qs_trace_event *)qs_memory_alloc(sizeof(qs_trace_event) * TRACE_RING_SIZE * (server->workers_size + 1));
+	if(!all) return ERROR_NOT_ENOUGH_MEMORY;
+	for(i = 0; i < server->workers_size; ++i)
 	{
-		server->threads[i] = create_thread(working_thread, server, THREAD_STACK_SIZE);
+		if(server->workers[i].state == worker_free && server->workers[i].trace.head == 0) continue;
+		collected += trace_collect(server, &server->workers[i].trace, all + collected);
 	}
+	collected += trace_collect(server, &server->external_trace, all + collected);
+	qsort(all, collected, sizeof(qs_trace_event), trace_compare);
+	first = collected > *events_count ? collected - *events_count : 0;
+	memcpy(events, all + first, sizeof(qs_trace_event) * (collected - first));
+	*events_count = (u_long)(collected - first);
+	qs_memory_free(all);
+	return ERROR_SUCCESS;
+}
 
-	io_context = alloc_context(server);
-	io_context->ended_operation = start_server;
+static const char *trace_event_names[] = {
+	"accept", "recv", "callback", "callback", "send_post", "send", "disconnect"
+};
 
-	u_long idle_check_period = server->qs_params.connections_idle_timeout;
-	if(idle_check_period)
+// Converts a snapshot to the Chrome trace event format, which chrome://tracing
+// and Perfetto open directly. Needs no server instance, so dumps written as raw
+// qs_trace_event arrays can be converted offline.
+MYDLL_API unsigned int qs_trace_write_chrome( const qs_trace_event *events, u_long events_count, HANDLE file )
+{
+	char line[256];
+	const char *name, *phase;
+	u_long i, written;
+	int len;
+	BOOL first = TRUE;
+	if((!events && events_count) || file == INVALID_HANDLE_VALUE) return ERROR_INVALID_PARAMETER;
+
+	if(!WriteFile(file, "{\"traceEvents\":[\n", 17, &written, NULL)) return GetLastError();
+	for(i = 0; i < events_count; ++i)
 	{
-		CreateTimerQueueTimer(&server->timer, NULL, (WAITORTIMERCALLBACK)clean_timer_callback, server,  idle_check_period,  idle_check_period/2, NULL);
+		const qs_trace_event *e = &events[i];
+		if(e->type > qs_trace_disconnect) continue;
+		if(e->type == qs_trace_callback_enter || e->type == qs_trace_callback_exit)
+		{
+			name = e->value < qs_histogram_types_count ? histogram_type_names[e->value] : "callback";
+			phase = e->type == qs_trace_callback_enter ? "\"ph\":\"B\"" : "\"ph\":\"E\"";
+		}
+		else
+		{
+			name = trace_event_names[e->type];
+			phase = "\"ph\":\"i\",\"s\":\"t\"";
+		}
+		len = _snprintf_s(line, sizeof(line), _TRUNCATE, 
+			"%s{\"name\":\"%s\",%s,\"ts\":%I64u,\"pid\":0,\"tid\":%u,\"args\":{\"connection\":%lu,\"value\":%lu}}\n",
+			first ? "" : ",", name, phase, e->timestamp, (u_int)e->worker, e->connection_id, e->value);
+		if(len < 0) continue;
+		if(!WriteFile(file, line, (u_long)len, &written, NULL)) return GetLastError();
+		first = FALSE;
 	}
+	if(!WriteFile(file, "]}\n", 3, &written, NULL)) return GetLastError();
+	return ERROR_SUCCESS;
+}
 
-	PostQueuedCompletionStatus(server->iocp, 8, 0, (LPOVERLAPPED)io_context);
-	server->status = runned;
+MYDLL_API unsigned int qs_enum_connections( void *qs_instance, ENUM_CONNECTIONS_PROC enum_connections_proc)
+{
+	qs_context *server;
+	if(!qs_instance || !enum_connections_proc) return ERROR_INVALID_PARAMETER;
+	server = (qs_context*)qs_instance;
+	connection_storage_traverse(server->storage, enum_connections_proc);
 	return ERROR_SUCCESS;
+}
+
+// Immutable message shared by all recipients of a broadcast
+struct _qs_payload {
+	volatile LONG refs;
+	WSABUF wsabuf;              // read by every WSASend, never written after creation
+	char data[1];
+};
+
+// Sends of one registry shard or of a slice of group members, run by whichever
+// worker takes the packet
+typedef struct _broadcast_job {
+	OVERLAPPED ov;
+	states ended_operation;     // broadcast_shard
+	qs_payload *payload;
+	BROADCAST_FILTER_PROC filter;
+	void *arg;
+	u_long shard;               // registry shard of a broadcast_shard job
+	u_long count;               // referenced contexts of a broadcast_members job
+	io_context *contexts[1];
+} broadcast_job;
+
+// One recipient. The connection has its own OVERLAPPED busy with receives, so
+// every broadcast send completes on a separate one.
+typedef struct _broadcast_send {
+	OVERLAPPED ov;
+	states ended_operation;     // broadcast_sent
+	io_context *context;
+	qs_payload *payload;
+	struct _broadcast_send *next;   // deferred sends of a TLS connection
+	WSABUF wsabuf;                  // the payload, or its records for a TLS connection
+	char records[1];
+} broadcast_send;
 
+MYDLL_API qs_payload* qs_payload_create(const char *data, u_long len)
+{
+	qs_payload *payload = (qs_payload *)qs_memory_alloc(sizeof(qs_payload) + len);
+	if(!payload) return NULL;
+	payload->refs = 1;
+	payload->wsabuf.buf = payload->data;
+	payload->wsabuf.len = len;
+	if(data) memcpy(payload->data, data, len);
+	return payload;
 }
 
-static void idle_check(connection *con)
+MYDLL_API char* qs_payload_data(qs_payload *payload)
 {
-	io_context *context = get_context(con);
-	u_long count = GetTickCount();
-	if((count - context->last_activity) > context->server_ctx->qs_params.connections_idle_timeout)
+	return payload ? payload->data : NULL;
+}
+
+MYDLL_API void qs_payload_release(qs_payload *payload)
+{
+	if(payload && InterlockedDecrement(&payload->refs) == 0) qs_memory_free(payload);
+}
+
+static void broadcast_send_done(qs_context *server, broadcast_send *op)
+{
+	send_release(op->context, op->payload->wsabuf.len);
+	qs_payload_release(op->payload);
+	context_release(server, op->context);
+	qs_memory_free(op);
+	// The last reference of a closed connection gives its buffers back here
+	if(server->qs_params.limits.buffer_memory) listeners_fill(server);
+}
+
+// Closing connections are expected to fail here, they are only counted
+static BOOL broadcast_send_issue(broadcast_send *op)
+{
+	u_long bytes_send;
+	if(WSASend(op->context->connection.socket.sock, &op->wsabuf, 1, &bytes_send, 0, (LPOVERLAPPED)op, 0) == SOCKET_ERROR && 
+		WSAGetLastError() != WSA_IO_PENDING)
 	{
-		shutdown(con->socket.sock, SD_BOTH);
+		STAT_ERROR(op->context->server_ctx, qs_error_send);
+		return FALSE;
 	}
+	return TRUE;
 }
 
-void WINAPI clean_timer_callback(void * context, BOOL fTimerOrWaitFired)
+// Bytes of the records of a TLS broadcast
+static u_long tls_records_size(tls_session *t, u_long len)
 {
-	qs_context * server = (qs_context *)context;
-	connection_storage *storage = server->storage;
-	connection_storage_traverse(storage, idle_check);
+	u_long records = (len + t->sizes.cbMaximumMessage - 1) / t->sizes.cbMaximumMessage;
+	return len + records * (t->sizes.cbHeader + t->sizes.cbTrailer);
 }
 
-MYDLL_API unsigned int qs_stop( void *qs_instance )
+// Encrypts the payload into records of its own and sends them. Called with the lock held.
+static BOOL tls_broadcast_issue(tls_session *t, broadcast_send *op)
 {
-	qs_context* server = (qs_context*)qs_instance;
-	size_t i;
+	const WSABUF *source = &op->payload->wsabuf;
+	u_long offset, n, record_len;
+	SECURITY_STATUS status;
+	op->wsabuf.buf = op->records;
+	op->wsabuf.len = 0;
+	for(offset = 0; offset < source->len; offset += n)
+	{
+		n = source->len - offset;
+		if(n > t->sizes.cbMaximumMessage) n = t->sizes.cbMaximumMessage;
+		memcpy(op->records + op->wsabuf.len + t->sizes.cbHeader, source->buf + offset, n);
+		if((status = tls_seal(t, op->records + op->wsabuf.len, n, &record_len)) != SEC_E_OK)
+		{
+			STAT_ERROR(op->context->server_ctx, qs_error_tls);
+			return FALSE;
+		}
+		op->wsabuf.len += record_len;
+	}
+	return broadcast_send_issue(op);
+}
 
-	u_long idle_check_period = server->qs_params.connections_idle_timeout;
-	if(idle_check_period)
+// Failed sends are finished once the lock is left: the last reference of the
+// connection may be among them and free the session with its lock.
+static void tls_broadcasts_done(qs_context *server, broadcast_send *failed)
+{
+	broadcast_send *next;
+	for(; failed; failed = next)
 	{
-		DeleteTimerQueueTimer(NULL, server->timer, NULL);
+		next = failed->next;
+		broadcast_send_done(server, failed);
 	}
-	for(i = 0; i<(size_t)server->qs_params.worker_threads_count; i++)
+}
+
+static void tls_broadcast_post(qs_context *server, broadcast_send *op)
+{
+	tls_session *t = op->context->tls;
+	broadcast_send *failed = NULL;
+	EnterCriticalSection(&t->lock);
+	if(t->sending)
 	{
-		io_context *io_context = alloc_context(server);
-		io_context->ended_operation = stop_server;
-		PostQueuedCompletionStatus(server->iocp, 8, 0, (LPOVERLAPPED)io_context);
+		if(t->deferred_tail) t->deferred_tail->next = op;
+		else t->deferred = op;
+		t->deferred_tail = op;
 	}
+	else if(!tls_broadcast_issue(t, op)) failed = op;
+	LeaveCriticalSection(&t->lock);
+	tls_broadcasts_done(server, failed);
+}
 
-	WaitForMultipleObjects(server->qs_params.worker_threads_count, (HANDLE *)server->threads, TRUE, INFINITE);
-	for(i = 0; i<(size_t)server->qs_params.worker_threads_count; i++)
+// The send of the connection has all of its records sent, or failed. The
+// broadcasts which waited for it follow in order.
+static void tls_send_finish(io_context *context)
+{
+	tls_session *t = context->tls;
+	broadcast_send *op, *next, *failed = NULL;
+	EnterCriticalSection(&t->lock);
+	t->sending = FALSE;
+	op = t->deferred;
+	t->deferred = t->deferred_tail = NULL;
+	for(; op; op = next)
 	{
-		CloseHandle((HANDLE)server->threads[i]);
+		next = op->next;
+		if(tls_broadcast_issue(t, op)) continue;
+		op->next = failed;
+		failed = op;
 	}
+	LeaveCriticalSection(&t->lock);
+	tls_broadcasts_done(context->server_ctx, failed);
+}
 
-	socket_close(server->qs_socket.sock, &server->qs_info);
-	CloseHandle(server->iocp);
-	connection_storage_free(server->storage);
-	free(server->threads);	
-	neddisablethreadcache(0);
-	server->qs_info.sockets_count = 0;
-	server->qs_info.active_connections_count = 0;
-	server->status = not_runned;
+static void broadcast_post(qs_context *server, io_context *context, qs_payload *payload)
+{
+	broadcast_send *op;
+	tls_session *t = context->tls;
+	u_long size;
+	// Slow consumers miss broadcasts instead of queuing them without bound
+	if(send_over_limits(context, payload->wsabuf.len))
+	{
+		STAT_ADD(server, sends_dropped, 1);
+		return;
+	}
+	if(t && !payload->wsabuf.len) return;
+	// TLS recipients get their own copy, encrypted when the send is issued
+	size = t ? tls_records_size(t, payload->wsabuf.len) : 0;
+	if(!(op = (broadcast_send *)qs_memory_alloc(sizeof(broadcast_send) + size)))
+	{
+		STAT_ERROR(server, qs_error_send);
+		return;
+	}
+	memset(&op->ov, 0, sizeof(op->ov));
+	op->ended_operation = broadcast_sent;
+	op->context = context;
+	op->payload = payload;
+	op->next = NULL;
+	op->wsabuf = payload->wsabuf;
+	InterlockedIncrement(&context->refs);
+	InterlockedIncrement(&payload->refs);
+	send_charge(context, payload->wsabuf.len);
+	if(t) tls_broadcast_post(server, op);
+	else if(!broadcast_send_issue(op)) broadcast_send_done(server, op);
+}
 
-	return ERROR_SUCCESS;
+// Runs on a worker. The shard stays locked while its sends are issued, which
+// keeps the recipients from being freed; the sends themselves hold references.
+static void broadcast_run(qs_context *server, broadcast_job *job)
+{
+	storage_shard *shard = &server->storage->shards[job->shard];
+	connection *con;
+	size_t i;
+	EnterCriticalSection(&shard->cs);
+	for(i = 0; i < shard->count; i++)
+	{
+		con = shard->connections[i];
+		if(job->filter && !job->filter(con, job->arg)) continue;
+		broadcast_post(server, get_context(con), job->payload);
+	}
+	LeaveCriticalSection(&shard->cs);
+	qs_payload_release(job->payload);
+	qs_memory_free(job);
 }
 
-MYDLL_API unsigned int qs_send(connection *connection)
+// Group members were filtered and referenced when the job was made
+static void broadcast_members_run(qs_context *server, broadcast_job *job)
 {
-	io_context *context;
-	int  res;
-	int  error;
-	u_long bytes_send;
-	if(!connection) return ERROR_INVALID_PARAMETER;
-	context = get_context(connection);
-	context->ended_operation = send_done;
-	res = WSASend(connection->socket.sock, (WSABUF *)&(connection->buffer), 1, &bytes_send, 0, (LPOVERLAPPED)context, 0);
-	if ((res == SOCKET_ERROR) && (WSA_IO_PENDING != (error = WSAGetLastError())))
+	u_long i;
+	for(i = 0; i < job->count; i++)
+	{
+		broadcast_post(server, job->contexts[i], job->payload);
+		context_release(server, job->contexts[i]);
+	}
+	qs_payload_release(job->payload);
+	qs_memory_free(job);
+}
+
+static broadcast_job *broadcast_job_new(states operation, qs_payload *payload, BROADCAST_FILTER_PROC filter, void *arg, u_long contexts)
+{
+	broadcast_job *job = (broadcast_job *)qs_memory_alloc(sizeof(broadcast_job) + sizeof(io_context *) * (contexts ? contexts - 1 : 0));
+	if(!job) return NULL;
+	memset(&job->ov, 0, sizeof(job->ov));
+	job->ended_operation = operation;
+	job->payload = payload;
+	job->filter = filter;
+	job->arg = arg;
+	job->shard = 0;
+	job->count = 0;
+	InterlockedIncrement(&payload->refs);
+	return job;
+}
+
+static void broadcast_job_free(qs_context *server, broadcast_job *job)
+{
+	u_long i;
+	for(i = 0; i < job->count; i++)
+	{
+		context_release(server, job->contexts[i]);
+	}
+	qs_payload_release(job->payload);
+	qs_memory_free(job);
+}
+
+// Matching members are copied out with a reference each in slices of
+// BROADCAST_SLICE, so a large group is spread over the workers. The filter runs
+// here under the shard lock, where no member can be in on_disconnect.
+#define BROADCAST_SLICE 1024
+
+static unsigned int broadcast_group(qs_context *server, qs_payload *payload, u_long group_id, BROADCAST_FILTER_PROC filter, void *arg)
+{
+	group_shard *shard = group_shard_get(server, group_id);
+	broadcast_job *job = NULL;
+	group *g;
+	u_long i;
+	unsigned int error = ERROR_SUCCESS;
+
+	EnterCriticalSection(&shard->cs);
+	g = *group_slot(shard, group_id);
+	for(i = 0; g && i < g->count; i++)
 	{
-		return error;
+		if(filter && !filter(&g->members[i].context->connection, arg)) continue;
+		if(!job && !(job = broadcast_job_new(broadcast_members, payload, filter, arg, BROADCAST_SLICE)))
+		{
+			error = ERROR_NOT_ENOUGH_MEMORY;
+			break;
+		}
+		job->contexts[job->count++] = g->members[i].context;
+		InterlockedIncrement(&g->members[i].context->refs);
+		if(job->count == BROADCAST_SLICE)
+		{
+			if(!PostQueuedCompletionStatus(server->iocp, 0, 0, (LPOVERLAPPED)job))
+			{
+				error = GetLastError();
+				broadcast_job_free(server, job);
+				job = NULL;
+				break;
+			}
+			job = NULL;
+		}
 	}
-	return ERROR_SUCCESS;
+	LeaveCriticalSection(&shard->cs);
+	if(job && !PostQueuedCompletionStatus(server->iocp, 0, 0, (LPOVERLAPPED)job))
+	{
+		error = GetLastError();
+		broadcast_job_free(server, job);
+	}
+	return error;
 }
 
-MYDLL_API unsigned int qs_send_file( void *qs_instance, connection *connection, HANDLE file)
+// Sends the payload to the members of a group, or to every connection with group
+// 0, which the filter accepts (NULL for all). The work is posted to the completion
+// port in parts, so the sends are issued by all workers at once; the payload is
+// never copied.
+MYDLL_API unsigned int qs_broadcast( void *qs_instance, qs_payload *payload, u_long group, BROADCAST_FILTER_PROC filter, void *arg )
 {
-	qs_context* server;	
-	io_context *context;
-	if(!qs_instance || !connection || file == INVALID_HANDLE_VALUE) return ERROR_INVALID_PARAMETER;
+	qs_context *server;
+	broadcast_job *job;
+	u_long i;
+	if(!qs_instance || !payload) return ERROR_INVALID_PARAMETER;
 	server = (qs_context*)qs_instance;
-	context = get_context(connection);
-	context->ended_operation = transmit_file;
-	server->ex_funcs.TransmitFile(connection->socket.sock, file, 0, 0, (LPOVERLAPPED)context, 0, TF_DISCONNECT | TF_USE_KERNEL_APC);	
-	return ERROR_SUCCESS;
-}
-
-MYDLL_API unsigned int qs_recv(connection *connection)
-{
-	io_context *context;
-	int res;
-	int error;
-	u_long bytes_recv;
-	u_long flags = 0;
-	if(!connection) return ERROR_INVALID_PARAMETER;
-	context = get_context(connection);
-	context->ended_operation = recv_done;
-	res = WSARecv(connection->socket.sock, (WSABUF *)&(connection->buffer), 1, &bytes_recv, &flags, (LPOVERLAPPED)context, 0);
-	if ((res == SOCKET_ERROR) && (WSA_IO_PENDING != (error = WSAGetLastError())))
+	if(server->status != runned) return ERROR_NOT_READY;
+	if(group) return broadcast_group(server, payload, group, filter, arg);
+	for(i = 0; i < STORAGE_SHARDS; i++)
 	{
-		return error;
+		if(!server->storage->shards[i].count) continue;
+		if(!(job = broadcast_job_new(broadcast_shard, payload, filter, arg, 0))) return ERROR_NOT_ENOUGH_MEMORY;
+		job->shard = i;
+		if(!PostQueuedCompletionStatus(server->iocp, 0, 0, (LPOVERLAPPED)job))
+		{
+			broadcast_job_free(server, job);
+			return GetLastError();
+		}
 	}
 	return ERROR_SUCCESS;
 }
 
-MYDLL_API unsigned int qs_close_connection( void *qs_instance, connection *connection )
+// Group membership is changed only from the callbacks of the connection itself,
+// like its other per-connection state. Memberships end on disconnect.
+MYDLL_API unsigned int qs_group_join(connection *connection, u_long group_id)
 {
-	qs_context* server;	
 	io_context *context;
-	if(!qs_instance || !connection) return ERROR_INVALID_PARAMETER;
-	server = (qs_context*)qs_instance;
+	qs_context *server;
+	group_shard *shard;
+	group **slot, *g;
+	group_member *grown;
+	membership *m;
+	if(!connection || !group_id) return ERROR_INVALID_PARAMETER;
 	context = get_context(connection);
-	context->ended_operation = on_disconnect;
-	server->ex_funcs.DisconnectEx(connection->socket.sock, (LPOVERLAPPED)context, 0, 0);
+	server = context->server_ctx;
+	for(m = context->memberships; m; m = m->next)
+	{
+		if(m->group_id == group_id) return ERROR_ALREADY_EXISTS;
+	}
+	if(!(m = (membership *)qs_memory_alloc(sizeof(membership)))) return ERROR_NOT_ENOUGH_MEMORY;
+	m->group_id = group_id;
+	shard = group_shard_get(server, group_id);
+	EnterCriticalSection(&shard->cs);
+	slot = group_slot(shard, group_id);
+	if(!(g = *slot))
+	{
+		if((g = (group *)qs_memory_alloc(sizeof(group))) != NULL)
+		{
+			memset(g, 0, sizeof(group));
+			g->id = group_id;
+			*slot = g;
+		}
+	}
+	if(g && g->count == g->size)
+	{
+		grown = (group_member *)nedrealloc(g->members, sizeof(group_member) * (g->size ? g->size * 2 : 4));
+		if(grown)
+		{
+			g->members = grown;
+			g->size = g->size ? g->size * 2 : 4;
+		}
+	}
+	if(!g || g->count == g->size)
+	{
+		if(g && !g->count)
+		{
+			*slot = g->next;
+			qs_memory_free(g->members);
+			qs_memory_free(g);
+		}
+		LeaveCriticalSection(&shard->cs);
+		qs_memory_free(m);
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+	m->index = g->count;
+	g->members[g->count].context = context;
+	g->members[g->count].membership = m;
+	g->count++;
+	LeaveCriticalSection(&shard->cs);
+	m->next = context->memberships;
+	context->memberships = m;
 	return ERROR_SUCCESS;
 }
 
-MYDLL_API unsigned int qs_post_message_to_pool(void *qs_instance, void *message, connection *connection)
+MYDLL_API unsigned int qs_group_leave(connection *connection, u_long group_id)
 {
-	qs_context* server;	
 	io_context *context;
-	if(!qs_instance || !connection) return ERROR_INVALID_PARAMETER;
-	server = (qs_context*)qs_instance;
+	membership **link, *m;
+	if(!connection) return ERROR_INVALID_PARAMETER;
 	context = get_context(connection);
-	context->ended_operation = user_message;
-	PostQueuedCompletionStatus(server->iocp, 8, (uintptr_t)message, (LPOVERLAPPED)context);
-	return ERROR_SUCCESS;
+	for(link = &context->memberships; (m = *link) != NULL; link = &m->next)
+	{
+		if(m->group_id != group_id) continue;
+		*link = m->next;
+		group_remove(context->server_ctx, m);
+		qs_memory_free(m);
+		return ERROR_SUCCESS;
+	}
+	return ERROR_NOT_FOUND;
 }
 
-MYDLL_API unsigned int qs_query_qs_information( void *qs_instance, qs_info *qs_information )
+// Calls enum_connections_proc for the members with the shard of the group locked
+MYDLL_API unsigned int qs_group_enum( void *qs_instance, u_long group_id, ENUM_CONNECTIONS_PROC enum_connections_proc, u_long *members_count )
 {
 	qs_context *server;
-	if(!qs_instance || !qs_information) return ERROR_INVALID_PARAMETER;
+	group_shard *shard;
+	group *g;
+	u_long i;
+	if(!qs_instance || !group_id) return ERROR_INVALID_PARAMETER;
 	server = (qs_context*)qs_instance;
-	memcpy(qs_information, &server->qs_info, sizeof(qs_info));
+	shard = group_shard_get(server, group_id);
+	EnterCriticalSection(&shard->cs);
+	g = *group_slot(shard, group_id);
+	if(members_count) *members_count = g ? g->count : 0;
+	for(i = 0; g && enum_connections_proc && i < g->count; i++)
+	{
+		enum_connections_proc(&g->members[i].context->connection);
+	}
+	LeaveCriticalSection(&shard->cs);
 	return ERROR_SUCCESS;
 }
 
-MYDLL_API unsigned int qs_enum_connections( void *qs_instance, ENUM_CONNECTIONS_PROC enum_connections_proc)
+// Current date in HTTP format, refreshed once per second while the server runs
+MYDLL_API const char* qs_get_date( void *qs_instance )
 {
-	qs_context *server;
-	if(!qs_instance || !enum_connections_proc) return ERROR_INVALID_PARAMETER;
-	server = (qs_context*)qs_instance;
-	connection_storage_traverse(server->storage, enum_connections_proc);
-	return ERROR_SUCCESS;
+	qs_context *server = (qs_context*)qs_instance;
+	if(!server) return NULL;
+	return server->date[server->date_slot];
 }
 
 MYDLL_API void sockaddr_to_string(char *buf, size_t len, const union usa *usa) {
 	buf[0] = '\0';
-#if defined(USE_IPV6) && defined(HAVE_INET_NTOP)
+	if (usa->sa.sa_family == AF_UNIX) {
+		// Unnamed peers and abstract names print as an empty path
+		_snprintf_s(buf, len, _TRUNCATE, "unix:%s", usa->sun.sun_path[0] ? usa->sun.sun_path : "");
+		return;
+	}
+#if defined(HAVE_INET_NTOP)
 	// Only Windoze Vista (and newer) have inet_ntop()
 	inet_ntop(usa->sa.sa_family, (usa->sa.sa_family == AF_INET ?
 		(void *) &usa->sin.sin_addr :
 	(void *) &usa->sin6.sin6_addr), buf, len);
-#elif defined(HAVE_INET_NTOP)
-	inet_ntop(usa->sa.sa_family, (void *) &usa->sin.sin_addr, buf, len);
 #elif defined(_WIN32)
 	strncpy(buf, inet_ntoa(usa->sin.sin_addr), len);
 #else
@@ -658,64 +4566,451 @@ MYDLL_API void sockaddr_to_string(char *buf, size_t len, const union usa *usa) {
 	buf[len - 1] = 0;
 }
 
-static void init_accept(qs_context *server, BYTE *out_buf)
+// Issues one AcceptEx() on the listener, counted in its pending accepts by the caller
+static BOOL init_accept(qs_context *server, listener_state *l)
 {
-	SOCKET client;
 	io_context *new_context;
 	u_long bytes_transferred;
 	int error;
-	new_context = alloc_context(server);
-	if(new_context != NULL)
+	new_context = listener_context(server, l);
+	if(new_context == NULL)
+	{
+		InterlockedDecrement(&l->pending);
+		return FALSE;
+	}
+	new_context->ended_operation = on_connect;
+	new_context->connection.id = (u_long)InterlockedIncrement(&server->connections_ids);
+	new_context->connection.socket.sock = socket_create(&server->qs_info, l->socket.lsa.sa.sa_family);
+
+	if(server->ex_funcs.AcceptEx(l->socket.sock, new_context->connection.socket.sock, l->addresses, 0, sizeof(struct sockaddr_storage) + 16, sizeof(struct sockaddr_storage) + 16, 
+		&bytes_transferred, (LPOVERLAPPED)new_context) == 0 && (error = WSAGetLastError()) != ERROR_IO_PENDING)
 	{
-		client = socket_create(&server->qs_info);
-		new_context->ended_operation = on_connect;
-		new_context->connection.socket.sock = client;
+		STAT_ERROR(server, qs_error_accept);
+		report_error(server, qs_error_accept, error, new_context->connection.id);
+		context_release(server, new_context);
+		InterlockedDecrement(&l->pending);
+		return FALSE;
+	}
+	return TRUE;
+}
 
-		if(server->ex_funcs.AcceptEx(server->qs_socket.sock, new_context->connection.socket.sock, out_buf, 0, sizeof(struct sockaddr_storage) + 16, sizeof(struct sockaddr_storage) + 16, 
-			&bytes_transferred, (LPOVERLAPPED)new_context) == 0 && (error = WSAGetLastError())!=997)
+// Tops the pending accepts of the listener up to init_accepts_count
+static void listener_fill(qs_context *server, listener_state *l)
+{
+	while(l->pending < (LONG)l->params.init_accepts_count && !connection_storage_is_full(server->storage) && !memory_full(server))
+	{
+		if(InterlockedIncrement(&l->pending) > (LONG)l->params.init_accepts_count)
 		{
-			cry(server, "%s: AcceptEx() fail with error: %d",	__func__, error);
+			InterlockedDecrement(&l->pending);
+			break;
 		}
+		if(!init_accept(server, l)) break;
 	}
 }
 
+static void listeners_fill(qs_context *server)
+{
+	u_long i;
+	for(i = 0; i < server->listeners_count; ++i) listener_fill(server, &server->listeners[i]);
+}
+
+// AcceptEx() completed with an error: the client gave up or the listener was closed
+static void accept_failed(worker *self, io_context *io_ctx, u_long error)
+{
+	qs_context *server = self->server;
+	listener_state *l = io_ctx->listener;
+	self->stats.errors[qs_error_accept]++;
+	report_error(server, qs_error_accept, error, io_ctx->connection.id);
+	context_release(server, io_ctx);
+	InterlockedDecrement(&l->pending);
+	if(server->status == runned) listener_fill(server, l);
+}
+
 static void set_keep_alive(connection *con, u_long  keepalivetime, u_long keepaliveinterval)
 {
 	struct tcp_keepalive alive;
 	u_long dwRet, dwSize;
-	io_context *context;
 
 	if(keepalivetime !=0 && keepaliveinterval!=0)
 	{
-		context = get_context(con);
 		alive.onoff = 1;
 		alive.keepalivetime = keepalivetime;
 		alive.keepaliveinterval = keepaliveinterval;
+		// Synchronous: with the OVERLAPPED of the connection the completion of a
+		// socket already on the port would be dispatched as its pending operation
 		dwRet = WSAIoctl(con->socket.sock, SIO_KEEPALIVE_VALS, &alive, sizeof(alive),
-			NULL, 0, &dwSize, (LPOVERLAPPED)context, NULL);
+			NULL, 0, &dwSize, NULL, NULL);
 	}	
 }
 
 
+__inline static void worker_record(worker *self, qs_histogram_type type, LONGLONG ticks)
+{
+	histogram_record(&self->histograms[type], qpc_to_us(self->server, ticks));
+}
+
+// Records the dispatch delay and returns the moment the callback is entered
+__inline static LONGLONG callback_enter(worker *self, qs_histogram_type type, LONGLONG started, io_context *io_ctx)
+{
+	LONGLONG now = qpc_now();
+	worker_record(self, qs_histogram_dispatch, now - started);
+	trace_record(self, now, qs_trace_callback_enter, io_ctx->connection.id, type);
+	return now;
+}
+
+__inline static void callback_leave(worker *self, qs_histogram_type type, LONGLONG entered, u_long connection_id)
+{
+	LONGLONG now = qpc_now();
+	worker_record(self, type, now - entered);
+	trace_record(self, now, qs_trace_callback_exit, connection_id, type);
+}
+
+// The connection never reached on_connect: it is reported and freed
+static void connect_failed(worker *self, io_context *io_ctx, u_long error)
+{
+	qs_context *server = self->server;
+	connect_unlist(server, io_ctx);
+	upstream_detach(io_ctx);
+	if(io_ctx->connect_timed_out) error = WSAETIMEDOUT;
+	self->stats.errors[qs_error_connect]++;
+	report_error(server, qs_error_connect, error, io_ctx->connection.id);
+	if(io_ctx->listener->callbacks.on_connect_error)
+	{
+		io_ctx->listener->callbacks.on_connect_error(&io_ctx->connection, error);
+	}
+	context_release(server, io_ctx);
+}
+
+// Registers a connection which is ready for use and calls on_connect
+static void connection_opened(worker *self, io_context *io_ctx, LONGLONG started)
+{
+	LONGLONG entered;
+	u_long connection_id = io_ctx->connection.id;
+	connection_storage_add(self->server->storage, &io_ctx->connection);	
+	trace_record(self, started, qs_trace_accept, connection_id, 0);
+	entered = callback_enter(self, qs_histogram_on_connect, started, io_ctx);
+	io_ctx->listener->callbacks.on_connect(&io_ctx->connection);
+	callback_leave(self, qs_histogram_on_connect, entered, connection_id);
+}
+
+#define TLS_ASC_FLAGS (ASC_REQ_SEQUENCE_DETECT | ASC_REQ_REPLAY_DETECT | ASC_REQ_CONFIDENTIALITY | \
+	ASC_REQ_EXTENDED_ERROR | ASC_REQ_ALLOCATE_MEMORY | ASC_REQ_STREAM)
+
+// The handshake failed or timed out, the connection never reached on_connect
+static void tls_failed(worker *self, io_context *io_ctx, u_long error)
+{
+	qs_context *server = self->server;
+	connect_unlist(server, io_ctx);
+	if(io_ctx->connect_timed_out) error = WSAETIMEDOUT;
+	self->stats.errors[qs_error_tls]++;
+	report_error(server, qs_error_tls, error, io_ctx->connection.id);
+	InterlockedDecrement(&server->qs_info.active_connections_count);
+	context_release(server, io_ctx);
+}
+
+static unsigned int tls_token_post(io_context *io_ctx)
+{
+	tls_session *t = io_ctx->tls;
+	WSABUF wsabuf;
+	u_long bytes_send;
+	int error;
+	wsabuf.buf = t->token + t->token_sent;
+	wsabuf.len = t->token_len - t->token_sent;
+	io_ctx->ended_operation = tls_handshake_sent;
+	io_ctx->posted = qpc_now();
+	if(WSASend(io_ctx->connection.socket.sock, &wsabuf, 1, &bytes_send, 0, (LPOVERLAPPED)io_ctx, 0) == SOCKET_ERROR &&
+		(error = WSAGetLastError()) != WSA_IO_PENDING)
+	{
+		return error;
+	}
+	return ERROR_SUCCESS;
+}
+
+static void tls_established(worker *self, io_context *io_ctx)
+{
+	SecPkgContext_SessionInfo info;
+	connect_unlist(self->server, io_ctx);
+	self->stats.tls_handshakes++;
+	if(QueryContextAttributes(&io_ctx->tls->ctx, SECPKG_ATTR_SESSION_INFO, &info) == SEC_E_OK && (info.dwFlags & SSL_SESSION_RECONNECT))
+		self->stats.tls_session_hits++;
+	else self->stats.tls_session_misses++;
+	connection_opened(self, io_ctx, qpc_now());
+}
+
+// Feeds the received handshake messages to SChannel and sends its answer. Posts
+// the next operation, or opens the connection when the handshake is done; data
+// the client sent behind its last message stays buffered for the first receive.
+static void tls_handshake_next(worker *self, io_context *io_ctx)
+{
+	tls_session *t = io_ctx->tls;
+	SecBuffer in[2], out[1];
+	SecBufferDesc in_desc, out_desc;
+	SECURITY_STATUS status;
+	u_long attrs;
+	unsigned int error;
+
+	if(io_ctx->connect_timed_out)
+	{
+		tls_failed(self, io_ctx, WSAETIMEDOUT);
+		return;
+	}
+	in_desc.ulVersion = out_desc.ulVersion = SECBUFFER_VERSION;
+	in_desc.cBuffers = 2;
+	in_desc.pBuffers = in;
+	out_desc.cBuffers = 1;
+	out_desc.pBuffers = out;
+	while(t->in_len && !t->open)
+	{
+		in[0].BufferType = SECBUFFER_TOKEN;
+		in[0].pvBuffer = t->in + t->in_start;
+		in[0].cbBuffer = t->in_len;
+		in[1].BufferType = SECBUFFER_EMPTY;
+		in[1].pvBuffer = NULL;
+		in[1].cbBuffer = 0;
+		out[0].BufferType = SECBUFFER_TOKEN;
+		out[0].pvBuffer = NULL;
+		out[0].cbBuffer = 0;
+		status = AcceptSecurityContext(&io_ctx->listener->tls_cred, t->have_ctx ? &t->ctx : NULL, &in_desc, TLS_ASC_FLAGS, 
+			SECURITY_NATIVE_DREP, t->have_ctx ? NULL : &t->ctx, &out_desc, &attrs, NULL);
+		if(status == SEC_E_INCOMPLETE_MESSAGE) break;
+		if(status != SEC_E_OK && status != SEC_I_CONTINUE_NEEDED)
+		{
+			if(out[0].pvBuffer) FreeContextBuffer(out[0].pvBuffer);
+			tls_failed(self, io_ctx, (u_long)status);
+			return;
+		}
+		t->have_ctx = TRUE;
+		if(in[1].BufferType == SECBUFFER_EXTRA)
+		{
+			t->in_start += t->in_len - in[1].cbBuffer;
+			t->in_len = in[1].cbBuffer;
+		}
+		else t->in_len = 0;
+		if(status == SEC_E_OK)
+		{
+			QueryContextAttributes(&t->ctx, SECPKG_ATTR_STREAM_SIZES, &t->sizes);
+			t->open = TRUE;
+		}
+		if(out[0].pvBuffer && out[0].cbBuffer)
+		{
+			t->token = (char *)out[0].pvBuffer;
+			t->token_len = out[0].cbBuffer;
+			t->token_sent = 0;
+			if((error = tls_token_post(io_ctx)) != ERROR_SUCCESS) tls_failed(self, io_ctx, error);
+			return;
+		}
+		if(out[0].pvBuffer) FreeContextBuffer(out[0].pvBuffer);
+	}
+	if(t->open) tls_established(self, io_ctx);
+	else if((error = tls_socket_recv(io_ctx, tls_handshake)) != ERROR_SUCCESS) tls_failed(self, io_ctx, error);
+}
+
+// Accepted connection of a TLS listener: on_connect waits for the handshake,
+// which is listed with the pending connects to expire after handshake_timeout
+static void tls_start(worker *self, io_context *io_ctx)
+{
+	unsigned int error;
+	if(!(io_ctx->tls = tls_session_new()))
+	{
+		tls_failed(self, io_ctx, ERROR_NOT_ENOUGH_MEMORY);
+		return;
+	}
+	memory_charge(io_ctx, 2 * TLS_BUFFER_SIZE);
+	io_ctx->connect_deadline = clock_now(self->server) + io_ctx->listener->tls_timeout;
+	connect_list(self->server, io_ctx);
+	if((error = tls_socket_recv(io_ctx, tls_handshake)) != ERROR_SUCCESS) tls_failed(self, io_ctx, error);
+}
+
+static void tls_handshake_complete(worker *self, io_context *io_ctx, u_long bytes, u_long error)
+{
+	tls_session *t = io_ctx->tls;
+	if(error || !bytes)
+	{
+		tls_failed(self, io_ctx, error ? error : WSAECONNRESET);
+		return;
+	}
+	if(io_ctx->ended_operation == tls_handshake)
+	{
+		t->in_len += bytes;
+		tls_handshake_next(self, io_ctx);
+		return;
+	}
+	t->token_sent += bytes;
+	if(t->token_sent < t->token_len)
+	{
+		if((error = tls_token_post(io_ctx)) != ERROR_SUCCESS) tls_failed(self, io_ctx, error);
+		return;
+	}
+	FreeContextBuffer(t->token);
+	t->token = NULL;
+	tls_handshake_next(self, io_ctx);
+}
+
+// Receive completion of a TLS connection. Returns FALSE while there is no
+// plaintext for on_recv yet: the next receive was posted or the connection is closing.
+static BOOL tls_recv_done(worker *self, io_context *io_ctx, u_long *bytes)
+{
+	tls_session *t = io_ctx->tls;
+	SECURITY_STATUS status;
+	unsigned int error;
+
+	if(t->delivered)
+	{
+		t->delivered = FALSE;
+		return TRUE;
+	}
+	t->in_len += *bytes;
+	if((*bytes = tls_fill(t, &status)) != 0) return TRUE;
+	if(status == SEC_E_INCOMPLETE_MESSAGE)
+	{
+		if((error = tls_socket_recv(io_ctx, recv_done)) == ERROR_SUCCESS) return FALSE;
+		self->stats.errors[qs_error_recv]++;
+		report_error(self->server, qs_error_recv, error, io_ctx->connection.id);
+	}
+	else if(status != SEC_I_CONTEXT_EXPIRED)
+	{
+		self->stats.errors[qs_error_tls]++;
+		report_error(self->server, qs_error_tls, (u_long)status, io_ctx->connection.id);
+	}
+	qs_close_connection(self->server, &io_ctx->connection);
+	return FALSE;
+}
+
+// Send completion of a TLS connection. Returns FALSE while records of the send
+// are still going out; bytes becomes the plaintext length for on_send.
+static BOOL tls_send_done(worker *self, io_context *io_ctx, u_long *bytes)
+{
+	tls_session *t = io_ctx->tls;
+	unsigned int error;
+
+	t->out_sent += *bytes;
+	if(t->out_sent < t->out_len) error = tls_out_post(io_ctx);
+	else if((error = tls_send_next(io_ctx)) == ERROR_NO_DATA)
+	{
+		*bytes = t->source_total;
+		tls_send_finish(io_ctx);
+		return TRUE;
+	}
+	if(error == ERROR_SUCCESS) return FALSE;
+	tls_send_finish(io_ctx);
+	self->stats.errors[qs_error_send]++;
+	report_error(self->server, qs_error_send, error, io_ctx->connection.id);
+	qs_close_connection(self->server, &io_ctx->connection);
+	return FALSE;
+}
+
+// Sends what the callback queued. Only called when the callback posted no
+// operation, so the connection still belongs to this thread.
+static void responses_flush(worker *self, io_context *io_ctx)
+{
+	unsigned int error;
+	if(!io_ctx->sendq || !io_ctx->sendq->count) return;
+	if((error = send_queue_post(io_ctx)) != ERROR_SUCCESS)
+	{
+		report_error(self->server, qs_error_send, error, io_ctx->connection.id);
+		qs_close_connection(self->server, &io_ctx->connection);
+	}
+}
+
+// The sends of a connection with a held receive have drained
+static void writable_deliver(worker *self, io_context *io_ctx)
+{
+	unsigned int error;
+	if(io_ctx->listener->callbacks.on_writable) (*io_ctx->listener->callbacks.on_writable)(&io_ctx->connection);
+	if((error = recv_post(io_ctx, io_ctx->held_offset)) != ERROR_SUCCESS)
+	{
+		report_error(self->server, qs_error_recv, error, io_ctx->connection.id);
+		qs_close_connection(self->server, &io_ctx->connection);
+	}
+	// Taken by send_release()
+	context_release(self->server, io_ctx);
+}
+
+// Passes the complete frames of the ring to on_frames. Without one the rest of
+// the frame is received unless it can never fit.
+static void frames_deliver(worker *self, io_context *io_ctx, LONGLONG started)
+{
+	qs_context *server = self->server;
+	recv_ring *ring = io_ctx->ring;
+	LONGLONG entered;
+	u_long count, connection_id = io_ctx->connection.id;
+	unsigned int error;
+	BOOL invalid;
+
+	ring->held = 0;
+	count = frames_collect(ring, &io_ctx->listener->params.framing, &invalid);
+	if(!count)
+	{
+		if(invalid || ring->used == ring->size)
+		{
+			self->stats.errors[qs_error_recv]++;
+			error = WSAEMSGSIZE;
+		}
+		else error = ring_recv_post(io_ctx);
+		if(error != ERROR_SUCCESS)
+		{
+			report_error(server, qs_error_recv, error, connection_id);
+			qs_close_connection(server, &io_ctx->connection);
+		}
+		return;
+	}
+	entered = callback_enter(self, qs_histogram_on_recv, started, io_ctx);
+	self->delivering = io_ctx;
+	self->issued = FALSE;
+	(*io_ctx->listener->callbacks.on_frames)(&io_ctx->connection, ring->frames, count);
+	self->delivering = NULL;
+	callback_leave(self, qs_histogram_on_recv, entered, connection_id);
+	if(!self->issued) responses_flush(self, io_ctx);
+}
+
 unsigned __stdcall working_thread(void *s) 
 {
-	qs_context *server = (qs_context *)s;
+	worker *self = (worker *)s;
+	qs_context *server = self->server;
+	qs_worker_stats *stats = &self->stats;
+	LONGLONG started, entered;
+	LONG epoch;
+	u_long connection_id;
 	u_long bytes_transferred;
 	ULONG_PTR key;
 	io_context *io_ctx;
-	unsigned char buf[256];
+	listener_state *listener;
+	BOOL closed;
 	int len;
-	u_long max_accepts = server->qs_params.listener.init_accepts_count;
-	u_long accepts = max_accepts;
 
+	current_worker = self;
 	for(;;)
 	{
 		if (!GetQueuedCompletionStatus(server->iocp, &bytes_transferred, &key, (LPOVERLAPPED *)&io_ctx, INFINITE))
 		{
 			if(io_ctx != NULL)
 			{
-				cry(server, "%s: GetQueuedCompletionStatus() fail with error: %d\n",	__func__, GetLastError());
-				continue;
+				closed = FALSE;
+				stats->errors[qs_error_completion]++;
+				// Broadcast sends fail when their connection is closed under them
+				if(io_ctx->ended_operation == broadcast_sent) broadcast_send_done(server, (broadcast_send *)io_ctx);
+				else if(io_ctx->ended_operation == connect_done) connect_failed(self, io_ctx, GetLastError());
+				else if(io_ctx->ended_operation == on_connect) accept_failed(self, io_ctx, GetLastError());
+				else if(io_ctx->ended_operation == tls_handshake || io_ctx->ended_operation == tls_handshake_sent) tls_handshake_complete(self, io_ctx, 0, GetLastError());
+				else if(io_ctx->ended_operation == proxy_recv || io_ctx->ended_operation == proxy_send) proxy_complete(self, (proxy_op *)io_ctx, 0, FALSE);
+				else if(io_ctx->ended_operation == udp_recv || io_ctx->ended_operation == udp_send) udp_complete(self, (udp_op *)io_ctx, 0, FALSE);
+				else if(io_ctx->ended_operation == send_done || io_ctx->ended_operation == recv_done || 
+					io_ctx->ended_operation == transmit_file || io_ctx->ended_operation == on_disconnect)
+				{
+					// A reset or shut down connection is closed like one at the end of its stream
+					if(io_ctx->ended_operation != on_disconnect) report_error(server, qs_error_completion, GetLastError(), io_ctx->connection.id);
+					if(io_ctx->ended_operation == send_done)
+					{
+						send_release(io_ctx, io_ctx->send_posted);
+						io_ctx->send_posted = 0;
+					}
+					io_ctx->ended_operation = on_disconnect;
+					bytes_transferred = 0;
+					closed = TRUE;
+				}
+				else report_error(server, qs_error_completion, GetLastError(), io_ctx->connection.id);
+				// The other packets may be freed already
+				if(!closed) continue;
 			}
 			else
 			{
@@ -724,41 +5019,119 @@ unsigned __stdcall working_thread(void *s)
 			}
 		}
 
-		if((!bytes_transferred && io_ctx->ended_operation != on_connect) || io_ctx->ended_operation == on_disconnect)
+		started = qpc_now();
+		stats->completions++;
+		epoch = server->histograms_epoch;
+		if(self->histograms_epoch != epoch)
+		{
+			memset(self->histograms, 0, sizeof(self->histograms));
+			self->histograms_epoch = epoch;
+		}
+		if(io_ctx->ended_operation == queue_probe)
+		{
+			server->qs_info.queue_delay = (u_long)qpc_to_us(server, started - server->scaling.probe_posted);
+			InterlockedExchange(&server->scaling.probe_pending, 0);
+			continue;
+		}
+		if(io_ctx->ended_operation == broadcast_shard)
+		{
+			broadcast_run(server, (broadcast_job *)io_ctx);
+			continue;
+		}
+		if(io_ctx->ended_operation == broadcast_members)
+		{
+			broadcast_members_run(server, (broadcast_job *)io_ctx);
+			continue;
+		}
+		if(io_ctx->ended_operation == udp_recv || io_ctx->ended_operation == udp_send)
+		{
+			udp_complete(self, (udp_op *)io_ctx, bytes_transferred, TRUE);
+			continue;
+		}
+		if(io_ctx->ended_operation == proxy_recv || io_ctx->ended_operation == proxy_send)
+		{
+			proxy_complete(self, (proxy_op *)io_ctx, bytes_transferred, TRUE);
+			continue;
+		}
+		if(io_ctx->ended_operation == broadcast_sent)
+		{
+			// TLS connections count plaintext, without the record overhead
+			stats->bytes_sent += ((broadcast_send *)io_ctx)->context->tls ? ((broadcast_send *)io_ctx)->payload->wsabuf.len : bytes_transferred;
+			broadcast_send_done(server, (broadcast_send *)io_ctx);
+			continue;
+		}
+		if(io_ctx->ended_operation == tls_handshake || io_ctx->ended_operation == tls_handshake_sent)
+		{
+			tls_handshake_complete(self, io_ctx, bytes_transferred, ERROR_SUCCESS);
+			stats->callbacks_time += qpc_now() - started;
+			continue;
+		}
+
+		if((!bytes_transferred && io_ctx->ended_operation != on_connect && io_ctx->ended_operation != connect_done && 
+			io_ctx->ended_operation != frames_ready && io_ctx->ended_operation != writable) || 
+			io_ctx->ended_operation == on_disconnect)
 		{
-			(*server->qs_params.callbacks.on_disconnect)(&io_ctx->connection);
-			socket_close(io_ctx->connection.socket.sock, &server->qs_info);
+			stats->disconnects++;
+			InterlockedDecrement(&server->qs_info.active_connections_count);
+			trace_record(self, started, qs_trace_disconnect, io_ctx->connection.id, 0);
+			// Broadcast sends completing from now on must not resume a held receive
+			InterlockedExchange(&io_ctx->recv_held, 0);
+			// Out of the registry and the groups first, so broadcast filters never
+			// see a connection in on_disconnect
+			groups_leave_all(server, io_ctx);
+			upstream_detach(io_ctx);
 			connection_storage_delete(server->storage, &io_ctx->connection);	
-			free_context(server, io_ctx);
-			for(; accepts < max_accepts; ++accepts)
-			{
-				if(!connection_storage_is_full(server->storage)) init_accept(server, buf);		
-			}
+			entered = callback_enter(self, qs_histogram_on_disconnect, started, io_ctx);
+			(*io_ctx->listener->callbacks.on_disconnect)(&io_ctx->connection);
+			callback_leave(self, qs_histogram_on_disconnect, entered, io_ctx->connection.id);
+			// Broadcast sends still holding the context fail or are cancelled now,
+			// deferred ones of a TLS connection are issued first to be cancelled as well
+			if(io_ctx->tls) tls_send_finish(io_ctx);
+			shutdown(io_ctx->connection.socket.sock, SD_BOTH);
+			CancelIoEx((HANDLE)io_ctx->connection.socket.sock, NULL);
+			context_release(server, io_ctx);
+			// A full registry may have held back the accepts of any listener
+			listeners_fill(server);
+			stats->callbacks_time += qpc_now() - started;
 			continue;
 		}
 
-		if(io_ctx->ended_operation == on_connect) 
+		if(io_ctx->ended_operation == on_connect || io_ctx->ended_operation == connect_done) 
 		{	
-			--accepts;
-			io_ctx->last_activity = GetTickCount();
-			setsockopt(io_ctx->connection.socket.sock, SOL_SOCKET, SO_UPDATE_ACCEPT_CONTEXT, 
-				(char *)&server->qs_socket, sizeof(server->qs_socket) );
+			// The context may be gone once on_connect returns
+			listener = io_ctx->connection.outbound ? NULL : io_ctx->listener;
+			if(io_ctx->ended_operation == on_connect)
+			{
+				InterlockedDecrement(&io_ctx->listener->pending);
+				stats->accepts++;
+				setsockopt(io_ctx->connection.socket.sock, SOL_SOCKET, SO_UPDATE_ACCEPT_CONTEXT, 
+					(char *)&io_ctx->listener->socket.sock, sizeof(SOCKET) );
+			}
+			else
+			{
+				connect_unlist(server, io_ctx);
+				stats->connects++;
+				setsockopt(io_ctx->connection.socket.sock, SOL_SOCKET, SO_UPDATE_CONNECT_CONTEXT, NULL, 0);
+			}
+			InterlockedIncrement(&server->qs_info.active_connections_count);
+			io_ctx->last_activity = clock_now(server);
 			set_keep_alive(&io_ctx->connection, server->qs_params.keep_alive_time, server->qs_params.keep_alive_interval);
 			len = sizeof(io_ctx->connection.socket.lsa);
 			getsockname(io_ctx->connection.socket.sock, &io_ctx->connection.socket.lsa.sa, &len);
 			len = sizeof(io_ctx->connection.socket.rsa);
 			getpeername(io_ctx->connection.socket.sock, &io_ctx->connection.socket.rsa.sa, &len);
 
-			if(CreateIoCompletionPort((HANDLE)io_ctx->connection.socket.sock, server->iocp, 0, 0) == NULL )
-			{
-				cry(server, "%s: CreateIoCompletionPort() fail with error: %d",	__func__, GetLastError());
-			}
-			connection_storage_add(server->storage, &io_ctx->connection);	
-			server->qs_params.callbacks.on_connect(&io_ctx->connection);
-			for(; accepts < max_accepts; ++accepts)
+			// Outbound sockets are associated with the port before ConnectEx()
+			if(!io_ctx->connection.outbound && CreateIoCompletionPort((HANDLE)io_ctx->connection.socket.sock, server->iocp, 0, 0) == NULL )
 			{
-				if(!connection_storage_is_full(server->storage)) init_accept(server, buf);		
+				stats->errors[qs_error_iocp]++;
+				report_error(server, qs_error_iocp, GetLastError(), io_ctx->connection.id);
 			}
+			// on_connect of a TLS connection follows its handshake
+			if(listener && listener->tls) tls_start(self, io_ctx);
+			else connection_opened(self, io_ctx, started);
+			if(listener) listener_fill(server, listener);
+			stats->callbacks_time += qpc_now() - started;
 			continue;
 		}
 	
@@ -766,37 +5139,108 @@ unsigned __stdcall working_thread(void *s)
 		switch(io_ctx->ended_operation) 
 		{
 		case(send_done):
-			io_ctx->last_activity = GetTickCount();
-			(*server->qs_params.callbacks.on_send)(&(io_ctx->connection));
+			// TLS connections count plaintext, without the record overhead
+			if(io_ctx->tls && !tls_send_done(self, io_ctx, &bytes_transferred)) break;
+			io_ctx->connection.bytes_transferred = bytes_transferred;
+			stats->bytes_sent += bytes_transferred;
+			send_release(io_ctx, io_ctx->send_posted);
+			io_ctx->send_posted = 0;
+			if(io_ctx->sendq && io_ctx->sendq->sending)
+			{
+				io_ctx->sendq->sending = FALSE;
+				io_ctx->sendq->count = 0;
+				io_ctx->sendq->area_used = 0;
+			}
+			worker_record(self, qs_histogram_send_in_flight, started - io_ctx->posted);
+			if(io_ctx->recv_completed)
+			{
+				worker_record(self, qs_histogram_turnaround, started - io_ctx->recv_completed);
+				io_ctx->recv_completed = 0;
+			}
+			trace_record(self, started, qs_trace_send_complete, io_ctx->connection.id, bytes_transferred);
+			io_ctx->last_activity = clock_now(server);
+			entered = callback_enter(self, qs_histogram_on_send, started, io_ctx);
+			connection_id = io_ctx->connection.id;
+			(*io_ctx->listener->callbacks.on_send)(&(io_ctx->connection));
+			callback_leave(self, qs_histogram_on_send, entered, connection_id);
 			break;
 
 		case(recv_done):
-			io_ctx->last_activity = GetTickCount();
-			(*server->qs_params.callbacks.on_recv)(&(io_ctx->connection));
+			if(io_ctx->tls && !tls_recv_done(self, io_ctx, &bytes_transferred)) break;
+			io_ctx->connection.bytes_transferred = bytes_transferred;
+			stats->bytes_received += bytes_transferred;
+			worker_record(self, qs_histogram_recv_in_flight, started - io_ctx->posted);
+			io_ctx->recv_completed = started;
+			trace_record(self, started, qs_trace_recv_complete, io_ctx->connection.id, bytes_transferred);
+			io_ctx->last_activity = clock_now(server);
+			if(io_ctx->ring)
+			{
+				io_ctx->ring->used += bytes_transferred;
+				if(io_ctx->listener->params.framing.type != qs_framing_none)
+				{
+					frames_deliver(self, io_ctx, started);
+					break;
+				}
+				ring_linearize(io_ctx->ring);
+				io_ctx->connection.input.buf = io_ctx->ring->data + io_ctx->ring->start;
+				io_ctx->connection.input.data_len = io_ctx->ring->used;
+			}
+			else if(io_ctx->recv_offset)
+			{
+				io_ctx->connection.buffer.buf = io_ctx->buffer_base;
+				io_ctx->connection.buffer.data_len = io_ctx->recv_offset + bytes_transferred;
+			}
+			entered = callback_enter(self, qs_histogram_on_recv, started, io_ctx);
+			connection_id = io_ctx->connection.id;
+			self->delivering = io_ctx;
+			self->issued = FALSE;
+			(*io_ctx->listener->callbacks.on_recv)(&(io_ctx->connection));
+			self->delivering = NULL;
+			callback_leave(self, qs_histogram_on_recv, entered, connection_id);
+			if(!self->issued) responses_flush(self, io_ctx);
+			break;
+
+		case(frames_ready):
+			frames_deliver(self, io_ctx, started);
+			break;
+
+		case(writable):
+			writable_deliver(self, io_ctx);
 			break;
 
 		case(transmit_file):
-			io_ctx->last_activity = GetTickCount();
-			(*server->qs_params.callbacks.on_send_file)(&(io_ctx->connection));
+			stats->bytes_sent += bytes_transferred;
+			worker_record(self, qs_histogram_send_in_flight, started - io_ctx->posted);
+			trace_record(self, started, qs_trace_send_complete, io_ctx->connection.id, bytes_transferred);
+			io_ctx->last_activity = clock_now(server);
+			entered = callback_enter(self, qs_histogram_on_send_file, started, io_ctx);
+			connection_id = io_ctx->connection.id;
+			(*io_ctx->listener->callbacks.on_send_file)(&(io_ctx->connection));
+			callback_leave(self, qs_histogram_on_send_file, entered, connection_id);
 			break;
 
 		case(user_message):
-			io_ctx->last_activity = GetTickCount();
-			(*server->qs_params.callbacks.on_message)(&(io_ctx->connection), (void *)key);
+			io_ctx->last_activity = clock_now(server);
+			entered = callback_enter(self, qs_histogram_on_message, started, io_ctx);
+			connection_id = io_ctx->connection.id;
+			(*io_ctx->listener->callbacks.on_message)(&(io_ctx->connection), (void *)key);
+			callback_leave(self, qs_histogram_on_message, entered, connection_id);
 			break;
 
 		case(start_server):
-			for(accepts = 0; accepts < server->qs_params.listener.init_accepts_count; ++accepts)
-			{
-				init_accept(server, buf);		
-			}
+			listeners_fill(server);
 			free_context(server, io_ctx);
 			break;
 		case(stop_server):
 			free_context(server, io_ctx);
 			goto exit;
-		}
 
+		case(retire_worker):
+			// The packet is shared, the controller has already accounted for this worker
+			self->state = worker_retired;
+			goto exit;
+		}
+		stats->callbacks_time += qpc_now() - started;
 	}
 exit:
 	return 0;
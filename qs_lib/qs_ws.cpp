@@ -0,0 +1,492 @@
+#include "qs_ws.h"
+
+#include <intrin.h>
+#if defined(_M_IX86) || defined(_M_X64)
+#include <immintrin.h>
+#define HAVE_SSE2
+#elif defined(_M_ARM) || defined(_M_ARM64)
+#include <arm_neon.h>
+#define HAVE_NEON
+#endif
+
+#define WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+#define WS_KEY_LENGTH 24
+#define WS_ACCEPT_LENGTH 28
+
+typedef struct _sha1_context {
+	unsigned int h[5];
+	unsigned char block[64];
+	size_t block_len;
+	ULONGLONG len;
+} sha1_context;
+
+#define ROL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+static void sha1_block(sha1_context *ctx, const unsigned char *p)
+{
+	unsigned int w[80], a, b, c, d, e, f, k, t;
+	int i;
+
+	for(i = 0; i < 16; ++i) w[i] = (unsigned int)p[i * 4] << 24 | (unsigned int)p[i * 4 + 1] << 16 | (unsigned int)p[i * 4 + 2] << 8 | p[i * 4 + 3];
+	for(i = 16; i < 80; ++i) w[i] = ROL(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+	a = ctx->h[0];
+	b = ctx->h[1];
+	c = ctx->h[2];
+	d = ctx->h[3];
+	e = ctx->h[4];
+	for(i = 0; i < 80; ++i)
+	{
+		if(i < 20)
+		{
+			f = (b & c) | (~b & d);
+			k = 0x5A827999;
+		}
+		else if(i < 40)
+		{
+			f = b ^ c ^ d;
+			k = 0x6ED9EBA1;
+		}
+		else if(i < 60)
+		{
+			f = (b & c) | (b & d) | (c & d);
+			k = 0x8F1BBCDC;
+		}
+		else
+		{
+			f = b ^ c ^ d;
+			k = 0xCA62C1D6;
+		}
+		t = ROL(a, 5) + f + e + k + w[i];
+		e = d;
+		d = c;
+		c = ROL(b, 30);
+		b = a;
+		a = t;
+	}
+	ctx->h[0] += a;
+	ctx->h[1] += b;
+	ctx->h[2] += c;
+	ctx->h[3] += d;
+	ctx->h[4] += e;
+}
+
+static void sha1_init(sha1_context *ctx)
+{
+	ctx->h[0] = 0x67452301;
+	ctx->h[1] = 0xEFCDAB89;
+	ctx->h[2] = 0x98BADCFE;
+	ctx->h[3] = 0x10325476;
+	ctx->h[4] = 0xC3D2E1F0;
+	ctx->block_len = 0;
+	ctx->len = 0;
+}
+
+static void sha1_update(sha1_context *ctx, const void *data, size_t len)
+{
+	const unsigned char *p = (const unsigned char *)data;
+	ctx->len += len;
+	while(len--)
+	{
+		ctx->block[ctx->block_len++] = *p++;
+		if(ctx->block_len == 64)
+		{
+			sha1_block(ctx, ctx->block);
+			ctx->block_len = 0;
+		}
+	}
+}
+
+static void sha1_final(sha1_context *ctx, unsigned char digest[20])
+{
+	ULONGLONG bits = ctx->len * 8;
+	unsigned char pad = 0x80;
+	int i;
+
+	sha1_update(ctx, &pad, 1);
+	pad = 0;
+	while(ctx->block_len != 56) sha1_update(ctx, &pad, 1);
+	for(i = 7; i >= 0; --i)
+	{
+		pad = (unsigned char)(bits >> (i * 8));
+		sha1_update(ctx, &pad, 1);
+	}
+	for(i = 0; i < 20; ++i) digest[i] = (unsigned char)(ctx->h[i / 4] >> (24 - (i % 4) * 8));
+}
+
+static size_t base64_encode(const unsigned char *data, size_t len, char *out)
+{
+	static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	size_t i, n = 0;
+	unsigned int v;
+
+	for(i = 0; i + 2 < len; i += 3)
+	{
+		v = (unsigned int)data[i] << 16 | (unsigned int)data[i + 1] << 8 | data[i + 2];
+		out[n++] = alphabet[v >> 18];
+		out[n++] = alphabet[(v >> 12) & 63];
+		out[n++] = alphabet[(v >> 6) & 63];
+		out[n++] = alphabet[v & 63];
+	}
+	if(i < len)
+	{
+		v = (unsigned int)data[i] << 16 | (i + 1 < len ? (unsigned int)data[i + 1] << 8 : 0);
+		out[n++] = alphabet[v >> 18];
+		out[n++] = alphabet[(v >> 12) & 63];
+		out[n++] = i + 1 < len ? alphabet[(v >> 6) & 63] : '=';
+		out[n++] = '=';
+	}
+	return n;
+}
+
+static BOOL header_is(const qs_http_request *request, const char *name, const char *value)
+{
+	const qs_http_str *h = qs_http_get_header(request, name);
+	size_t len = strlen(value);
+	return h && h->len == len && _strnicmp(h->p, value, len) == 0;
+}
+
+// Connection is a comma separated list of tokens, one of them must be "upgrade"
+static BOOL header_has_token(const qs_http_request *request, const char *name, const char *token)
+{
+	const qs_http_str *h = qs_http_get_header(request, name);
+	size_t len = strlen(token), i = 0, start;
+
+	if(!h) return FALSE;
+	while(i < h->len)
+	{
+		while(i < h->len && (h->p[i] == ' ' || h->p[i] == '\t' || h->p[i] == ',')) ++i;
+		start = i;
+		while(i < h->len && h->p[i] != ',' && h->p[i] != ' ' && h->p[i] != '\t') ++i;
+		if(i - start == len && _strnicmp(h->p + start, token, len) == 0) return TRUE;
+	}
+	return FALSE;
+}
+
+MYDLL_API BOOL qs_ws_handshake(const qs_http_request *request, qs_http_response *response)
+{
+	static const char head[] = "HTTP/1.1 101 Switching Protocols\r\n"
+		"Upgrade: websocket\r\n"
+		"Connection: Upgrade\r\n"
+		"Sec-WebSocket-Accept: ";
+	const qs_http_str *key;
+	sha1_context sha1;
+	unsigned char digest[20];
+	char *p;
+
+	if(request->method.len != 3 || memcmp(request->method.p, "GET", 3) != 0 || request->version_minor < 1) return FALSE;
+	if(!header_is(request, "Upgrade", "websocket") || !header_has_token(request, "Connection", "upgrade")) return FALSE;
+	if(!header_is(request, "Sec-WebSocket-Version", "13")) return FALSE;
+	key = qs_http_get_header(request, "Sec-WebSocket-Key");
+	if(!key || key->len != WS_KEY_LENGTH) return FALSE;
+	if(response->size - response->len < sizeof(head) - 1 + WS_ACCEPT_LENGTH + 4) return FALSE;
+
+	sha1_init(&sha1);
+	sha1_update(&sha1, key->p, key->len);
+	sha1_update(&sha1, WS_GUID, sizeof(WS_GUID) - 1);
+	sha1_final(&sha1, digest);
+
+	p = response->buf + response->len;
+	memcpy(p, head, sizeof(head) - 1);
+	p += sizeof(head) - 1;
+	p += base64_encode(digest, sizeof(digest), p);
+	memcpy(p, "\r\n\r\n", 4);
+	response->len += (u_long)(sizeof(head) - 1 + WS_ACCEPT_LENGTH + 4);
+	return TRUE;
+}
+
+#if defined(HAVE_SSE2)
+static BOOL cpu_has_avx2(void)
+{
+	static volatile LONG avx2 = -1;
+	int info[4];
+	LONG result = 0;
+
+	if(avx2 < 0)
+	{
+		__cpuid(info, 0);
+		if(info[0] >= 7)
+		{
+			__cpuid(info, 1);
+			// AVX and OSXSAVE, then the OS must save the YMM registers
+			if((info[2] & (1 << 27)) && (info[2] & (1 << 28)) && (_xgetbv(0) & 6) == 6)
+			{
+				__cpuidex(info, 7, 0);
+				result = (info[1] & (1 << 5)) != 0;
+			}
+		}
+		avx2 = result;
+	}
+	return avx2 > 0;
+}
+
+static size_t unmask_avx2(char *data, size_t len, unsigned int key)
+{
+	__m256i k = _mm256_set1_epi32((int)key);
+	size_t i;
+	for(i = 0; i + 32 <= len; i += 32)
+	{
+		_mm256_storeu_si256((__m256i *)(data + i), _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(data + i)), k));
+	}
+	_mm256_zeroupper();
+	return i;
+}
+#endif
+
+// XORs the payload with the repeating 4 byte mask: 32 bytes at a time with
+// AVX2, 16 with SSE2 or NEON, then words and the tail.
+MYDLL_API void qs_ws_unmask(char *data, size_t len, const unsigned char mask[4])
+{
+	unsigned int key, v;
+	size_t i = 0;
+
+	memcpy(&key, mask, 4);
+#if defined(HAVE_SSE2)
+	{
+		__m128i k = _mm_set1_epi32((int)key);
+		if(len >= 64 && cpu_has_avx2()) i = unmask_avx2(data, len, key);
+		for(; i + 16 <= len; i += 16)
+		{
+			_mm_storeu_si128((__m128i *)(data + i), _mm_xor_si128(_mm_loadu_si128((const __m128i *)(data + i)), k));
+		}
+	}
+#elif defined(HAVE_NEON)
+	{
+		uint8x16_t k = vreinterpretq_u8_u32(vdupq_n_u32(key));
+		for(; i + 16 <= len; i += 16)
+		{
+			vst1q_u8((uint8_t *)data + i, veorq_u8(vld1q_u8((const uint8_t *)data + i), k));
+		}
+	}
+#endif
+	for(; i + 4 <= len; i += 4)
+	{
+		memcpy(&v, data + i, 4);
+		v ^= key;
+		memcpy(data + i, &v, 4);
+	}
+	for(; i < len; ++i) data[i] ^= mask[i & 3];
+}
+
+// Well-formed UTF-8: no overlong forms, surrogates or code points above
+// U+10FFFF. ASCII is skipped 8 bytes at a time.
+static BOOL utf8_valid(const unsigned char *p, size_t len)
+{
+	ULONGLONG v;
+	size_t i = 0, n;
+	unsigned char c;
+
+	while(i < len)
+	{
+		if(i + 8 <= len)
+		{
+			memcpy(&v, p + i, 8);
+			if(!(v & 0x8080808080808080ULL))
+			{
+				i += 8;
+				continue;
+			}
+		}
+		c = p[i];
+		if(c < 0x80)
+		{
+			i++;
+			continue;
+		}
+		if(c >= 0xC2 && c <= 0xDF) n = 1;
+		else if(c >= 0xE0 && c <= 0xEF) n = 2;
+		else if(c >= 0xF0 && c <= 0xF4) n = 3;
+		else return FALSE;
+		if(len - i <= n) return FALSE;
+		// The second byte is narrowed for the forms which could be overlong or out of range
+		if((c == 0xE0 && p[i + 1] < 0xA0) || (c == 0xED && p[i + 1] > 0x9F) ||
+			(c == 0xF0 && p[i + 1] < 0x90) || (c == 0xF4 && p[i + 1] > 0x8F)) return FALSE;
+		for(++i; n; --n, ++i)
+		{
+			if((p[i] & 0xC0) != 0x80) return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+// Status codes a peer may send in a close frame (RFC 6455 7.4): the defined
+// ones which are not reserved for local use, and the registered and private ranges
+static BOOL close_code_valid(u_short code)
+{
+	if(code >= 1000 && code <= 1003) return TRUE;
+	if(code >= 1007 && code <= 1014) return TRUE;
+	return code >= 3000 && code <= 4999;
+}
+
+typedef struct _ws_frame {
+	BOOL fin;
+	int opcode;
+	ULONGLONG len;
+	unsigned char mask[4];
+} ws_frame;
+
+// Header length, 0 when it is not complete yet, -1 for frames a server must refuse
+static int frame_header(const unsigned char *p, size_t avail, ws_frame *f)
+{
+	int n = 2, i;
+
+	if(avail < 2) return 0;
+	// No extensions are negotiated, so the RSV bits must be clear
+	if(p[0] & 0x70) return -1;
+	// Client frames must be masked
+	if(!(p[1] & 0x80)) return -1;
+	f->fin = (p[0] & 0x80) != 0;
+	f->opcode = p[0] & 0x0F;
+	f->len = p[1] & 0x7F;
+	if(f->len == 126)
+	{
+		if(avail < 4) return 0;
+		f->len = (ULONGLONG)p[2] << 8 | p[3];
+		n = 4;
+	}
+	else if(f->len == 127)
+	{
+		if(avail < 10) return 0;
+		for(i = 0, f->len = 0; i < 8; ++i) f->len = f->len << 8 | p[2 + i];
+		if(f->len >> 63) return -1;
+		n = 10;
+	}
+	if(avail < (size_t)n + 4) return 0;
+	memcpy(f->mask, p + n, 4);
+	return n + 4;
+}
+
+MYDLL_API void qs_ws_parser_init(qs_ws_parser *parser, u_long buffered)
+{
+	parser->buffered = buffered;
+	parser->message_len = 0;
+	parser->message_opcode = qs_ws_continuation;
+}
+
+// Processes the data of a receive posted by qs_ws_recv(). Frames are unmasked in
+// place and the payloads of a fragmented message are moved together behind each
+// other; control frames in between are handled and dropped. What is left of an
+// incomplete message stays at the start of the buffer.
+MYDLL_API qs_ws_result qs_ws_on_recv(qs_ws_parser *parser, connection *connection, QS_WS_MESSAGE_PROC on_message, void *arg)
+{
+	char *base, *payload;
+	u_long size;
+	size_t total, pos, out, start, joined;
+	ws_frame f;
+	int header;
+	qs_ws_opcode opcode;
+	qs_ws_result res = qs_ws_ok;
+
+	if(!parser || !connection || !on_message) return qs_ws_protocol_error;
+	base = qs_buffer_base(connection, &size);
+	total = parser->buffered + connection->bytes_transferred;
+	start = 0;
+	out = pos = parser->message_len;
+
+	while(pos < total)
+	{
+		if((header = frame_header((const unsigned char *)base + pos, total - pos, &f)) < 0) return qs_ws_protocol_error;
+		if(header == 0) break;
+		// The frame has to fit behind the joined fragments once the buffer is compacted
+		if(f.len > size || (out - start) + header + f.len > size) return qs_ws_too_large;
+		if(total - pos < header + f.len) break;
+		payload = base + pos + header;
+		qs_ws_unmask(payload, (size_t)f.len, f.mask);
+
+		if(f.opcode & 0x08)
+		{
+			if(!f.fin || f.len > 125) return qs_ws_protocol_error;
+			pos += header + (size_t)f.len;
+			if(f.opcode == qs_ws_ping)
+			{
+				if(qs_ws_send(connection, qs_ws_pong, payload, (u_long)f.len) != ERROR_SUCCESS) return qs_ws_send_failed;
+			}
+			else if(f.opcode == qs_ws_close)
+			{
+				// A body starts with a 2 byte status code, the reason is UTF-8
+				if(f.len == 1) return qs_ws_protocol_error;
+				if(f.len >= 2 && !close_code_valid((u_short)((unsigned char)payload[0] << 8 | (unsigned char)payload[1]))) return qs_ws_protocol_error;
+				if(f.len > 2 && !utf8_valid((const unsigned char *)payload + 2, (size_t)f.len - 2)) return qs_ws_protocol_error;
+				// Echo the status code and stop reading
+				if(qs_ws_send(connection, qs_ws_close, payload, f.len >= 2 ? 2 : 0) != ERROR_SUCCESS) return qs_ws_send_failed;
+				res = qs_ws_closed;
+				break;
+			}
+			else if(f.opcode != qs_ws_pong) return qs_ws_protocol_error;
+			continue;
+		}
+
+		if(f.opcode == qs_ws_continuation)
+		{
+			if(parser->message_opcode == qs_ws_continuation) return qs_ws_protocol_error;
+		}
+		else if(f.opcode == qs_ws_text || f.opcode == qs_ws_binary)
+		{
+			if(parser->message_opcode != qs_ws_continuation) return qs_ws_protocol_error;
+			parser->message_opcode = (qs_ws_opcode)f.opcode;
+		}
+		else return qs_ws_protocol_error;
+
+		if(payload != base + out) memmove(base + out, payload, (size_t)f.len);
+		out += (size_t)f.len;
+		pos += header + (size_t)f.len;
+		if(f.fin)
+		{
+			opcode = parser->message_opcode;
+			parser->message_opcode = qs_ws_continuation;
+			joined = start;
+			start = out;
+			if(opcode == qs_ws_text && !utf8_valid((const unsigned char *)base + joined, out - joined)) return qs_ws_protocol_error;
+			if(!on_message(connection, opcode, base + joined, out - joined, arg))
+			{
+				res = qs_ws_stopped;
+				break;
+			}
+		}
+	}
+
+	// Joined fragments first, then the unparsed frames
+	joined = out - start;
+	if(start && joined) memmove(base, base + start, joined);
+	if(pos < total && pos != joined) memmove(base + joined, base + pos, total - pos);
+	parser->message_len = (u_long)joined;
+	parser->buffered = (u_long)(joined + total - pos);
+	return res;
+}
+
+// Posts a receive after the buffered part of an incomplete message. Pongs and
+// close replies queued by qs_ws_on_recv() are sent first instead; the receive
+// then follows from on_send like after any other send.
+MYDLL_API unsigned int qs_ws_recv(qs_ws_parser *parser, connection *connection)
+{
+	unsigned int error;
+	if(!parser) return ERROR_INVALID_PARAMETER;
+	if((error = qs_send_flush(connection)) != ERROR_NO_DATA) return error;
+	return qs_recv_append(connection, parser->buffered);
+}
+
+MYDLL_API unsigned int qs_ws_send(connection *connection, qs_ws_opcode opcode, const char *data, u_long len)
+{
+	unsigned char *p;
+	u_long available, n;
+	int i;
+
+	if(!connection || (!data && len)) return ERROR_INVALID_PARAMETER;
+	n = len < 126 ? 2 : (len < 65536 ? 4 : 10);
+	if(!(p = (unsigned char *)qs_send_reserve(connection, &available))) return ERROR_INSUFFICIENT_BUFFER;
+	if(available < n + len) return ERROR_INSUFFICIENT_BUFFER;
+	p[0] = (unsigned char)(0x80 | opcode);
+	if(n == 2) p[1] = (unsigned char)len;
+	else if(n == 4)
+	{
+		p[1] = 126;
+		p[2] = (unsigned char)(len >> 8);
+		p[3] = (unsigned char)len;
+	}
+	else
+	{
+		p[1] = 127;
+		for(i = 0; i < 8; ++i) p[2 + i] = (unsigned char)((ULONGLONG)len >> (56 - i * 8));
+	}
+	if(len) memcpy(p + n, data, len);
+	return qs_send_commit(connection, n + len);
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include "qs_http.h"
+
+// WebSocket (RFC 6455) server side: upgrade handshake and an incremental frame
+// parser working in place over connection->buffer like qs_http. Fragmented
+// messages are joined in the buffer, pings are answered through the send queue.
+// Text messages and close reasons must be valid UTF-8.
+
+typedef enum _qs_ws_opcode {
+	qs_ws_continuation = 0x0,
+	qs_ws_text = 0x1,
+	qs_ws_binary = 0x2,
+	qs_ws_close = 0x8,
+	qs_ws_ping = 0x9,
+	qs_ws_pong = 0xA
+} qs_ws_opcode;
+
+typedef enum _qs_ws_result {
+	qs_ws_ok,                   // all complete messages were processed
+	qs_ws_stopped,              // the message callback returned FALSE
+	qs_ws_closed,               // the peer sent a close frame, the reply is queued
+	qs_ws_protocol_error,
+	qs_ws_too_large,            // a message does not fit into the connection buffer
+	qs_ws_send_failed           // a pong or close reply could not be queued, close the connection
+} qs_ws_result;
+
+// Parser state of one connection, keep it in user_data.
+typedef struct _qs_ws_parser {
+	u_long buffered;            // bytes at the start of the buffer: joined fragments, then unparsed frames
+	u_long message_len;         // payload of the fragmented message joined so far
+	qs_ws_opcode message_opcode;    // opcode of that message, qs_ws_continuation when there is none
+} qs_ws_parser;
+
+// Called for every complete text or binary message. The payload is unmasked in
+// place and stays valid until the callback returns. Return FALSE to stop.
+typedef BOOL (*QS_WS_MESSAGE_PROC)(connection *connection, qs_ws_opcode opcode, const char *data, size_t len, void *arg);
+
+// Writes the 101 response to a valid upgrade request, FALSE when the request is not one.
+MYDLL_API BOOL         qs_ws_handshake(const qs_http_request *request, qs_http_response *response);
+// buffered: bytes the HTTP parser left at the start of the buffer after the upgrade request
+MYDLL_API void         qs_ws_parser_init(qs_ws_parser *parser, u_long buffered);
+MYDLL_API qs_ws_result qs_ws_on_recv(qs_ws_parser *parser, connection *connection, QS_WS_MESSAGE_PROC on_message, void *arg);
+// Sends what the queue holds instead of receiving, call it again from on_send
+MYDLL_API unsigned int qs_ws_recv(qs_ws_parser *parser, connection *connection);
+// Queues an unmasked frame with the whole message, see qs_send_append()
+MYDLL_API unsigned int qs_ws_send(connection *connection, qs_ws_opcode opcode, const char *data, u_long len);
+MYDLL_API void         qs_ws_unmask(char *data, size_t len, const unsigned char mask[4]);
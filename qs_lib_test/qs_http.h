@@ -0,0 +1,87 @@
+#pragma once
+
+#include "qs_lib.h"
+
+// Incremental HTTP/1.1 request parser working in place over connection->buffer.
+// Parsed strings are views into the receive buffer and are not zero terminated.
+
+#define QS_HTTP_MAX_HEADERS 64
+
+typedef struct _qs_http_str {
+	const char *p;
+	size_t len;
+} qs_http_str;
+
+typedef struct _qs_http_header {
+	qs_http_str name;
+	qs_http_str value;
+} qs_http_header;
+
+typedef struct _qs_http_request {
+	qs_http_str method;
+	qs_http_str uri;
+	qs_http_str path;
+	qs_http_str query;
+	int version_minor;          // x of HTTP/1.x
+	qs_http_header headers[QS_HTTP_MAX_HEADERS];
+	size_t headers_count;
+	size_t content_length;
+	qs_http_str body;
+	BOOL keep_alive;
+} qs_http_request;
+
+typedef enum _qs_http_result {
+	qs_http_ok,                 // a request was parsed, or all buffered data was processed
+	qs_http_incomplete,         // more data is needed
+	qs_http_stopped,            // the request callback returned FALSE
+	qs_http_bad_request,
+	qs_http_too_large,          // headers or body do not fit into the connection buffer
+	qs_http_not_implemented     // chunked request bodies are not supported
+} qs_http_result;
+
+// Parser state of one connection, keep it in user_data.
+typedef struct _qs_http_parser {
+	u_long buffered;            // bytes of unprocessed requests at the start of the buffer
+	u_long scanned;             // bytes of the current request already searched for the header end
+	u_long header_len;          // 0 until the headers of the current request are parsed
+	qs_http_request request;
+} qs_http_parser;
+
+// Called for every complete request. The views stay valid until the callback returns.
+// Return FALSE to stop processing the buffered requests.
+typedef BOOL (*QS_HTTP_REQUEST_PROC)(connection *connection, qs_http_request *request, void *arg);
+
+MYDLL_API void           qs_http_parser_init(qs_http_parser *parser);
+MYDLL_API qs_http_result qs_http_parse(qs_http_parser *parser, const char *data, size_t len, size_t *consumed);
+MYDLL_API qs_http_result qs_http_on_recv(qs_http_parser *parser, connection *connection, QS_HTTP_REQUEST_PROC on_request, void *arg);
+MYDLL_API unsigned int   qs_http_recv(qs_http_parser *parser, connection *connection);
+MYDLL_API const qs_http_str *qs_http_get_header(const qs_http_request *request, const char *name);
+
+// Response writer. Status line, headers and body are copied straight into a
+// caller supplied buffer, usually the connection buffer; common header blocks
+// are prebuilt and the Date header comes from qs_get_date().
+typedef struct _qs_http_response {
+	char *buf;
+	u_long size;
+	u_long len;                 // bytes written so far, the data_len to send
+} qs_http_response;
+
+typedef enum _qs_http_content_type {
+	qs_http_content_none,
+	qs_http_text_plain,
+	qs_http_text_html,
+	qs_http_application_json,
+	qs_http_application_octet_stream
+} qs_http_content_type;
+
+// The writers return FALSE and leave the response unchanged when the data does not fit.
+MYDLL_API void qs_http_response_init(qs_http_response *response, char *buf, u_long size);
+MYDLL_API BOOL qs_http_write_status(qs_http_response *response, void *qs_instance, int status, qs_http_content_type content_type, BOOL keep_alive);
+MYDLL_API BOOL qs_http_write_header(qs_http_response *response, const char *name, size_t name_len, const char *value, size_t value_len);
+MYDLL_API BOOL qs_http_write_body(qs_http_response *response, const char *body, size_t len);
+MYDLL_API char* qs_http_end_headers(qs_http_response *response, size_t content_length);
+
+// Writes the response into the send queue of the connection, so responses to
+// pipelined requests leave in one send after on_recv returns.
+MYDLL_API BOOL         qs_http_response_reserve(qs_http_response *response, connection *connection);
+MYDLL_API unsigned int qs_http_response_commit(qs_http_response *response, connection *connection);
@@ -1,6 +1,5 @@
 #pragma once
 
-//#define USE_IPV6
 
 #ifdef MYDLL_EXPORTS
 #define MYDLL_API extern "C" __declspec(dllexport)
@@ -14,21 +13,19 @@
 
 #include <ws2tcpip.h>
 #include <mswsock.h>
+#include <afunix.h>
 
 // Unified socket address.
 union usa {
 	struct sockaddr sa;
 	struct sockaddr_in sin;
-#if defined(USE_IPV6)
-	struct sockaddr_in6 sin6;
-#else
-
-#endif
+	struct sockaddr_in6 sin6;   // also IPv4 clients of dual-stack sockets, as mapped addresses
+	struct sockaddr_un sun;     // "unix:" listeners
 };
 
 // Describes listening socket, or socket which was accept()-ed
 struct socket {
-	SOCKET sock;          // Listening socket
+	SOCKET sock;
 	union usa lsa;        // Local socket address
 	union usa rsa;        // Remote socket address
 };
@@ -43,49 +40,288 @@ struct _connection {
 	struct buffer buffer;
 	u_long bytes_transferred;
 	void *user_data;
+	u_long id;                  // unique within the server instance, used in traces
+	struct buffer input;        // unconsumed received data with params.receive_ring
+	BOOL outbound;              // opened with qs_connect()
+	u_long listener_id;         // accepting listener, 0 for outbound connections
 };
 
 typedef struct _connection connection;
 
+// Kinds of failures counted in the statistics.
+typedef enum _qs_error_type {
+	qs_error_accept,          // AcceptEx() and accepted socket setup
+	qs_error_recv,            // WSARecv()
+	qs_error_send,            // WSASend(), TransmitFile()
+	qs_error_completion,      // failed completion packets
+	qs_error_iocp,            // completion port association
+	qs_error_connect,         // ConnectEx() and connect timeouts
+	qs_error_tls,             // TLS handshakes and records, SECURITY_STATUS codes
+	qs_error_types_count
+} qs_error_type;
+
+// Failure reported from the I/O path. Repeated failures of the same kind and
+// code are folded into one event by the error logging thread, the connection
+// id is cleared when the folded occurrences come from different connections.
+typedef struct _qs_error_event {
+	qs_error_type type;
+	u_long code;                // Win32 / Windows Sockets error code
+	u_long connection_id;       // 0 when the failure is not tied to one connection
+	ULONGLONG timestamp;        // ms, system uptime of the first occurrence
+	u_long count;               // occurrences folded into this event
+} qs_error_event;
+
+// Message framing of a listener. With framing the connection receives into its
+// own ring and complete messages are passed to on_frames in batches.
+typedef enum _qs_framing_type {
+	qs_framing_none,            // raw chunks are passed to on_recv
+	qs_framing_fixed,           // fixed size header with a length field
+	qs_framing_varint,          // LEB128 length in front of the payload
+	qs_framing_delimiter        // payload ends with a delimiter sequence
+} qs_framing_type;
+
+typedef struct _qs_frame {
+	const char *data;           // frame start, valid until on_frames returns
+	u_long len;                 // header and payload, the delimiter excluded
+	u_long header_len;          // bytes in front of the payload
+} qs_frame;
+
 // Callback functions.
 typedef BOOL (*ON_CONNECT_PROC)( connection *connection );
+typedef void (*ON_CONNECT_ERROR_PROC)( connection *connection, u_long error );
 typedef void (*ON_DISCONNECT_PROC)( connection *connection );
 typedef BOOL (*ON_RECV_PROC)( connection *connection);
 typedef BOOL (*ON_SEND_PROC)( connection *connection);
 typedef BOOL (*ON_SENDFILE_PROC)( connection *connection);
 typedef void (*ON_ERROR_PROC)( wchar_t *str_error);
+typedef void (*ON_ERROR_EVENT_PROC)( const qs_error_event *error_event);
+typedef BOOL (*ON_FRAMES_PROC)( connection *connection, const qs_frame *frames, u_long frames_count);
 typedef void (*USERMESSAGE_HANDLER_PROC)(connection *connection, void *message);
+typedef void (*ON_WRITABLE_PROC)( connection *connection);
 typedef void ( *ENUM_CONNECTIONS_PROC)(connection *connection);
+typedef void (*ON_DATAGRAM_PROC)( void *endpoint, const union usa *from, const char *data, u_long len, void *user_data );
+// Selects broadcast recipients while a shard of the registry or of the group index is locked
+typedef BOOL (*BROADCAST_FILTER_PROC)(connection *connection, void *arg);
+
+// Reference counted message for qs_broadcast(). Created with one reference;
+// every pending send holds another, so the creator may release it right away.
+// A broadcast is one send of its own next to the sends of the connection: it
+// never splits the data of one qs_send() or qs_send_flush(), but it may land
+// between two of them. Protocols which write a frame in several parts should
+// queue the parts and flush them as one send to connections taking broadcasts.
+typedef struct _qs_payload qs_payload;
+
+typedef struct _qs_callbacks {
+	ON_CONNECT_PROC               on_connect;
+	ON_CONNECT_ERROR_PROC         on_connect_error;     // qs_connect() failed, the connection is freed after it
+	ON_DISCONNECT_PROC            on_disconnect;
+	ON_SEND_PROC                  on_send;
+	ON_SENDFILE_PROC              on_send_file;
+	ON_RECV_PROC                  on_recv;
+	ON_FRAMES_PROC                on_frames;
+	ON_ERROR_PROC                 on_error;
+	ON_ERROR_EVENT_PROC           on_error_event;
+	USERMESSAGE_HANDLER_PROC	  on_message;
+	ON_WRITABLE_PROC              on_writable;          // a receive held by params.limits is about to be posted
+} qs_callbacks;
+
+// TLS of a listener, terminated with SChannel. Its connections get on_connect
+// after the handshake, on_recv sees plaintext and sends are encrypted on the way
+// out. qs_send_file() and qs_proxy() are not supported on them; qs_broadcast()
+// encrypts a copy of the payload for each of them.
+typedef struct _qs_tls_params {
+	const char *cert_subject;           // looked up in the system certificate store
+	const char *cert_store;             // "MY" when NULL
+	BOOL machine_store;                 // LOCAL_MACHINE instead of CURRENT_USER
+	const void *certificate;            // PCCERT_CONTEXT used instead of the lookup
+	u_long handshake_timeout;           // ms, 0 selects 10 s
+
+	// Resumption. Sessions are cached by SChannel; with tickets the state
+	// travels with the client instead, sealed with keys the server rotates.
+	u_long session_lifespan;            // ms a cached session stays resumable, 0 selects the system default
+	BOOL session_tickets;
+	u_long ticket_key_rotation;         // ms a ticket key issues tickets, 0 selects 12 h
+} qs_tls_params;
+
+// A listening socket. All listeners of a server share its worker pool.
+typedef struct _qs_listener {
+	char *listen_adr;
+	u_long init_accepts_count;          // AcceptEx() calls kept pending
+
+	// Frames may not be larger than the connection buffer.
+	struct _framing {
+		qs_framing_type type;
+		u_long header_size;         // fixed: header bytes, the length field included
+		u_long length_offset;       // fixed: offset of the length field in the header
+		u_long length_size;         // fixed: 1, 2 or 4 bytes
+		BOOL big_endian;            // fixed: byte order of the length field
+		long length_adjustment;     // fixed: added to the field to get the payload length
+		char delimiter[4];          // delimiter: the sequence ending a frame
+		u_long delimiter_len;
+	} framing;
+
+	BOOL ipv6_only;                     // IPv6 addresses, a bare port included, refuse IPv4 clients
+	u_long connection_buffer_size;      // 0 selects params.connection_buffer_size
+	const qs_callbacks *callbacks;      // NULL members fall back to params.callbacks
+	const qs_tls_params *tls;           // NULL for plain connections
+} qs_listener;
 
 typedef struct _qs_params {
-	struct _listener {
-		char *listen_adr;
-		u_long init_accepts_count;
-	} listener;
+	qs_listener listener;               // used when listeners_count is 0
+	qs_listener *listeners;             // otherwise all listeners, indexed by connection->listener_id
+	u_long listeners_count;
 
 	unsigned int worker_threads_count;
+
+	// Optional worker pool scaling. Disabled when max_worker_threads is 0,
+	// otherwise worker_threads_count is the initial pool size.
+	struct _scaling {
+		unsigned int min_worker_threads;
+		unsigned int max_worker_threads;
+		u_long period;                  // ms between controller decisions
+		u_long queue_delay_threshold;   // us a completion may wait before a worker is added
+	} scaling;
+
+	// Optional listener serving the statistics in Prometheus text format
+	// from its own thread. Disabled when listen_adr is NULL.
+	struct _metrics {
+		char *listen_adr;
+	} metrics;
+
 	u_long connection_buffer_size;
+	BOOL receive_ring;                  // receive into a mirrored ring, see qs_recv_consume()
 	u_long keep_alive_time;
 	u_long keep_alive_interval;
 	unsigned int connections_idle_timeout;
 	size_t max_count_of_connections;
+	u_long error_reports_per_second;    // limit of formatted on_error reports, 0 selects the default
+
+	// Backpressure, 0 disables a limit. A qs_recv() of a connection over its
+	// send limits is held until its sends drain, broadcast sends which would
+	// exceed them are dropped; accepts and new send queues wait for buffer memory.
+	struct _limits {
+		u_long connection_send_bytes;   // queued and in-flight send bytes of one connection
+		ULONGLONG send_bytes;           // of all connections
+		ULONGLONG buffer_memory;        // connection buffers, receive rings, send queues and TLS buffers
+	} limits;
 
-	struct _callbacks {
-		ON_CONNECT_PROC               on_connect;
-		ON_DISCONNECT_PROC            on_disconnect;
-		ON_SEND_PROC                  on_send;
-		ON_SENDFILE_PROC              on_send_file;
-		ON_RECV_PROC                  on_recv;
-		ON_ERROR_PROC                 on_error;
-		USERMESSAGE_HANDLER_PROC	  on_message;
-	} callbacks;
+	qs_callbacks callbacks;
 } qs_params;
 
+// Counters kept by every worker thread.
+typedef struct _qs_worker_stats {
+	ULONGLONG completions;
+	ULONGLONG bytes_received;
+	ULONGLONG bytes_sent;
+	ULONGLONG accepts;
+	ULONGLONG connects;                      // outbound connections established
+	ULONGLONG tls_handshakes;                // completed TLS handshakes
+	ULONGLONG tls_session_hits;              // of those resumed from the session cache or a ticket
+	ULONGLONG tls_session_misses;            // and full handshakes
+	ULONGLONG disconnects;
+	ULONGLONG reads_held;                    // qs_recv() calls held back by params.limits
+	ULONGLONG sends_dropped;                 // broadcast sends dropped by params.limits
+	ULONGLONG callbacks_time;                // us spent dispatching completions
+	ULONGLONG errors[qs_error_types_count];
+} qs_worker_stats;
+
+typedef struct _qs_worker_info {
+	BOOL running;
+	qs_worker_stats stats;
+} qs_worker_info;
+
+// Latency distributions recorded by the worker threads, in microseconds.
+typedef enum _qs_histogram_type {
+	qs_histogram_dispatch,          // completion dequeued -> callback entered
+	qs_histogram_on_connect,        // callback durations
+	qs_histogram_on_disconnect,
+	qs_histogram_on_recv,
+	qs_histogram_on_send,
+	qs_histogram_on_send_file,
+	qs_histogram_on_message,
+	qs_histogram_recv_in_flight,    // WSARecv() posted -> completed
+	qs_histogram_send_in_flight,    // WSASend(), TransmitFile() posted -> completed
+	qs_histogram_turnaround,        // receive completed -> next send completed on the connection
+	qs_histogram_types_count
+} qs_histogram_type;
+
+typedef struct _qs_histogram {
+	ULONGLONG count;
+	ULONGLONG min;
+	ULONGLONG max;
+	ULONGLONG mean;
+	ULONGLONG p50;
+	ULONGLONG p90;
+	ULONGLONG p99;
+	ULONGLONG p999;
+	ULONGLONG p9999;
+} qs_histogram;
+
+// Events of the per-worker trace rings.
+typedef enum _qs_trace_event_type {
+	qs_trace_accept,
+	qs_trace_recv_complete,     // value: bytes
+	qs_trace_callback_enter,    // value: qs_histogram_type of the callback
+	qs_trace_callback_exit,     // value: qs_histogram_type of the callback
+	qs_trace_send_post,         // value: bytes
+	qs_trace_send_complete,     // value: bytes
+	qs_trace_disconnect
+} qs_trace_event_type;
+
+#define QS_TRACE_EXTERNAL_WORKER 0xFFFF
+
+typedef struct _qs_trace_event {
+	ULONGLONG timestamp;        // us since qs_start
+	u_long connection_id;
+	u_long value;
+	unsigned short type;        // qs_trace_event_type
+	unsigned short worker;      // worker index, QS_TRACE_EXTERNAL_WORKER for other threads
+} qs_trace_event;
+
 typedef struct _qs_info {
 	volatile u_long sockets_count;
 	volatile u_long active_connections_count;
+
+	// Worker pool controller state
+	volatile u_long worker_threads_count;
+	volatile u_long workers_added;
+	volatile u_long workers_retired;
+	volatile u_long queue_delay;            // us, last measured completion queue wait
+	volatile u_long queue_depth;            // estimated completions waiting in the port
+	volatile u_long callbacks_load;         // percent of worker time spent in callbacks
+	volatile u_long completions_per_second;
+
+	// Upstream pools, see qs_upstream_acquire()
+	volatile u_long upstream_hits;          // checkouts served by an idle connection
+	volatile u_long upstream_misses;        // checkouts which opened a new connection
+	volatile u_long upstream_evictions;     // idle connections closed by timeout or health check
+
+	// Backpressure, see params.limits
+	volatile LONGLONG send_bytes;           // queued and in-flight send bytes
+	volatile LONGLONG buffer_memory;        // buffer bytes of the connections
+
+	// Sum of the per-worker counters, aggregated by qs_query_qs_information
+	qs_worker_stats totals;
 } qs_info;
 
+// Limits of an upstream pool, see qs_upstream_create().
+typedef struct _qs_upstream_params {
+	u_long max_active;          // connections of the pool including idle ones, 0 for no limit
+	u_long max_idle;            // idle connections kept for reuse
+	u_long idle_timeout;        // ms an idle connection is kept, 0 for no limit
+	u_long connect_timeout;     // ms, see qs_connect()
+} qs_upstream_params;
+
+// UDP endpoint, see qs_udp_open().
+typedef struct _qs_udp_params {
+	u_long recv_depth;          // receives kept posted, 0 selects 16
+	u_long buffer_size;         // bytes per receive and per send call, 0 selects 2048, 65535 with coalesce
+	u_long socket_buffer;       // SO_RCVBUF and SO_SNDBUF, 0 keeps the system default
+	BOOL coalesce;              // receive coalescing and send segmentation offload where available
+	ON_DATAGRAM_PROC on_datagram;
+	void *user_data;
+} qs_udp_params;
+
 // Server functions.
 MYDLL_API u_long        qs_create(void **qs_instance );
 MYDLL_API void		    qs_delete(void *qs_instance );
@@ -93,11 +329,42 @@ MYDLL_API unsigned int  qs_start( void *qs_instance, qs_params * params );
 MYDLL_API unsigned int  qs_stop( void *qs_instance );
 MYDLL_API unsigned int  qs_send(connection *connection);
 MYDLL_API unsigned int  qs_send_file( void *qs_instance, connection *connection, HANDLE file);
+MYDLL_API unsigned int  qs_send_append(connection *connection, const char *data, u_long len);
+MYDLL_API unsigned int  qs_send_append_ref(connection *connection, const char *data, u_long len);
+MYDLL_API char*         qs_send_reserve(connection *connection, u_long *available);
+MYDLL_API unsigned int  qs_send_commit(connection *connection, u_long len);
+MYDLL_API unsigned int  qs_send_flush(connection *connection);
 MYDLL_API unsigned int  qs_recv(connection *connection);
+MYDLL_API unsigned int  qs_recv_append(connection *connection, u_long offset);
+MYDLL_API char*         qs_buffer_base(connection *connection, u_long *size);
+MYDLL_API unsigned int  qs_recv_consume(connection *connection, u_long bytes);
+MYDLL_API unsigned int  qs_connect( void *qs_instance, const char *address, u_long timeout, void *user_data );
 MYDLL_API unsigned int  qs_close_connection( void *qs_instance, connection *connection );
+MYDLL_API unsigned int  qs_proxy( connection *client, connection *upstream );
+MYDLL_API void*         qs_udp_open( void *qs_instance, const char *address, const qs_udp_params *params );
+MYDLL_API unsigned int  qs_udp_send( void *endpoint, const union usa *to, const char *data, u_long len );
+MYDLL_API unsigned int  qs_udp_send_batch( void *endpoint, const union usa *to, const char *data, u_long segment_size, u_long count );
+MYDLL_API unsigned int  qs_udp_close( void *qs_instance, void *endpoint );
+MYDLL_API unsigned int  qs_proxy_bytes( connection *connection, ULONGLONG *received, ULONGLONG *sent );
+MYDLL_API void*         qs_upstream_create( void *qs_instance, const char *address, const qs_upstream_params *params );
+MYDLL_API unsigned int  qs_upstream_acquire( void *upstream, void *user_data, connection **connection );
+MYDLL_API unsigned int  qs_upstream_release( connection *connection, BOOL reuse );
 MYDLL_API unsigned int  qs_post_message_to_pool(void *qs_instance, void *message, connection *connection);
 MYDLL_API unsigned int  qs_query_qs_information( void *qs_instance, qs_info *qs_information );
+MYDLL_API unsigned int  qs_query_worker_information( void *qs_instance, unsigned int worker_index, qs_worker_info *worker_information );
+MYDLL_API unsigned int  qs_query_histogram( void *qs_instance, qs_histogram_type type, qs_histogram *histogram );
+MYDLL_API unsigned int  qs_reset_histograms( void *qs_instance );
+MYDLL_API unsigned int  qs_trace_snapshot( void *qs_instance, qs_trace_event *events, u_long *events_count );
+MYDLL_API unsigned int  qs_trace_write_chrome( const qs_trace_event *events, u_long events_count, HANDLE file );
 MYDLL_API unsigned int  qs_enum_connections( void *qs_instance, ENUM_CONNECTIONS_PROC enum_connections_proc);
+MYDLL_API qs_payload*   qs_payload_create(const char *data, u_long len);
+MYDLL_API char*         qs_payload_data(qs_payload *payload);
+MYDLL_API void          qs_payload_release(qs_payload *payload);
+MYDLL_API unsigned int  qs_broadcast( void *qs_instance, qs_payload *payload, u_long group, BROADCAST_FILTER_PROC filter, void *arg );
+MYDLL_API unsigned int  qs_group_join(connection *connection, u_long group);
+MYDLL_API unsigned int  qs_group_leave(connection *connection, u_long group);
+MYDLL_API unsigned int  qs_group_enum( void *qs_instance, u_long group, ENUM_CONNECTIONS_PROC enum_connections_proc, u_long *members_count );
+MYDLL_API const char*   qs_get_date( void *qs_instance );
 MYDLL_API void			sockaddr_to_string(char *buf, size_t len, const union usa *usa) ;
 MYDLL_API void*         qs_memory_alloc(size_t size);
 MYDLL_API void          qs_memory_free(void *p);
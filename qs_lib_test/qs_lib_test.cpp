@@ -1,5 +1,6 @@
 #include "stdafx.h"
 #include "qs_lib.h"
+#include "qs_http.h"
 
 #define BUF_SIZE 1024 * 1024
 
@@ -7,8 +8,8 @@
 static void *server;
 
 typedef struct test_struct {
-	int num;
-	bool flag;
+	qs_http_parser parser;
+	int responses;
 } test_struct;
 
 static BOOL on_connect1( connection *connection )
@@ -17,11 +18,10 @@ static BOOL on_connect1( connection *connection )
 	sockaddr_to_string(buf1, sizeof(buf1), &connection->socket.rsa); 
 	printf("connection from: %s\n", buf1);
 	test_struct *data = (test_struct *)qs_memory_alloc(sizeof(test_struct));
-	data->flag = true;
-	data->num = 50;
+	qs_http_parser_init(&data->parser);
+	data->responses = 0;
 	connection->user_data = data;
-	connection->buffer.data_len = BUF_SIZE;
-	if(qs_recv(connection) != 0)
+	if(qs_http_recv(&data->parser, connection) != 0)
 	{
 		qs_close_connection(server, connection);
 	}
@@ -34,12 +34,14 @@ static void on_disconnect1( connection *connection )
 
 	sockaddr_to_string(buf, sizeof(buf), &connection->socket.rsa); 
 	printf("%s disconnect\n", buf);
+	qs_memory_free(connection->user_data);
 }
 
-static BOOL on_recv( connection *connection)
+// Queues the response, all responses of one receive leave in a single send
+static BOOL on_request( connection *connection, qs_http_request *request, void *arg)
 {
-	test_struct *data = (test_struct *)connection->user_data;
-	char *html = "<!DOCTYPE html>\n"
+	test_struct *data = (test_struct *)arg;
+	static const char html[] = "<!DOCTYPE html>\n"
 		"<html>"
 		"<head>"
 		"<meta charset=\"utf-8\" />"
@@ -49,17 +51,27 @@ static BOOL on_recv( connection *connection)
 		"<center><h1>Server is work</h1></center>"
 		"</body>"
 		"</html>";
+	qs_http_response response;
+
+	if(!qs_http_response_reserve(&response, connection)) return FALSE;
+	qs_http_write_status(&response, server, 200, qs_http_text_html, request->keep_alive);
+	qs_http_write_body(&response, html, sizeof(html) - 1);
+	if(qs_http_response_commit(&response, connection) != 0) return FALSE;
+	data->responses++;
+	return TRUE;
+}
 
-	char *response = "HTTP/1.1 200 OK\r\n"
-		"Content-Type: text/html; charset=utf-8\r\n"
-		//"Connection: close\r\n"
-		"Content-Length: %d\r\n\r\n";
-
-	sprintf((char *)connection->buffer.buf, response, (u_int)strlen(html));
-	strcat((char *)connection->buffer.buf, html);
-	connection->buffer.data_len = (u_long)strlen((char *)connection->buffer.buf);
+static BOOL on_recv( connection *connection)
+{
+	test_struct *data = (test_struct *)connection->user_data;
 
-	if (qs_send(connection) != 0)
+	data->responses = 0;
+	if(qs_http_on_recv(&data->parser, connection, on_request, data) != qs_http_ok)
+	{
+		qs_close_connection(server, connection);
+	}
+	// Without a complete request nothing is sent, receive the rest
+	else if(!data->responses && qs_http_recv(&data->parser, connection) != 0)
 	{
 		qs_close_connection(server, connection);
 	}
@@ -68,8 +80,8 @@ static BOOL on_recv( connection *connection)
 
 static BOOL on_send( connection *connection)
 {
-	connection->buffer.data_len = BUF_SIZE;
-	if(qs_recv(connection)!=0)
+	test_struct *data = (test_struct *)connection->user_data;
+	if(qs_http_recv(&data->parser, connection) != 0)
 	{
 		qs_close_connection(server, connection);
 	}